@@ -40,10 +40,21 @@ bool mgos_bt_gap_get_pairing_enable(void);
 bool mgos_bt_gap_set_pairing_enable(bool pairing_enable);
 
 int mgos_bt_gap_get_num_paired_devices(void);
+
 /*
- * These are actually async. TODO(rojer): Add callbacks to the API.
- * For now, just allow some time for the calls to complete.
+ * Removal of paired devices is asynchronous, callback is invoked on the mgos
+ * task when the stack has completed the request, or with ok = false if it
+ * has not done so within 5 seconds. If false is returned, the request was
+ * not submitted and callback will not be invoked.
  */
+typedef void (*mgos_bt_gap_remove_paired_cb_t)(bool ok, void *cb_arg);
+bool mgos_bt_gap_remove_paired_device_async(const esp_bd_addr_t addr,
+                                            mgos_bt_gap_remove_paired_cb_t cb,
+                                            void *cb_arg);
+bool mgos_bt_gap_remove_all_paired_devices_async(
+    mgos_bt_gap_remove_paired_cb_t cb, void *cb_arg);
+
+/* Same as above, without completion callbacks. */
 void mgos_bt_gap_remove_paired_device(const esp_bd_addr_t addr);
 void mgos_bt_gap_remove_all_paired_devices(void);
 
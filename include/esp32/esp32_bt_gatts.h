@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "esp_gatt_defs.h"
+#include "esp_gatts_api.h"
+
+#include "mgos_bt_gatts.h"
+
+#include "esp32_bt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Static service tables.
+ *
+ * Services can be declared as const attribute tables, which are placed in
+ * flash. Registering such a service only allocates a small block holding
+ * attribute handles, no parsing or copying is done at runtime.
+ *
+ * The table only holds pointers, so UUIDs and characteristic properties are
+ * defined as named objects first, with the *_DEF macros below; this works
+ * in both C and C++. UUIDs are binary: 16-bit values or 16 bytes of a
+ * 128-bit UUID in little-endian order (reverse of the string form).
+ *
+ * Permissions are ESP_GATT_PERM_* bits and are used as is: unlike services
+ * registered with mgos_bt_gatts_register_service(), neither sec_level nor
+ * bt.gatts.min_sec_level is applied to them. Both still apply to the link,
+ * encryption is requested on connect. Use the *_ENCRYPTED or *_ENC_MITM
+ * permissions to protect the attributes themselves.
+ * Example:
+ *
+ *   ESP32_BT_GATTS_UUID16_DEF(s_my_svc_uuid, 0x1234);
+ *   ESP32_BT_GATTS_UUID16_DEF(s_my_char_uuid, 0x5678);
+ *   ESP32_BT_GATTS_PROP_DEF(s_my_char_prop, ESP_GATT_CHAR_PROP_BIT_READ |
+ *                                               ESP_GATT_CHAR_PROP_BIT_NOTIFY);
+ *   static const esp_gatts_attr_db_t s_my_svc[] = {
+ *       ESP32_BT_GATTS_SVC_UUID16(s_my_svc_uuid, ESP_GATT_PERM_READ),
+ *       ESP32_BT_GATTS_CHAR_DECL(s_my_char_prop, ESP_GATT_PERM_READ),
+ *       ESP32_BT_GATTS_CHAR_VAL_UUID16(s_my_char_uuid, ESP_GATT_PERM_READ),
+ *       ESP32_BT_GATTS_CCCD(ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE),
+ *   };
+ *   mgos_bt_gatts_register_service_static(
+ *       s_my_svc, ARRAY_SIZE(s_my_svc), NULL, MGOS_BT_GATT_SEC_LEVEL_NONE,
+ *       my_svc_ev, NULL);
+ */
+#define ESP32_BT_GATTS_UUID16_DEF(name, uuid16) \
+  static const uint16_t name = (uuid16)
+
+#define ESP32_BT_GATTS_UUID128_DEF(name, ...) \
+  static const uint8_t name[ESP_UUID_LEN_128] = {__VA_ARGS__}
+
+/* prop is ESP_GATT_CHAR_PROP_BIT_*. */
+#define ESP32_BT_GATTS_PROP_DEF(name, prop) static const uint8_t name = (prop)
+
+#define ESP32_BT_GATTS_ATTR_(rsp, uuid_len, uuid_p, perm, len, value) \
+  {                                                                   \
+    {(rsp)}, {                                                        \
+      (uuid_len), (uint8_t *) (uuid_p), (perm), (len), (len),         \
+          (uint8_t *) (value)                                         \
+    }                                                                 \
+  }
+
+#define ESP32_BT_GATTS_SVC_UUID16(uuid16, perm)                        \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16,             \
+                       &primary_service_uuid, (perm), ESP_UUID_LEN_16, \
+                       &(uuid16))
+
+#define ESP32_BT_GATTS_SVC_UUID128(uuid128, perm)                       \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16,              \
+                       &primary_service_uuid, (perm), ESP_UUID_LEN_128, \
+                       (uuid128))
+
+/* Characteristic declaration. */
+#define ESP32_BT_GATTS_CHAR_DECL(prop, perm)                                \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_AUTO_RSP, ESP_UUID_LEN_16, &char_decl_uuid, \
+                       (perm), 1, &(prop))
+
+/* Characteristic value, reads and writes go to the event handler. */
+#define ESP32_BT_GATTS_CHAR_VAL_UUID16(uuid16, perm)         \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_16, \
+                       &(uuid16), (perm), 0, NULL)
+
+#define ESP32_BT_GATTS_CHAR_VAL_UUID128(uuid128, perm)        \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_128, \
+                       (uuid128), (perm), 0, NULL)
+
+/* Client characteristic configuration descriptor, must follow the value. */
+#define ESP32_BT_GATTS_CCCD(perm)                            \
+  ESP32_BT_GATTS_ATTR_(ESP_GATT_RSP_BY_APP, ESP_UUID_LEN_16, \
+                       &char_client_config_uuid, (perm), 0, NULL)
+
+/* Standard UUIDs the table macros point to. */
+extern const uint16_t primary_service_uuid;
+extern const uint16_t char_decl_uuid;
+extern const uint16_t char_client_config_uuid;
+
+/* Per-attribute settings, indexed like the attribute table. */
+struct esp32_bt_gatts_attr_info {
+  /* If NULL, service handler will be used. */
+  mgos_bt_gatts_ev_handler_t handler;
+  void *handler_arg;
+  enum mgos_bt_gatts_notify_qmode notify_qmode;
+  bool stream_prepared_writes;
+};
+
+/*
+ * Register a service declared as a static table. First entry must be the
+ * primary service declaration. attr_db and attr_info must remain valid
+ * forever. attr_info is optional; if NULL, all the events go to `handler`
+ * and notifications use MGOS_BT_GATTS_NOTIFY_QMODE_ALL.
+ */
+bool mgos_bt_gatts_register_service_static(
+    const esp_gatts_attr_db_t *attr_db, uint16_t num_attrs,
+    const struct esp32_bt_gatts_attr_info *attr_info,
+    enum mgos_bt_gatt_sec_level sec_level, mgos_bt_gatts_ev_handler_t handler,
+    void *handler_arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -27,14 +27,51 @@
 extern "C" {
 #endif
 
+/*
+ * Connection tables are indexed by conn_id, which Bluedroid allocates
+ * from a small range bounded by the number of ACL links.
+ */
+#ifdef CONFIG_BT_ACL_CONNECTIONS
+#define ESP32_BT_MAX_CONNS CONFIG_BT_ACL_CONNECTIONS
+#else
+#define ESP32_BT_MAX_CONNS 4
+#endif
+
+/* Buckets of the per-address connection hash. Must be a power of 2. */
+#define ESP32_BT_ADDR_HASH_SIZE 8
+
+unsigned int esp32_bt_addr_hash(const esp_bd_addr_t addr);
+
 enum cs_log_level ll_from_status(esp_bt_status_t status);
 
 bool esp32_bt_is_scanning(void);
 bool esp32_bt_gattc_init(void);
 
+/*
+ * Scan time-slicing, to let GATT client operations use the radio.
+ * esp32_bt_gap_scan_pause() returns true if radio is available right away
+ * (not scanning or scan is already paused), otherwise it begins pausing the
+ * scan and returns false; esp32_bt_gattc_radio_free() will be called
+ * on the BT task when the scan has stopped.
+ */
+bool esp32_bt_gap_scan_pause(void);
+void esp32_bt_gap_scan_resume(void);
+void esp32_bt_gattc_radio_free(void);
+
 bool esp32_bt_gap_init(void);
+bool esp32_bt_gap_is_paired(const esp_bd_addr_t addr);
+
+/* Removes cached attribute database of the peer, if any. */
+void esp32_bt_gattc_cache_invalidate(const esp_bd_addr_t addr);
+
 bool esp32_bt_gatts_init(void);
 void esp32_bt_gatts_auth_cmpl(const esp_bd_addr_t addr, bool success);
+void esp32_bt_gatts_conn_params_updated(const esp_bd_addr_t addr, bool ok,
+                                        uint16_t conn_int, uint16_t latency,
+                                        uint16_t timeout);
+void esp32_bt_gattc_conn_params_updated(const esp_bd_addr_t addr,
+                                        uint16_t conn_int, uint16_t latency,
+                                        uint16_t timeout);
 
 void esp32_bt_set_is_advertising(bool is_advertising);
 
@@ -42,6 +79,7 @@ void esp32_bt_set_is_advertising(bool is_advertising);
 bool esp32_bt_wipe_config(void);
 
 esp_gatt_status_t esp32_bt_gatt_get_status(enum mgos_bt_gatt_status st);
+enum mgos_bt_gatt_status esp32_bt_gatt_status_from_esp(esp_gatt_status_t st);
 
 #ifdef __cplusplus
 }
@@ -72,6 +72,16 @@ bool mgos_bt_uuid_from_str(const struct mg_str str, struct mgos_bt_uuid *uuid);
 int mgos_bt_uuid_cmp(const struct mgos_bt_uuid *a,
                      const struct mgos_bt_uuid *b);
 
+/*
+ * Schedule an event to be triggered on the mgos task.
+ * Event data is copied, along with any data referenced by the mg_str fields
+ * of the BT events that carry them (scan results, GATTC read results and
+ * notifications), so caller does not need to make copies.
+ * Does not allocate memory; if the event queue is full, the event is dropped.
+ * Scan results and notifications are dropped earlier, to leave room for
+ * the events that must not be lost, see mgos_bt_sched_reserve().
+ * Must be called from the BT stack task.
+ */
 void mgos_event_trigger_schedule(int ev, const void *ev_data, size_t data_len);
 
 #ifdef __cplusplus
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Dense table of fixed-size per-attribute entries, indexed by
+ * (handle - start). Attribute handles are allocated sequentially, so a table
+ * covering all the registered services is compact and lookups are O(1).
+ * Entries start zeroed; what constitutes an empty entry is up to the user.
+ */
+struct mgos_bt_attr_tab {
+  uint8_t *entries;
+  size_t entry_size;
+  uint16_t start; /* Handle of the first entry. */
+  uint32_t len;   /* Number of entries, up to 0x10000. */
+};
+
+void mgos_bt_attr_tab_init(struct mgos_bt_attr_tab *t, size_t entry_size);
+
+/*
+ * Grow the table to cover handles [min_handle, max_handle].
+ * Existing entries are kept, new ones are zeroed. Entry pointers obtained
+ * before the call are invalidated if the table is reallocated.
+ */
+bool mgos_bt_attr_tab_extend(struct mgos_bt_attr_tab *t, uint16_t min_handle,
+                             uint16_t max_handle);
+
+/* Returns the entry for the handle or NULL if not covered by the table. */
+void *mgos_bt_attr_tab_get(const struct mgos_bt_attr_tab *t, uint16_t handle);
+
+void mgos_bt_attr_tab_free(struct mgos_bt_attr_tab *t);
+
+#ifdef __cplusplus
+}
+#endif
@@ -36,9 +36,75 @@ enum mgos_bt_gap_event {
   MGOS_BT_GAP_EVENT_SCAN_STOP, /* NULL */
 };
 
+/*
+ * Scan filter. Reports that do not pass the filter are dropped as soon as
+ * they are received from the controller and never reach event handlers.
+ * Each non-empty criterion must match for a report to be accepted;
+ * within a list, any element may match.
+ */
+struct mgos_bt_gap_scan_filter {
+  /* Service UUIDs, advertised in complete or incomplete service lists. */
+  const struct mgos_bt_uuid *svc_uuids;
+  int num_svc_uuids;
+  /* Company IDs of the manufacturer-specific data. */
+  const uint16_t *mfr_ids;
+  int num_mfr_ids;
+  /* Prefix of the full or short name. */
+  const char *name_prefix;
+  /* Device addresses. Address type is not compared. */
+  const struct mgos_bt_addr *addrs;
+  int num_addrs;
+  /* Minimum RSSI, 0 - any. */
+  int min_rssi;
+};
+
+/* Scan duty cycle presets, trading power for detection latency. */
+enum mgos_bt_gap_scan_duty {
+  MGOS_BT_GAP_SCAN_DUTY_DEFAULT = 0,
+  MGOS_BT_GAP_SCAN_DUTY_LOW_POWER = 1,   /* 10% */
+  MGOS_BT_GAP_SCAN_DUTY_BALANCED = 2,    /* 50% */
+  MGOS_BT_GAP_SCAN_DUTY_LOW_LATENCY = 3, /* 100% */
+};
+
 struct mgos_bt_gap_scan_opts {
   int duration_ms;
   bool active;
+  /* Scan until mgos_bt_gap_scan_stop() is called, duration_ms is ignored. */
+  bool continuous;
+  /*
+   * Scan interval and window, in ms. If not set, taken from the duty profile.
+   * Window must not exceed interval. Both are rounded to 0.625 ms units.
+   */
+  int interval_ms;
+  int window_ms;
+  enum mgos_bt_gap_scan_duty duty;
+  /* Optional, copied when the scan is started. */
+  const struct mgos_bt_gap_scan_filter *filter;
+  /*
+   * Duplicate suppression. If dedup_cache_size > 0, recently seen reports
+   * (same address and content) are remembered and repeats are dropped unless
+   * RSSI changed by more than dedup_rssi_delta or dedup_ttl_ms has passed
+   * since the report was last passed on (0 - never).
+   * Cache is allocated when the scan is started; when it is full,
+   * the least recently passed on entries are replaced.
+   */
+  int dedup_cache_size;
+  int dedup_rssi_delta;
+  int dedup_ttl_ms;
+};
+
+struct mgos_bt_gap_scan_stats {
+  uint32_t num_accepted; /* Reports passed to the handlers. */
+  uint32_t num_rejected; /* Reports dropped by the filter. */
+  uint32_t num_dups;     /* Reports dropped as duplicates. */
+  uint32_t num_restarts; /* Times continuous scan was restarted. */
+  float duty_cfg;        /* Configured scan duty cycle, window / interval. */
+  /* Achieved: configured, less the time paused or restarting the scan. */
+  float duty;
+  float reports_per_sec; /* All reports received, including dropped. */
+  /* Scan pauses to let GATT client operations through. */
+  uint32_t num_pauses;
+  uint32_t paused_ms; /* Total time spent paused, i.e. not scanning. */
 };
 
 // https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
@@ -60,6 +126,57 @@ enum mgos_bt_gap_eir_type {
   MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA = 0xff,
 };
 
+/*
+ * Index of the AD structures in advertisement data and scan response,
+ * built in a single pass. Data is not copied, index refers to the original
+ * buffers, which must remain valid while the index is used.
+ * Entries are in the order they appear, advertisement data first,
+ * repeated types get an entry each.
+ */
+#define MGOS_BT_ADV_INDEX_MAX_ENTRIES                                \
+  ((MGOS_BT_GAP_ADV_DATA_MAX_LEN + MGOS_BT_GAP_SCAN_RSP_MAX_LEN) / 2)
+#define MGOS_BT_ADV_INDEX_SCAN_RSP 0x80 /* Entry is in the scan response. */
+
+struct mgos_bt_adv_index_entry {
+  uint8_t type;
+  uint8_t off; /* Offset of the data, ORed with MGOS_BT_ADV_INDEX_SCAN_RSP. */
+  uint8_t len; /* Length of the data, not including type. */
+};
+
+struct mgos_bt_adv_index {
+  const uint8_t *adv_data;
+  const uint8_t *scan_rsp;
+  uint8_t num_entries;
+  struct mgos_bt_adv_index_entry entries[MGOS_BT_ADV_INDEX_MAX_ENTRIES];
+};
+
+/*
+ * Build the index. Either of the buffers can be empty.
+ * Malformed or excess structures, as well as anything beyond
+ * 127 bytes into each buffer, are ignored.
+ */
+void mgos_bt_adv_index_init(struct mgos_bt_adv_index *idx,
+                            struct mg_str adv_data, struct mg_str scan_rsp);
+
+/*
+ * Find data of the next AD structure of type `t`, starting at entry `*pos`
+ * (start with 0). On success, `*pos` is advanced past the found entry,
+ * so the call can be repeated to iterate over repeated structures.
+ * Returns MG_NULL_STR if there are no more.
+ */
+struct mg_str mgos_bt_adv_index_find(const struct mgos_bt_adv_index *idx,
+                                     enum mgos_bt_gap_eir_type t, int *pos);
+
+struct mg_str mgos_bt_adv_index_get_name(const struct mgos_bt_adv_index *idx);
+bool mgos_bt_adv_index_has_service(const struct mgos_bt_adv_index *idx,
+                                   const struct mgos_bt_uuid *svc_uuid);
+struct mg_str mgos_bt_adv_index_get_service_data(
+    const struct mgos_bt_adv_index *idx, const struct mgos_bt_uuid *svc_uuid);
+
+/*
+ * Helpers below operate on a single buffer. When looking up more than one
+ * item, it is cheaper to build an index and use the functions above.
+ */
 struct mg_str mgos_bt_gap_parse_adv_data(struct mg_str adv_data,
                                          enum mgos_bt_gap_eir_type);
 
@@ -84,6 +201,25 @@ struct mgos_bt_gap_scan_result {
 
 bool mgos_bt_gap_scan(const struct mgos_bt_gap_scan_opts *);
 
+/* Stop the scan. MGOS_BT_GAP_EVENT_SCAN_STOP will be triggered. */
+bool mgos_bt_gap_scan_stop(void);
+
+/* Stats of the current or last scan. */
+void mgos_bt_gap_get_scan_stats(struct mgos_bt_gap_scan_stats *stats);
+
+/*
+ * Returns true if the scan result passes the filter.
+ * `idx` must be the index of the result's advertisement data and scan
+ * response.
+ */
+bool mgos_bt_gap_scan_filter_match(const struct mgos_bt_gap_scan_filter *f,
+                                   const struct mgos_bt_gap_scan_result *r,
+                                   const struct mgos_bt_adv_index *idx);
+
+/* Returns a copy of the filter in a single allocation, to be free()d. */
+struct mgos_bt_gap_scan_filter *mgos_bt_gap_scan_filter_copy(
+    const struct mgos_bt_gap_scan_filter *f);
+
 #ifdef __cplusplus
 }
 #endif
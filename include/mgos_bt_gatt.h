@@ -33,6 +33,7 @@ struct mgos_bt_gatt_conn {
 #define MGOS_BT_GATT_PROP_WRITE (1 << 1)
 #define MGOS_BT_GATT_PROP_NOTIFY (1 << 2)
 #define MGOS_BT_GATT_PROP_INDICATE (1 << 3)
+#define MGOS_BT_GATT_PROP_WRITE_NR (1 << 4) /* Write without response */
 
 #define MGOS_BT_GATT_PROP_RWNI(r, w, n, i)                                    \
   (((r) ? MGOS_BT_GATT_PROP_READ : 0) | ((w) ? MGOS_BT_GATT_PROP_WRITE : 0) | \
@@ -62,6 +63,8 @@ enum mgos_bt_gatt_status {
   MGOS_BT_GATT_STATUS_INVALID_ATT_VAL_LENGTH = -8,
   MGOS_BT_GATT_STATUS_UNLIKELY_ERROR = -9,
   MGOS_BT_GATT_STATUS_INSUF_RESOURCES = -10,
+  MGOS_BT_GATT_STATUS_TIMEOUT = -11,
+  MGOS_BT_GATT_STATUS_NOT_CONNECTED = -12,
 };
 
 enum mgos_bt_gatt_notify_mode {
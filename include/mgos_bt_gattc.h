@@ -34,6 +34,7 @@ enum mgos_bt_gattc_event {
   MGOS_BT_GATTC_EV_DISCOVERY_RESULT, /* mgos_bt_gattc_discovery_result_arg */
   MGOS_BT_GATTC_EV_READ_RESULT,      /* mgos_bt_gattc_read_result */
   MGOS_BT_GATTC_EV_NOTIFY,           /* mgos_bt_gattc_notify_arg */
+  MGOS_BT_GATTC_EV_DISCOVERY_DONE,   /* mgos_bt_gattc_discovery_done_arg */
 };
 
 #define MGOS_BT_GATTC_INVALID_CONN_ID (-1)
@@ -46,6 +47,22 @@ struct mgos_bt_gattc_discovery_result_arg {
   uint8_t prop;                  /* Characteristic properties */
 };
 
+struct mgos_bt_gattc_discovery_entry {
+  struct mgos_bt_uuid svc; /* Service UUID */
+  struct mgos_bt_uuid chr; /* Characteristic UUID */
+  uint16_t handle;         /* Characteristic handle */
+  uint16_t cccd_handle;    /* Client config descriptor handle, 0 if none */
+  uint8_t prop;            /* Characteristic properties */
+};
+
+struct mgos_bt_gattc_discovery_done_arg {
+  struct mgos_bt_gatt_conn conn;   /* Device address */
+  enum mgos_bt_gatt_status status; /* Discovery status */
+  int num_entries;                 /* Number of characteristics */
+  /* Discovery table, same as mgos_bt_gattc_get_discovery_table() returns. */
+  const struct mgos_bt_gattc_discovery_entry *entries;
+};
+
 struct mgos_bt_gattc_read_result {
   struct mgos_bt_gatt_conn conn; /* Device address */
   uint16_t handle;               /* Characteristic handle  */
@@ -59,13 +76,192 @@ struct mgos_bt_gattc_notify_arg {
 };
 
 bool mgos_bt_gattc_connect(const struct mgos_bt_addr *addr);
+
+/*
+ * Connection parameters, in BLE units: intervals in 1.25 ms,
+ * supervision timeout in 10 ms.
+ */
+struct mgos_bt_gattc_conn_params {
+  uint16_t min_int;
+  uint16_t max_int;
+  uint16_t latency;
+  uint16_t timeout;
+};
+
+/*
+ * Connect with preferred connection parameters, e.g. those that were
+ * in effect on the previous connection to the same peer.
+ */
+bool mgos_bt_gattc_connect_opts(const struct mgos_bt_addr *addr,
+                                const struct mgos_bt_gattc_conn_params *cp);
+/*
+ * Failure of a connection attempt is reported (MGOS_BT_GATTC_EV_DISCONNECT
+ * with conn_id -1) at most this long after it was issued.
+ */
+#define MGOS_BT_GATTC_MAX_CONNECT_TIME_MS 35000
+/*
+ * Cancel pending connection attempt. Returns true if the attempt had not
+ * been issued yet and was dropped, no events follow. Otherwise the attempt
+ * may still be in progress and its outcome is reported as usual: a failure,
+ * or a connection that is closed right after it opens.
+ */
+bool mgos_bt_gattc_connect_cancel(const struct mgos_bt_addr *addr);
+/* Connection with the given id, if it is (still) connected. */
+bool mgos_bt_gattc_get_conn(int conn_id, struct mgos_bt_gatt_conn *conn);
+/* Parameters in effect, if they are known (have been updated). */
+bool mgos_bt_gattc_get_conn_params(int conn_id,
+                                   struct mgos_bt_gattc_conn_params *cp);
+/*
+ * Discover services and characteristics of the peer. Results are delivered
+ * as MGOS_BT_GATTC_EV_DISCOVERY_RESULT events, followed by
+ * MGOS_BT_GATTC_EV_DISCOVERY_DONE. For bonded peers results are
+ * cached on the filesystem (if bt.gattc.attr_cache is enabled, it is off
+ * by default) and subsequent discoveries are answered from the cache
+ * synchronously.
+ */
 bool mgos_bt_gattc_discover(int conn_id);
+
+/*
+ * Characteristics discovered on the connection, in one table.
+ * Table remains valid until the next discovery or disconnection.
+ * DISCOVERY_RESULT events are triggered for each entry, followed by
+ * a DISCOVERY_DONE event, when the table is ready.
+ */
+const struct mgos_bt_gattc_discovery_entry *mgos_bt_gattc_get_discovery_table(
+    int conn_id, int *num_entries);
+
+/*
+ * Discover only the given services. Results are delivered the same way as
+ * for mgos_bt_gattc_discover() and are merged into the discovery table.
+ * Partial results are not stored in the attribute cache.
+ */
+bool mgos_bt_gattc_discover_svcs(int conn_id, const struct mgos_bt_uuid *svcs,
+                                 int num_svcs);
 bool mgos_bt_gattc_disconnect(int conn_id);
 bool mgos_bt_gattc_read(int conn_id, uint16_t handle);
 bool mgos_bt_gattc_subscribe(int conn_id, uint16_t handle);
 bool mgos_bt_gattc_write(int conn_id, uint16_t handle, const void *data,
                          int len);
 
+/*
+ * Operations with completion callbacks.
+ *
+ * Reads, writes and subscriptions are queued per connection and several
+ * may be in flight at once. Callback is invoked on the mgos task exactly once
+ * for every operation that was accepted (i.e. function returned true),
+ * with status MGOS_BT_GATT_STATUS_TIMEOUT if the peer did not respond within
+ * bt.gattc.op_timeout_ms and MGOS_BT_GATT_STATUS_NOT_CONNECTED if the
+ * connection was lost. Data is only valid for the duration of the callback.
+ */
+struct mgos_bt_gattc_op_result {
+  int conn_id;
+  uint16_t handle;
+  enum mgos_bt_gatt_status status;
+  struct mg_str data; /* Data that has been read, for reads. */
+};
+
+typedef void (*mgos_bt_gattc_op_cb_t)(const struct mgos_bt_gattc_op_result *res,
+                                      void *cb_arg);
+
+bool mgos_bt_gattc_read_cb(int conn_id, uint16_t handle,
+                           mgos_bt_gattc_op_cb_t cb, void *cb_arg);
+bool mgos_bt_gattc_write_cb(int conn_id, uint16_t handle, const void *data,
+                            int len, mgos_bt_gattc_op_cb_t cb, void *cb_arg);
+bool mgos_bt_gattc_write_descr_cb(int conn_id, uint16_t handle,
+                                  const void *data, int len,
+                                  mgos_bt_gattc_op_cb_t cb, void *cb_arg);
+bool mgos_bt_gattc_subscribe_cb(int conn_id, uint16_t handle,
+                                mgos_bt_gattc_op_cb_t cb, void *cb_arg);
+
+/*
+ * Per-handle notification callbacks.
+ * Notifications and indications for handles that have callbacks are
+ * delivered only to the callbacks, not as MGOS_BT_GATTC_EV_NOTIFY events.
+ * Data is not copied to the heap and is only valid for the duration of
+ * the callback. By default callbacks run on the mgos task; with
+ * MGOS_BT_GATTC_NOTIFY_CB_BT_TASK, on the BT stack task, right as the
+ * notification arrives: such callbacks must be quick, must not block and
+ * must not call back into the BT API. Once mgos_bt_gattc_remove_notify_cb()
+ * returns, the callback is not running and will not be invoked again.
+ * Up to 4 callbacks per handle, mgos_bt_gattc_add_notify_cb() returns false
+ * beyond that. Registrations are removed when the connection is closed.
+ */
+#define MGOS_BT_GATTC_NOTIFY_CB_BT_TASK 1
+
+typedef void (*mgos_bt_gattc_notify_cb_t)(int conn_id, uint16_t handle,
+                                          bool is_notify, struct mg_str data,
+                                          void *cb_arg);
+
+bool mgos_bt_gattc_add_notify_cb(int conn_id, uint16_t handle, uint32_t flags,
+                                 mgos_bt_gattc_notify_cb_t cb, void *cb_arg);
+bool mgos_bt_gattc_remove_notify_cb(int conn_id, uint16_t handle,
+                                    mgos_bt_gattc_notify_cb_t cb,
+                                    void *cb_arg);
+
+/*
+ * Read several characteristics at once.
+ * If lengths of the values are known (lens is not NULL), a single Read
+ * Multiple request is used; all the values except the last must be of
+ * the given length, last one may be given as 0, meaning "the rest".
+ * Otherwise, or if the peer does not support Read Multiple, values are
+ * read with single reads, pipelined. Values are in the order of handles,
+ * each with its own status, and are only valid for the duration of
+ * the callback. Status is that of the first value that could not be read.
+ */
+typedef void (*mgos_bt_gattc_read_multi_cb_t)(
+    int conn_id, enum mgos_bt_gatt_status status, int num_values,
+    const struct mgos_bt_gattc_op_result *values, void *cb_arg);
+
+bool mgos_bt_gattc_read_multi(int conn_id, const uint16_t *handles,
+                              const uint16_t *lens, int num_handles,
+                              mgos_bt_gattc_read_multi_cb_t cb, void *cb_arg);
+
+/*
+ * Stream a buffer of arbitrary length to the characteristic.
+ * Data is copied and sent in chunks of (MTU - 3) bytes using writes without
+ * response, paced by the link's congestion feedback. If the characteristic
+ * is not known (from discovery) to support writes without response,
+ * write requests of up to 512 bytes are used instead; those that do not fit
+ * in the MTU are sent by the stack as long (prepared) writes.
+ * Callback is invoked once, when the whole buffer has been sent or on error.
+ */
+bool mgos_bt_gattc_write_stream(int conn_id, uint16_t handle, const void *data,
+                                size_t len, mgos_bt_gattc_op_cb_t cb,
+                                void *cb_arg);
+
+/*
+ * Lazy discovery: look up characteristic handle by UUID.
+ * If the characteristic is already known (from discovery or from the
+ * attribute cache), callback is invoked right away, otherwise only its
+ * service is discovered first. res->handle is the characteristic handle,
+ * status is MGOS_BT_GATT_STATUS_INVALID_HANDLE if there is no such
+ * characteristic.
+ */
+bool mgos_bt_gattc_resolve_char(int conn_id, const struct mgos_bt_uuid *svc,
+                                const struct mgos_bt_uuid *chr,
+                                mgos_bt_gattc_op_cb_t cb, void *cb_arg);
+
+/*
+ * Operations requested while scanning are deferred until the scan is paused,
+ * scan is resumed when they complete.
+ */
+struct mgos_bt_gattc_stats {
+  uint32_t num_ops;           /* Connect, read, write and subscribe requests. */
+  uint32_t num_deferred;      /* Requests that had to wait for scan pause. */
+  float avg_deferred_wait_ms; /* Average wait of the deferred requests. */
+  uint32_t num_completed;     /* Reads, writes and subscriptions completed. */
+  uint32_t num_timeouts;      /* Of those, timed out. */
+  uint32_t num_queue_full;    /* Times the stack pushed back. */
+  float avg_op_latency_ms;    /* Average time from request to completion. */
+  uint32_t num_cache_hits;    /* Discoveries answered from attribute cache. */
+  uint32_t num_cache_misses;  /* Discoveries that went over the air. */
+  uint32_t num_connects;      /* Connection attempts completed. */
+  uint32_t num_connect_fails; /* Of those, failed or timed out. */
+  float avg_connect_ms;       /* Average time from request to connection. */
+};
+
+void mgos_bt_gattc_get_stats(struct mgos_bt_gattc_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
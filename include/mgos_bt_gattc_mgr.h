@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "mgos_bt.h"
+#include "mgos_bt_gatt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Central connection manager.
+ *
+ * Keeps connections to a set of peers using at most bt.gattc.max_links
+ * links at a time. Peers are either kept connected or polled: connected
+ * every poll_interval_ms and disconnected once the application releases
+ * the link or max_hold_ms passes. Failed or lost connections are retried
+ * with exponential backoff. Address type and connection parameters of
+ * each peer are remembered and reused on reconnect.
+ */
+typedef void (*mgos_bt_gattc_mgr_cb_t)(const struct mgos_bt_gatt_conn *conn,
+                                       bool connected, void *cb_arg);
+
+struct mgos_bt_gattc_mgr_peer_opts {
+  int poll_interval_ms; /* 0 - keep connected. */
+  int max_hold_ms;      /* Polling: disconnect after this long, 0 - never. */
+  mgos_bt_gattc_mgr_cb_t cb;
+  void *cb_arg;
+};
+
+/*
+ * Add peer to the target set. If address type is not known
+ * (MGOS_BT_ADDR_TYPE_NONE), public and random are tried in turn.
+ */
+bool mgos_bt_gattc_mgr_add_peer(const struct mgos_bt_addr *addr,
+                                const struct mgos_bt_gattc_mgr_peer_opts *opts);
+/*
+ * Remove peer from the target set, disconnecting it if connected. Its link
+ * counts against max_links until the disconnect or cancel completes.
+ */
+bool mgos_bt_gattc_mgr_remove_peer(const struct mgos_bt_addr *addr);
+/* Polled peer: done with the link, it can be disconnected. */
+void mgos_bt_gattc_mgr_release(const struct mgos_bt_addr *addr);
+
+struct mgos_bt_gattc_mgr_stats {
+  int num_peers;           /* In the target set. */
+  int num_links;           /* Currently in use (connecting or connected). */
+  int max_links;           /* Link limit. */
+  uint32_t num_connects;   /* Successful connections. */
+  uint32_t num_failures;   /* Failed or timed out connection attempts. */
+  uint32_t num_lost;       /* Connections lost, not requested. */
+  float avg_connect_ms;    /* Average connection latency. */
+  float link_utilization;  /* Average share of links in use, 0-1. */
+};
+
+void mgos_bt_gattc_mgr_get_stats(struct mgos_bt_gattc_mgr_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -39,9 +39,32 @@ enum mgos_bt_gatts_ev {
   MGOS_BT_GATTS_EV_DISCONNECT = 5,  /* NULL */
 };
 
+/*
+ * Connection parameter profiles, in order of increasing power consumption.
+ * A connection uses the most demanding profile requested by any of its
+ * services, INTERACTIVE if none has a preference.
+ */
+enum mgos_bt_gatts_conn_profile {
+  MGOS_BT_GATTS_CONN_PROFILE_NONE = 0,        /* No preference. */
+  MGOS_BT_GATTS_CONN_PROFILE_IDLE = 1,        /* 400-500 ms, latency 4. */
+  MGOS_BT_GATTS_CONN_PROFILE_INTERACTIVE = 2, /* 60-100 ms. */
+  MGOS_BT_GATTS_CONN_PROFILE_BULK = 3,        /* 7.5-15 ms. */
+};
+
+struct mgos_bt_gatts_conn_params {
+  /* Profile in effect: changes once the peer accepts the parameters. */
+  enum mgos_bt_gatts_conn_profile profile;
+  bool update_failed; /* Last update was rejected, will be retried. */
+  uint16_t conn_int;  /* Interval in 1.25 ms units, 0 if not known yet. */
+  uint16_t latency;   /* Peripheral latency, in intervals. */
+  uint16_t timeout;   /* Supervision timeout, in 10 ms units. */
+};
+
 struct mgos_bt_gatts_conn {
   const struct mgos_bt_gatt_conn gc;
   void *user_data; /* Opaque pointer for user. */
+  /* Parameters of the connection, maintained by the library. Read-only. */
+  struct mgos_bt_gatts_conn_params params;
 };
 
 struct mgos_bt_gatts_read_arg {
@@ -52,6 +75,18 @@ struct mgos_bt_gatts_read_arg {
   uint16_t len;
 };
 
+/*
+ * Prepared (long) writes are normally buffered and delivered as a single
+ * WRITE once executed. For characteristics with stream_prepared_writes set,
+ * each chunk is delivered as it arrives, followed by a COMMIT or CANCEL.
+ */
+enum mgos_bt_gatts_write_stage {
+  MGOS_BT_GATTS_WRITE_STAGE_FULL = 0,   /* Complete value. */
+  MGOS_BT_GATTS_WRITE_STAGE_CHUNK = 1,  /* Chunk at offset, more may follow. */
+  MGOS_BT_GATTS_WRITE_STAGE_COMMIT = 2, /* All chunks received, no data. */
+  MGOS_BT_GATTS_WRITE_STAGE_CANCEL = 3, /* Discard the chunks, no data. */
+};
+
 struct mgos_bt_gatts_write_arg {
   struct mgos_bt_uuid uuid;
   uint16_t handle;
@@ -59,6 +94,7 @@ struct mgos_bt_gatts_write_arg {
   uint16_t offset;
   struct mg_str data;
   bool need_rsp;
+  enum mgos_bt_gatts_write_stage stage;
 };
 
 struct mgos_bt_gatts_notify_mode_arg {
@@ -79,6 +115,20 @@ typedef enum mgos_bt_gatt_status (*mgos_bt_gatts_ev_handler_t)(
     struct mgos_bt_gatts_conn *gsc, enum mgos_bt_gatts_ev ev, void *ev_arg,
     void *handler_arg);
 
+/*
+ * What to do with notifications for a characteristic that are queued
+ * but have not been sent yet.
+ */
+enum mgos_bt_gatts_notify_qmode {
+  /* Queue every value. When the queue is full, new values are rejected. */
+  MGOS_BT_GATTS_NOTIFY_QMODE_ALL = 0,
+  /* Only the latest value matters: a queued value is replaced in place. */
+  MGOS_BT_GATTS_NOTIFY_QMODE_LATEST = 1,
+  /* Queue every value. When the queue is full, the oldest queued value
+   * of the same characteristic is dropped to make room. */
+  MGOS_BT_GATTS_NOTIFY_QMODE_DROP_OLDEST = 2,
+};
+
 struct mgos_bt_gatts_char_def {
   const char *uuid;
   uint8_t prop;
@@ -86,6 +136,11 @@ struct mgos_bt_gatts_char_def {
    * If not provided, connection handler will be used. */
   mgos_bt_gatts_ev_handler_t handler;
   void *handler_arg;
+  enum mgos_bt_gatts_notify_qmode notify_qmode;
+  /* Deliver prepared write chunks as they arrive instead of buffering
+   * the whole value, see mgos_bt_gatts_write_stage. Value length is then
+   * not limited by the buffer size. */
+  bool stream_prepared_writes;
 };
 
 /*
@@ -111,12 +166,113 @@ void mgos_bt_gatts_send_resp_data(struct mgos_bt_gatts_conn *gsc,
                                   struct mgos_bt_gatts_read_arg *ra,
                                   struct mg_str data);
 
-void mgos_bt_gatts_notify(struct mgos_bt_gatts_conn *gsc,
+/*
+ * Queue a notification or indication. Data is copied.
+ * Up to bt.gatts.max_notify_queue_len values can be queued per connection,
+ * what happens when the limit is reached depends on the notify_qmode
+ * of the characteristic. Returns false if the value was not queued.
+ * Only the first MTU - 3 bytes of the value fit in a notification, the rest
+ * is not sent.
+ */
+bool mgos_bt_gatts_notify(struct mgos_bt_gatts_conn *gsc,
                           enum mgos_bt_gatt_notify_mode mode, uint16_t handle,
                           struct mg_str data);
 
+typedef void (*mgos_bt_gatts_free_cb_t)(void *data, void *arg);
+
+/*
+ * Same as mgos_bt_gatts_notify but takes ownership of the data instead of
+ * copying it. When no longer needed, data is released with
+ * free_cb(data.p, free_arg). This also happens if the call fails.
+ * If free_cb is NULL, data is copied.
+ */
+bool mgos_bt_gatts_notify_owned(struct mgos_bt_gatts_conn *gsc,
+                                enum mgos_bt_gatt_notify_mode mode,
+                                uint16_t handle, struct mg_str data,
+                                mgos_bt_gatts_free_cb_t free_cb,
+                                void *free_arg);
+
+/*
+ * Send a value to all the connections that have notifications or indications
+ * enabled for the characteristic. A single buffer is shared between all the
+ * connections; ownership rules are the same as for
+ * mgos_bt_gatts_notify_owned. Returns the number of connections the value
+ * was queued for.
+ */
+int mgos_bt_gatts_notify_all(uint16_t handle, struct mg_str data,
+                             mgos_bt_gatts_free_cb_t free_cb, void *free_arg);
+
+/*
+ * Store the value of a characteristic. Reads of characteristics that have
+ * a value are answered by the library, including long reads, and the handler
+ * does not receive READ events for them. A long read is served from the value
+ * as it was when the first chunk was read, even if it is updated meanwhile.
+ * Data is copied. `version` identifies the value: setting the same version
+ * again does nothing. If `notify` is true, the new value is also sent to
+ * the subscribed connections, like mgos_bt_gatts_notify_all does. Values
+ * longer than a notification can carry (MTU - 3 bytes) are notified
+ * truncated to that length; clients read the whole value with a long read.
+ */
+bool mgos_bt_gatts_set_value(uint16_t handle, struct mg_str data,
+                             uint32_t version, bool notify);
+
+/* Remove the stored value, reads will go to the handler again. */
+void mgos_bt_gatts_clear_value(uint16_t handle);
+
+/*
+ * Flow control for writes without response (MGOS_BT_GATT_PROP_WRITE_NR).
+ * There is no protocol level flow control for these, so a fast client can
+ * outrun the handler. Once credits have been granted for a characteristic,
+ * each write without response uses one, and writes that arrive with no
+ * credits left are dropped without reaching the handler. Each grant is
+ * signalled to the client by a notification on a separate credits
+ * characteristic of the same service, credits_handle (which must have
+ * MGOS_BT_GATT_PROP_NOTIFY), carrying the total number of credits granted
+ * so far, as a 32-bit little-endian value; the client may send up to
+ * (total granted - writes sent) more values. The data characteristic's
+ * own notifications are left to the application. A characteristic is
+ * always announced on the same credits characteristic, which should not be
+ * used for anything else.
+ * The client must enable notifications on the credits characteristic
+ * first: until it does, grants are rejected. The initial window is usually
+ * granted on the NOTIFY_MODE event that enables them. Returns false, with
+ * no credits granted, if the grant was rejected or the notification could
+ * not be queued.
+ */
+bool mgos_bt_gatts_write_nr_grant(struct mgos_bt_gatts_conn *gsc,
+                                  uint16_t handle, uint16_t credits_handle,
+                                  uint16_t credits);
+
+/*
+ * Request connection profile for the service's session on this connection,
+ * e.g. BULK for the duration of a transfer. NONE reverts to the service's
+ * default. Can be called from the CONNECT handler.
+ */
+bool mgos_bt_gatts_set_conn_profile(struct mgos_bt_gatts_conn *gsc,
+                                    enum mgos_bt_gatts_conn_profile profile);
+
+/* Set default connection profile of a registered service. */
+bool mgos_bt_gatts_set_service_conn_profile(
+    const char *svc_uuid, enum mgos_bt_gatts_conn_profile profile);
+
 bool mgos_bt_gatts_disconnect(struct mgos_bt_gatts_conn *gsc);
 
+struct mgos_bt_gatts_notify_stats {
+  uint32_t num_sent;      /* Notifications and indications sent. */
+  uint32_t num_congested; /* Times the stack reported congestion. */
+  uint32_t num_dropped;   /* Values dropped or replaced before sending. */
+  uint16_t queue_len;     /* Values queued but not yet sent. */
+  uint16_t num_in_flight; /* Sent but not yet confirmed. */
+  uint16_t window;        /* Current max notifications in flight. */
+  float conn_int_ms;      /* Connection interval, 0 if unknown. */
+  /* Average notifications sent per connection interval while sending. */
+  float pkts_per_conn_int;
+};
+
+/* Returns notification flow control stats for the connection. */
+bool mgos_bt_gatts_get_notify_stats(struct mgos_bt_gatts_conn *gsc,
+                                    struct mgos_bt_gatts_notify_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
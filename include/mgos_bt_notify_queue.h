@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/mg_str.h"
+#include "common/queue.h"
+
+#include "mgos_bt_gatts.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Notification payload. Shared between connections when broadcasting,
+ * released when the last reference is dropped.
+ */
+struct mgos_bt_notify_buf {
+  int refcnt;
+  struct mg_str data;
+  /* If NULL, data is stored inline, after the struct. */
+  mgos_bt_gatts_free_cb_t free_cb;
+  void *free_arg;
+};
+
+/*
+ * Returns a buffer with one reference. Without free_cb data is copied,
+ * otherwise it is owned by the buffer and released with free_cb, also if
+ * the buffer cannot be allocated.
+ */
+struct mgos_bt_notify_buf *mgos_bt_notify_buf_new(
+    struct mg_str data, mgos_bt_gatts_free_cb_t free_cb, void *free_arg);
+void mgos_bt_notify_buf_unref(struct mgos_bt_notify_buf *nb);
+
+struct mgos_bt_notify_entry {
+  uint16_t handle;
+  bool need_confirm;
+  struct mgos_bt_notify_buf *buf;
+  STAILQ_ENTRY(mgos_bt_notify_entry) next;
+};
+
+/* Releases the entry and its reference to the buffer. */
+void mgos_bt_notify_entry_free(struct mgos_bt_notify_entry *e);
+
+/*
+ * Data to send for the entry: as much of the value as fits in a single
+ * notification or indication at the given MTU (ATT header is 3 bytes).
+ */
+struct mg_str mgos_bt_notify_entry_data(const struct mgos_bt_notify_entry *e,
+                                        uint16_t mtu);
+
+/*
+ * Per-connection queue of notifications and indications not yet sent.
+ * Length is bounded, what happens when it is full depends on the qmode
+ * of the characteristic, see enum mgos_bt_gatts_notify_qmode.
+ */
+struct mgos_bt_notify_queue {
+  STAILQ_HEAD(mgos_bt_notify_entries, mgos_bt_notify_entry) entries;
+  int len;
+  uint32_t num_dropped; /* Values dropped or replaced. */
+};
+
+void mgos_bt_notify_queue_init(struct mgos_bt_notify_queue *q);
+
+/*
+ * Queue the buffer, taking a reference if it is queued.
+ * Returns false if the value was rejected because the queue is full.
+ */
+bool mgos_bt_notify_queue_push(struct mgos_bt_notify_queue *q,
+                               uint16_t handle, bool need_confirm,
+                               enum mgos_bt_gatts_notify_qmode qmode,
+                               int max_len, struct mgos_bt_notify_buf *nb);
+
+/* Removes and returns the oldest entry, NULL if the queue is empty. */
+struct mgos_bt_notify_entry *mgos_bt_notify_queue_pop(
+    struct mgos_bt_notify_queue *q);
+
+/* Frees all the entries. */
+void mgos_bt_notify_queue_clear(struct mgos_bt_notify_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mgos_system.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded single-producer, single-consumer ring buffer.
+ * Records are variable-length and stored inline, so pushing a record
+ * does not allocate. Producer and consumer may run on different tasks
+ * (and cores) without locking, as long as there is only one of each.
+ */
+struct mgos_bt_ring {
+  uint8_t *buf;
+  uint32_t size;
+  uint32_t head; /* Next write position. Only modified by the producer. */
+  uint32_t tail; /* Next read position. Only modified by the consumer. */
+  /* Producer state between reserve and commit. */
+  uint32_t res_pos;
+  uint32_t res_len;
+  bool res_wrap;
+  /* Stats. */
+  uint32_t high_water;
+  uint32_t num_pushed;
+  uint32_t num_dropped;
+};
+
+struct mgos_bt_ring_stats {
+  uint32_t size;        /* Size of the buffer, bytes. */
+  uint32_t used;        /* Currently used, bytes. */
+  uint32_t high_water;  /* Max ever used, bytes. */
+  uint32_t num_pushed;  /* Records pushed. */
+  uint32_t num_dropped; /* Records dropped due to lack of space. */
+};
+
+/* Initialize ring over the provided buffer. Size must be a multiple of 4. */
+void mgos_bt_ring_init(struct mgos_bt_ring *r, void *buf, size_t size);
+
+/*
+ * Producer side: reserve space for a record of `len` bytes.
+ * Returns pointer to the payload area or NULL if there is not enough space,
+ * in which case the drop counter is incremented.
+ * Record becomes visible to the consumer only after mgos_bt_ring_commit().
+ */
+void *mgos_bt_ring_reserve(struct mgos_bt_ring *r, size_t len);
+/* Same, but only if no more than `max_used` bytes are in use after it. */
+void *mgos_bt_ring_reserve_max(struct mgos_bt_ring *r, size_t len,
+                               size_t max_used);
+void mgos_bt_ring_commit(struct mgos_bt_ring *r);
+
+/*
+ * Consumer side: returns pointer to the oldest record and its length,
+ * or NULL if the ring is empty. The record stays valid until
+ * mgos_bt_ring_consume() is called.
+ */
+void *mgos_bt_ring_peek(struct mgos_bt_ring *r, size_t *len);
+void mgos_bt_ring_consume(struct mgos_bt_ring *r);
+
+void mgos_bt_ring_get_stats(const struct mgos_bt_ring *r,
+                            struct mgos_bt_ring_stats *stats);
+
+/*
+ * BT task -> mgos task event channel, backed by a ring.
+ *
+ * Reserves space for `len` bytes of data that will be passed to `cb`
+ * on the mgos task once committed. Data is only valid for the duration
+ * of the callback. Must only be called from the BT stack task.
+ *
+ * Control records (operation completions, connection events) must not be
+ * lost, or operations and connections get stuck. Bulk data (scan results,
+ * notifications) is reserved with mgos_bt_sched_reserve_bulk(), which
+ * fails once the ring is MGOS_BT_SCHED_BULK_MAX_PCT full, leaving the rest
+ * to control records. Drops are counted and logged, rate-limited.
+ */
+void *mgos_bt_sched_reserve(mgos_cb_t cb, size_t len);
+void *mgos_bt_sched_reserve_bulk(mgos_cb_t cb, size_t len);
+void mgos_bt_sched_commit(void);
+
+bool mgos_bt_sched_init(void);
+void mgos_bt_sched_get_stats(struct mgos_bt_ring_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,7 @@ let GATT = {
   PROP_WRITE: 2,
   PROP_NOTIFY: 4,
   PROP_INDICATE: 8,
+  PROP_WRITE_NR: 16,
 
   SEC_LEVEL_NONE: 0,
   SEC_LEVEL_AUTH: 1,
@@ -24,6 +25,8 @@ let GATT = {
   STATUS_INVALID_ATT_VAL_LENGTH: -8,
   STATUS_UNLIKELY_ERROR: -9,
   STATUS_INSUF_RESOURCES: -10,
+  STATUS_TIMEOUT: -11,
+  STATUS_NOT_CONNECTED: -12,
 
   // ## **`GATT.RWNI(r, w, n, i)`**
   // Helper for combining common char property bits.
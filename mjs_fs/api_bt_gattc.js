@@ -8,6 +8,7 @@ let GATTC = {
 
   discover: ffi('bool mgos_bt_gattc_discover(int)'),
   getDiscoveryResultArg: function(evdata) { return s2o(evdata, GATTC._drad) },
+  getDiscoveryDoneArg: function(evdata) { return s2o(evdata, GATTC._ddad) },
 
   read: ffi('bool mgos_bt_gattc_read(int, int)'),
   getReadResult: function(evdata) { return s2o(evdata, GATTC._rrd) },
@@ -25,6 +26,7 @@ let GATTC = {
   _rrd: ffi('void *mgos_bt_gattc_js_get_read_result_def(void)')(),
   _nad: ffi('void *mgos_bt_gattc_js_get_notify_arg_def(void)')(),
   _drad: ffi('void *mgos_bt_gattc_js_get_discovery_result_arg_def(void)')(),
+  _ddad: ffi('void *mgos_bt_gattc_js_get_discovery_done_arg_def(void)')(),
 };
 
 GATTC.EV_CONNECT          = GATTC.EV_GRP + 0;
@@ -32,3 +34,4 @@ GATTC.EV_DISCONNECT       = GATTC.EV_GRP + 1;
 GATTC.EV_DISCOVERY_RESULT = GATTC.EV_GRP + 2;
 GATTC.EV_READ_RESULT      = GATTC.EV_GRP + 3;
 GATTC.EV_NOTIFY           = GATTC.EV_GRP + 4;
+GATTC.EV_DISCOVERY_DONE   = GATTC.EV_GRP + 5;
@@ -48,7 +48,7 @@ let GATTS = {
   },
 
   notify: function(c, mode, handle, data) {
-    GATTS._ntfy(c._c, mode, handle, data);
+    return GATTS._ntfy(c._c, mode, handle, data);
   },
 
   _cd: ffi('void *mgos_bt_gatt_js_get_conn_def(void)')(),
@@ -59,5 +59,5 @@ let GATTS = {
   _fch: ffi('void mgos_bt_gatts_js_free_chars(void *)'),
   _rs: ffi('bool mgos_bt_gatts_register_service(char *, int, void *, int (*)(void *, int, void *, userdata), userdata)'),
   _srd: ffi('void mgos_bt_gatts_send_resp_data_js(void *, void *, struct mg_str *)'),
-  _ntfy: ffi('void mgos_bt_gatts_notify_js(void *, int, int, struct mg_str *)'),
+  _ntfy: ffi('bool mgos_bt_gatts_notify_js(void *, int, int, struct mg_str *)'),
 };
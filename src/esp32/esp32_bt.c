@@ -31,6 +31,7 @@
 
 #include "common/mg_str.h"
 
+#include "mgos_bt_ring.h"
 #include "mgos_hal.h"
 #include "mgos_net.h"
 #include "mgos_sys_config.h"
@@ -48,6 +49,11 @@ int esp32_bt_addr_cmp(const esp_bd_addr_t a, const esp_bd_addr_t b) {
                           (const struct mgos_bt_addr *) &b[0]);
 }
 
+unsigned int esp32_bt_addr_hash(const esp_bd_addr_t addr) {
+  /* Low bytes of the address are the most random ones. */
+  return (addr[5] ^ addr[4] ^ addr[3]) & (ESP32_BT_ADDR_HASH_SIZE - 1);
+}
+
 bool esp32_bt_addr_is_null(const esp_bd_addr_t addr) {
   return mgos_bt_addr_is_null((const struct mgos_bt_addr *) &addr[0]);
 }
@@ -90,10 +96,6 @@ static void mgos_bt_net_ev(int ev, void *evd, void *arg) {
   (void) arg;
 }
 
-int mgos_bt_gap_get_num_paired_devices(void) {
-  return esp_ble_get_bond_device_num();
-}
-
 /* Workaround for https://github.com/espressif/esp-idf/issues/1406 */
 bool esp32_bt_wipe_config(void) {
   bool result = false;
@@ -125,6 +127,11 @@ bool mgos_bt_common_init(void) {
 
   esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT);
 
+  if (!mgos_bt_sched_init()) {
+    LOG(LL_ERROR, ("Failed to allocate event queue"));
+    goto out;
+  }
+
   esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
   esp_err_t err = esp_bt_controller_init(&bt_cfg);
   if (err) {
@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "esp_bt.h"
 #include "esp_bt_defs.h"
@@ -27,21 +28,116 @@
 #include "esp_gap_ble_api.h"
 #include "nvs.h"
 
+#include "common/queue.h"
 #include "common/str_util.h"
 
 #include "frozen.h"
 
 #include "mgos_bt_gap.h"
+#include "mgos_bt_ring.h"
 #include "mgos_sys_config.h"
 #include "mgos_system.h"
+#include "mgos_timers.h"
+#include "mgos_utils.h"
 
 #include "esp32_bt_internal.h"
 
 static bool s_adv_enable = false;
 static bool s_advertising = false;
 static bool s_pairing_enable = false;
+/* True from scan start until the controller has actually stopped. */
 static bool s_scanning = false;
-static int s_scan_duration_sec = 3;
+static bool s_scan_stop_pending = false;
+static bool s_scan_continuous = false;
+static mgos_timer_id s_scan_timer = MGOS_INVALID_TIMER_ID;
+static int64_t s_scan_start_us = 0, s_scan_end_us = 0;
+
+enum esp32_bt_gap_scan_pause_state {
+  SCAN_PAUSE_NONE = 0,
+  SCAN_PAUSE_PENDING, /* Stop requested, waiting for the controller. */
+  SCAN_PAUSED,
+};
+static enum esp32_bt_gap_scan_pause_state s_scan_pause_state;
+static int64_t s_scan_pause_start_us = 0;
+/* Time spent (re)starting the scan after a restart or a pause. */
+static int64_t s_scan_restart_us = 0, s_scan_gaps_us = 0;
+/* Accessed from the BT task while scan is in progress. */
+static struct mgos_bt_gap_scan_filter *s_scan_filter = NULL;
+static struct mgos_bt_gap_scan_stats s_scan_stats;
+
+struct esp32_bt_gap_dedup_entry {
+  uint32_t hash; /* Of the address and content. 0 - empty. */
+  uint32_t last_ms;
+  int8_t rssi;
+};
+
+/* Open addressing hash table, with linear probing. */
+struct esp32_bt_gap_dedup {
+  uint32_t mask;
+  int rssi_delta;
+  uint32_t ttl_ms;
+  struct esp32_bt_gap_dedup_entry entries[];
+};
+
+#define DEDUP_MAX_PROBES 8
+
+static struct esp32_bt_gap_dedup *s_dedup = NULL;
+
+static struct esp32_bt_gap_dedup *dedup_new(int size, int rssi_delta,
+                                            int ttl_ms) {
+  uint32_t n = DEDUP_MAX_PROBES;
+  while (n < (uint32_t) size) n <<= 1;
+  struct esp32_bt_gap_dedup *d = (struct esp32_bt_gap_dedup *) calloc(
+      1, sizeof(*d) + n * sizeof(d->entries[0]));
+  if (d == NULL) return NULL;
+  d->mask = n - 1;
+  d->rssi_delta = rssi_delta;
+  d->ttl_ms = ttl_ms;
+  return d;
+}
+
+/* FNV-1a */
+static uint32_t dedup_hash(uint32_t h, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619;
+  }
+  return h;
+}
+
+/* Returns true if the report should be passed on. */
+static bool dedup_check(struct esp32_bt_gap_dedup *d,
+                        const struct mgos_bt_gap_scan_result *r) {
+  uint32_t h = 2166136261U;
+  h = dedup_hash(h, r->addr.addr, sizeof(r->addr.addr));
+  h = dedup_hash(h, r->adv_data.p, r->adv_data.len);
+  h = dedup_hash(h, r->scan_rsp.p, r->scan_rsp.len);
+  if (h == 0) h = 1;
+  uint32_t now = mgos_uptime_micros() / 1000;
+  struct esp32_bt_gap_dedup_entry *e = NULL, *oldest = NULL;
+  for (uint32_t i = 0; i < DEDUP_MAX_PROBES; i++) {
+    e = &d->entries[(h + i) & d->mask];
+    if (e->hash == h || e->hash == 0) break;
+    if (oldest == NULL || now - e->last_ms > now - oldest->last_ms) {
+      oldest = e;
+    }
+    e = NULL;
+  }
+  if (e != NULL && e->hash == h) {
+    int drssi = r->rssi - e->rssi;
+    if (drssi < 0) drssi = -drssi;
+    if (drssi <= d->rssi_delta &&
+        (d->ttl_ms == 0 || now - e->last_ms < d->ttl_ms)) {
+      return false;
+    }
+  } else if (e == NULL) {
+    e = oldest;
+  }
+  e->hash = h;
+  e->last_ms = now;
+  e->rssi = r->rssi;
+  return true;
+}
 
 static esp_ble_adv_data_t s_adv_data = {
     .set_scan_rsp = false,
@@ -140,22 +236,372 @@ bool mgos_bt_gap_set_pairing_enable(bool pairing_enable) {
   }
 }
 
-void mgos_bt_gap_remove_paired_device(const esp_bd_addr_t addr) {
-  esp_ble_remove_bond_device((uint8_t *) addr);
+/*
+ * Bond cache.
+ *
+ * Addresses of bonded peers, kept sorted for binary search. Loaded from the
+ * stack once at init and then kept up to date from the GAP events, so that
+ * checking whether a peer is bonded does not need to fetch the bond list.
+ * Updated on the BT task, read from the mgos task, hence the lock.
+ */
+static esp_bd_addr_t *s_bonds = NULL;
+static int s_num_bonds = 0, s_bonds_cap = 0;
+static struct mgos_rlock_type *s_bonds_lock = NULL;
+
+/*
+ * Pending removal requests. The stack completes them in order, so a
+ * completion belongs to the oldest matching request and those ahead of it
+ * have lost theirs. Requests not completed in time fail.
+ */
+#define BOND_REMOVE_TIMEOUT_MS 5000
+
+struct bond_remove_req {
+  esp_bd_addr_t addr;
+  bool all;
+  mgos_bt_gap_remove_paired_cb_t cb;
+  void *cb_arg;
+  int64_t deadline_us;
+  STAILQ_ENTRY(bond_remove_req) next;
+};
+static STAILQ_HEAD(s_bond_remove_reqs, bond_remove_req) s_bond_remove_reqs =
+    STAILQ_HEAD_INITIALIZER(s_bond_remove_reqs);
+static mgos_timer_id s_bond_remove_timer = MGOS_INVALID_TIMER_ID;
+
+/* Forwarded from the BT task. */
+struct bond_remove_done_info {
+  esp_bd_addr_t addr;
+  bool all;
+  bool ok;
+};
+
+/* Returns index of the address or, if not found, where it should go. */
+static int bonds_find(const esp_bd_addr_t addr, bool *found) {
+  int lo = 0, hi = s_num_bonds;
+  *found = false;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = memcmp(s_bonds[mid], addr, sizeof(esp_bd_addr_t));
+    if (cmp == 0) {
+      *found = true;
+      return mid;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
 }
 
-void mgos_bt_gap_remove_all_paired_devices(void) {
+static void bonds_add(const esp_bd_addr_t addr) {
+  bool found;
+  mgos_rlock(s_bonds_lock);
+  int i = bonds_find(addr, &found);
+  if (found) goto out;
+  if (s_num_bonds == s_bonds_cap) {
+    int new_cap = (s_bonds_cap > 0 ? s_bonds_cap * 2 : 4);
+    esp_bd_addr_t *nb =
+        (esp_bd_addr_t *) realloc(s_bonds, new_cap * sizeof(*s_bonds));
+    if (nb == NULL) goto out;
+    s_bonds = nb;
+    s_bonds_cap = new_cap;
+  }
+  memmove(&s_bonds[i + 1], &s_bonds[i], (s_num_bonds - i) * sizeof(*s_bonds));
+  memcpy(s_bonds[i], addr, sizeof(*s_bonds));
+  s_num_bonds++;
+out:
+  mgos_runlock(s_bonds_lock);
+}
+
+static void bonds_remove(const esp_bd_addr_t addr) {
+  bool found;
+  mgos_rlock(s_bonds_lock);
+  int i = bonds_find(addr, &found);
+  if (found) {
+    s_num_bonds--;
+    memmove(&s_bonds[i], &s_bonds[i + 1],
+            (s_num_bonds - i) * sizeof(*s_bonds));
+  }
+  mgos_runlock(s_bonds_lock);
+}
+
+static void bonds_load(void) {
   int num = esp_ble_get_bond_device_num();
-  esp_ble_bond_dev_t *list = (esp_ble_bond_dev_t *) calloc(num, sizeof(*list));
+  esp_ble_bond_dev_t *list = NULL;
+  if (num <= 0) return;
+  list = (esp_ble_bond_dev_t *) calloc(num, sizeof(*list));
   if (list != NULL && esp_ble_get_bond_device_list(&num, list) == ESP_OK) {
-    for (int i = 0; i < num; i++) {
-      mgos_bt_gap_remove_paired_device(list[i].bd_addr);
-    }
+    for (int i = 0; i < num; i++) bonds_add(list[i].bd_addr);
   }
   free(list);
 }
 
+bool esp32_bt_gap_is_paired(const esp_bd_addr_t addr) {
+  bool found;
+  mgos_rlock(s_bonds_lock);
+  bonds_find(addr, &found);
+  mgos_runlock(s_bonds_lock);
+  return found;
+}
+
+int mgos_bt_gap_get_num_paired_devices(void) {
+  mgos_rlock(s_bonds_lock);
+  int res = s_num_bonds;
+  mgos_runlock(s_bonds_lock);
+  return res;
+}
+
+static void bond_remove_req_complete(struct bond_remove_req *req, bool ok) {
+  STAILQ_REMOVE(&s_bond_remove_reqs, req, bond_remove_req, next);
+  if (req->cb != NULL) req->cb(ok, req->cb_arg);
+  free(req);
+}
+
+static void bond_remove_timer_cb(void *arg);
+
+/* Arms the timer for the oldest request, if there is one. */
+static void bond_remove_timer_start(void) {
+  struct bond_remove_req *req = STAILQ_FIRST(&s_bond_remove_reqs);
+  if (req == NULL || s_bond_remove_timer != MGOS_INVALID_TIMER_ID) return;
+  int64_t left_ms = (req->deadline_us - mgos_uptime_micros()) / 1000;
+  s_bond_remove_timer =
+      mgos_set_timer(MAX(left_ms, 1), 0, bond_remove_timer_cb, NULL);
+}
+
+static void bond_remove_timer_cb(void *arg) {
+  struct bond_remove_req *req;
+  int64_t now = mgos_uptime_micros();
+  s_bond_remove_timer = MGOS_INVALID_TIMER_ID;
+  while ((req = STAILQ_FIRST(&s_bond_remove_reqs)) != NULL &&
+         now >= req->deadline_us) {
+    LOG(LL_ERROR, ("Bond removal timed out"));
+    bond_remove_req_complete(req, false /* ok */);
+  }
+  bond_remove_timer_start();
+  (void) arg;
+}
+
+static void bond_remove_done_mgos(void *arg) {
+  const struct bond_remove_done_info *di =
+      (const struct bond_remove_done_info *) arg;
+  struct bond_remove_req *req, *match;
+  STAILQ_FOREACH(match, &s_bond_remove_reqs, next) {
+    if (match->all == di->all &&
+        (di->all || memcmp(match->addr, di->addr, sizeof(di->addr)) == 0)) {
+      break;
+    }
+  }
+  /* Not requested by us. */
+  if (match == NULL) return;
+  /* Requests ahead of it must have lost their completions. */
+  while ((req = STAILQ_FIRST(&s_bond_remove_reqs)) != match) {
+    bond_remove_req_complete(req, false /* ok */);
+  }
+  bond_remove_req_complete(match, di->ok);
+  if (s_bond_remove_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(s_bond_remove_timer);
+    s_bond_remove_timer = MGOS_INVALID_TIMER_ID;
+  }
+  bond_remove_timer_start();
+}
+
+/* Called on the BT task. */
+static void bond_remove_done(const esp_bd_addr_t addr, bool all, bool ok) {
+  struct bond_remove_done_info *di =
+      (struct bond_remove_done_info *) mgos_bt_sched_reserve(
+          bond_remove_done_mgos, sizeof(*di));
+  if (di == NULL) return;
+  if (addr != NULL) memcpy(di->addr, addr, sizeof(di->addr));
+  di->all = all;
+  di->ok = ok;
+  mgos_bt_sched_commit();
+}
+
+static bool bond_remove_req_add(const esp_bd_addr_t addr,
+                                mgos_bt_gap_remove_paired_cb_t cb,
+                                void *cb_arg) {
+  struct bond_remove_req *req =
+      (struct bond_remove_req *) calloc(1, sizeof(*req));
+  if (req == NULL) return false;
+  if (addr != NULL) {
+    memcpy(req->addr, addr, sizeof(req->addr));
+  } else {
+    req->all = true;
+  }
+  req->cb = cb;
+  req->cb_arg = cb_arg;
+  req->deadline_us = mgos_uptime_micros() + BOND_REMOVE_TIMEOUT_MS * 1000LL;
+  STAILQ_INSERT_TAIL(&s_bond_remove_reqs, req, next);
+  bond_remove_timer_start();
+  return true;
+}
+
+bool mgos_bt_gap_remove_paired_device_async(const esp_bd_addr_t addr,
+                                            mgos_bt_gap_remove_paired_cb_t cb,
+                                            void *cb_arg) {
+  esp32_bt_gattc_cache_invalidate(addr);
+  if (!bond_remove_req_add(addr, cb, cb_arg)) return false;
+  if (esp_ble_remove_bond_device((uint8_t *) addr) != ESP_OK) {
+    struct bond_remove_req *req = STAILQ_LAST(&s_bond_remove_reqs,
+                                              bond_remove_req, next);
+    STAILQ_REMOVE(&s_bond_remove_reqs, req, bond_remove_req, next);
+    free(req);
+    return false;
+  }
+  return true;
+}
+
+bool mgos_bt_gap_remove_all_paired_devices_async(
+    mgos_bt_gap_remove_paired_cb_t cb, void *cb_arg) {
+  mgos_rlock(s_bonds_lock);
+  for (int i = 0; i < s_num_bonds; i++) {
+    esp32_bt_gattc_cache_invalidate(s_bonds[i]);
+  }
+  mgos_runlock(s_bonds_lock);
+  if (!bond_remove_req_add(NULL, cb, cb_arg)) return false;
+  if (esp_ble_clear_bond_device_list() != ESP_OK) {
+    struct bond_remove_req *req = STAILQ_LAST(&s_bond_remove_reqs,
+                                              bond_remove_req, next);
+    STAILQ_REMOVE(&s_bond_remove_reqs, req, bond_remove_req, next);
+    free(req);
+    return false;
+  }
+  return true;
+}
+
+void mgos_bt_gap_remove_paired_device(const esp_bd_addr_t addr) {
+  mgos_bt_gap_remove_paired_device_async(addr, NULL, NULL);
+}
+
+void mgos_bt_gap_remove_all_paired_devices(void) {
+  mgos_bt_gap_remove_all_paired_devices_async(NULL, NULL);
+}
+
+static void get_scan_duty_params(const struct mgos_bt_gap_scan_opts *opts,
+                                 int *interval_ms, int *window_ms) {
+  switch (opts->duty) {
+    case MGOS_BT_GAP_SCAN_DUTY_LOW_POWER:
+      *interval_ms = 1000;
+      *window_ms = 100;
+      break;
+    case MGOS_BT_GAP_SCAN_DUTY_BALANCED:
+      *interval_ms = 200;
+      *window_ms = 100;
+      break;
+    case MGOS_BT_GAP_SCAN_DUTY_LOW_LATENCY:
+      *interval_ms = *window_ms = 100;
+      break;
+    default:
+      *interval_ms = MGOS_BT_GAP_DEFAULT_SCAN_INTERVAL_MS;
+      *window_ms = MGOS_BT_GAP_DEFAULT_SCAN_WINDOW_MS;
+  }
+  if (opts->interval_ms > 0) *interval_ms = opts->interval_ms;
+  if (opts->window_ms > 0) *window_ms = opts->window_ms;
+}
+
+static void scan_pause_end(void) {
+  if (s_scan_pause_state == SCAN_PAUSED) {
+    s_scan_stats.paused_ms +=
+        (mgos_uptime_micros() - s_scan_pause_start_us) / 1000;
+  }
+  s_scan_pause_state = SCAN_PAUSE_NONE;
+}
+
+static void scan_free_state(void) {
+  free(s_scan_filter);
+  s_scan_filter = NULL;
+  free(s_dedup);
+  s_dedup = NULL;
+}
+
+/*
+ * Called once the controller is no longer scanning, so nothing uses
+ * the filter and the cache anymore. s_scanning is cleared last,
+ * a new scan cannot be started before that.
+ */
+static void scan_done(bool on_bt_task) {
+  scan_pause_end();
+  scan_free_state();
+  s_scan_stop_pending = false;
+  s_scan_end_us = mgos_uptime_micros();
+  s_scanning = false;
+  LOG(LL_DEBUG, ("Scan stopped"));
+  if (on_bt_task) {
+    mgos_event_trigger_schedule(MGOS_BT_GAP_EVENT_SCAN_STOP, NULL, 0);
+  } else {
+    mgos_event_trigger(MGOS_BT_GAP_EVENT_SCAN_STOP, NULL);
+  }
+}
+
+static bool scan_stop(void) {
+  if (!s_scanning || s_scan_stop_pending) return true;
+  switch (s_scan_pause_state) {
+    case SCAN_PAUSED:
+      /* Controller is not scanning, just finish up. */
+      scan_done(false /* on_bt_task */);
+      return true;
+    case SCAN_PAUSE_PENDING:
+      /* Will be finished when stop completes. */
+      s_scan_stop_pending = true;
+      return true;
+    case SCAN_PAUSE_NONE:
+      break;
+  }
+  s_scan_stop_pending = true;
+  if (esp_ble_gap_stop_scanning() != ESP_OK) {
+    s_scan_stop_pending = false;
+    return false;
+  }
+  return true;
+}
+
+bool esp32_bt_gap_scan_pause(void) {
+  if (!s_scanning) return true;
+  /* Radio will be freed when stop completes. */
+  if (s_scan_stop_pending) return false;
+  switch (s_scan_pause_state) {
+    case SCAN_PAUSED:
+      return true;
+    case SCAN_PAUSE_PENDING:
+      return false;
+    case SCAN_PAUSE_NONE:
+      break;
+  }
+  s_scan_pause_state = SCAN_PAUSE_PENDING;
+  if (esp_ble_gap_stop_scanning() != ESP_OK) {
+    /* Let the caller try anyway. */
+    s_scan_pause_state = SCAN_PAUSE_NONE;
+    return true;
+  }
+  return false;
+}
+
+void esp32_bt_gap_scan_resume(void) {
+  if (s_scan_pause_state != SCAN_PAUSED) return;
+  scan_pause_end();
+  if (!s_scanning) return;
+  LOG(LL_DEBUG, ("Resuming scan"));
+  s_scan_restart_us = mgos_uptime_micros();
+  if (esp_ble_gap_start_scanning(0 /* until stopped */) != ESP_OK) {
+    scan_done(false /* on_bt_task */);
+  }
+}
+
+static void scan_timer_cb(void *arg) {
+  s_scan_timer = MGOS_INVALID_TIMER_ID;
+  scan_stop();
+  (void) arg;
+}
+
 bool mgos_bt_gap_scan(const struct mgos_bt_gap_scan_opts *opts) {
+  int interval_ms, window_ms;
+  get_scan_duty_params(opts, &interval_ms, &window_ms);
+  /* Valid range is 0x4 - 0x4000 units of 0.625 ms. */
+  if (window_ms > interval_ms || window_ms < 2.5 || interval_ms > 10240) {
+    LOG(LL_ERROR, ("Invalid scan params %d/%d", window_ms, interval_ms));
+    return false;
+  }
   esp_ble_scan_params_t params = {
       .scan_type =
           (opts->active ? BLE_SCAN_TYPE_ACTIVE : BLE_SCAN_TYPE_PASSIVE),
@@ -163,23 +609,84 @@ bool mgos_bt_gap_scan(const struct mgos_bt_gap_scan_opts *opts) {
           (mgos_sys_config_get_bt_random_address() ? BLE_ADDR_TYPE_RANDOM
                                                    : BLE_ADDR_TYPE_PUBLIC),
       .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
-      .scan_interval = MGOS_BT_GAP_DEFAULT_SCAN_INTERVAL_MS / 0.625,
-      .scan_window = MGOS_BT_GAP_DEFAULT_SCAN_WINDOW_MS / 0.625,
+      .scan_interval = interval_ms / 0.625,
+      .scan_window = window_ms / 0.625,
   };
-  s_scan_duration_sec = opts->duration_ms / 1000 + 1;
+  /* Includes scans that are being stopped or paused. */
+  if (s_scanning || s_scan_stop_pending ||
+      s_scan_pause_state != SCAN_PAUSE_NONE) {
+    LOG(LL_ERROR, ("Scan already in progress"));
+    return false;
+  }
+  /* Filter and cache of the previous scan were freed by scan_done(). */
+  if (opts->filter != NULL) {
+    s_scan_filter = mgos_bt_gap_scan_filter_copy(opts->filter);
+    if (s_scan_filter == NULL) goto out_err;
+  }
+  if (opts->dedup_cache_size > 0) {
+    s_dedup = dedup_new(opts->dedup_cache_size, opts->dedup_rssi_delta,
+                        opts->dedup_ttl_ms);
+    if (s_dedup == NULL) goto out_err;
+  }
+  memset(&s_scan_stats, 0, sizeof(s_scan_stats));
+  s_scan_stats.duty_cfg = (float) params.scan_window / params.scan_interval;
+  s_scan_restart_us = s_scan_gaps_us = 0;
+  s_scan_continuous = opts->continuous;
+  /* Controller only supports whole seconds, so duration is timed by us. */
+  mgos_clear_timer(s_scan_timer);
+  s_scan_timer = MGOS_INVALID_TIMER_ID;
   if (esp_ble_gap_set_scan_params(&params) == ESP_OK) {
     LOG(LL_DEBUG,
-        ("Starting scan (%s, %d/%d)",
+        ("Starting scan (%s, %d/%d%s)",
          (params.scan_type == BLE_SCAN_TYPE_ACTIVE ? "active" : "passive"),
-         params.scan_window, params.scan_interval));
+         params.scan_window, params.scan_interval,
+         (s_scan_continuous ? ", continuous" : "")));
     s_scanning = true;
+    s_scan_start_us = mgos_uptime_micros();
+    s_scan_end_us = 0;
+    if (!s_scan_continuous) {
+      int duration_ms = opts->duration_ms;
+      if (duration_ms <= 0) duration_ms = MGOS_BT_GAP_DEFAULT_SCAN_DURATION_MS;
+      s_scan_timer = mgos_set_timer(duration_ms, 0, scan_timer_cb, NULL);
+    }
     return true;
-  } else {
-    LOG(LL_ERROR, ("Scan already in progress"));
-    return false;
+  }
+  LOG(LL_ERROR, ("Scan already in progress"));
+out_err:
+  /* Scan has not started, the BT task has not seen these. */
+  scan_free_state();
+  return false;
+}
+
+bool mgos_bt_gap_scan_stop(void) {
+  mgos_clear_timer(s_scan_timer);
+  s_scan_timer = MGOS_INVALID_TIMER_ID;
+  return scan_stop();
+}
+
+void mgos_bt_gap_get_scan_stats(struct mgos_bt_gap_scan_stats *stats) {
+  *stats = s_scan_stats;
+  int64_t end_us = (s_scan_end_us != 0 ? s_scan_end_us : mgos_uptime_micros());
+  if (s_scan_start_us != 0 && end_us > s_scan_start_us) {
+    int64_t total_us = end_us - s_scan_start_us;
+    uint32_t num_reports =
+        stats->num_accepted + stats->num_rejected + stats->num_dups;
+    stats->reports_per_sec = num_reports * 1e6 / total_us;
+    /* Not scanning while paused or restarting, including right now. */
+    int64_t off_us = stats->paused_ms * 1000LL + s_scan_gaps_us;
+    if (s_scan_end_us == 0 && s_scan_pause_state == SCAN_PAUSED) {
+      off_us += end_us - s_scan_pause_start_us;
+    }
+    stats->duty = stats->duty_cfg * MAX(total_us - off_us, 0) / total_us;
   }
 }
 
+/* Only called when the message is actually logged. */
+static const char *to_hex(char *out, struct mg_str data) {
+  cs_to_hex(out, (const unsigned char *) data.p, data.len);
+  return out;
+}
+
 static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
                                  esp_ble_gap_cb_param_t *ep) {
   char buf[BT_UUID_STR_LEN];
@@ -187,15 +694,26 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
     case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT: {
       const struct ble_scan_start_cmpl_evt_param *p = &ep->scan_start_cmpl;
       LOG(LL_DEBUG, ("ESP_GAP_BLE_SCAN_START_COMPLETE st %d", p->status));
-      if (p->status != ESP_BT_STATUS_SUCCESS) s_scanning = false;
+      if (s_scan_restart_us != 0) {
+        s_scan_gaps_us += mgos_uptime_micros() - s_scan_restart_us;
+        s_scan_restart_us = 0;
+      }
+      if (p->status != ESP_BT_STATUS_SUCCESS) scan_done(true /* on_bt_task */);
       break;
     }
     case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT: {
       const struct ble_scan_stop_cmpl_evt_param *p = &ep->scan_stop_cmpl;
       LOG(LL_DEBUG, ("ESP_GAP_BLE_SCAN_STOP_COMPLETE st %d", p->status));
-      s_scanning = false;
-      LOG(LL_DEBUG, ("Scan aborted"));
-      mgos_event_trigger_schedule(MGOS_BT_GAP_EVENT_SCAN_STOP, NULL, 0);
+      if (s_scan_pause_state == SCAN_PAUSE_PENDING && !s_scan_stop_pending) {
+        s_scan_pause_state = SCAN_PAUSED;
+        s_scan_pause_start_us = mgos_uptime_micros();
+        s_scan_stats.num_pauses++;
+        LOG(LL_DEBUG, ("Scan paused"));
+        esp32_bt_gattc_radio_free();
+        break;
+      }
+      if (s_scanning) scan_done(true /* on_bt_task */);
+      esp32_bt_gattc_radio_free();
       break;
     }
     case ESP_GAP_BLE_SCAN_RESULT_EVT: {
@@ -208,28 +726,48 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
           struct mgos_bt_gap_scan_result arg = {.rssi = p->rssi};
           memcpy(arg.addr.addr, p->bda, sizeof(arg.addr.addr));
           arg.addr.type = (enum mgos_bt_addr_type)(p->ble_addr_type + 1);
-          arg.adv_data =
-              mg_strdup(mg_mk_str_n((char *) p->ble_adv, p->adv_data_len));
-          arg.scan_rsp = mg_strdup(mg_mk_str_n(
-              (char *) p->ble_adv + p->adv_data_len, p->scan_rsp_len));
-          cs_to_hex(ad_hex, (void *) arg.adv_data.p, arg.adv_data.len);
-          cs_to_hex(sr_hex, (void *) arg.scan_rsp.p, arg.scan_rsp.len);
-          const struct mg_str name = mgos_bt_gap_parse_name(arg.adv_data);
+          arg.adv_data = mg_mk_str_n((char *) p->ble_adv, p->adv_data_len);
+          arg.scan_rsp = mg_mk_str_n((char *) p->ble_adv + p->adv_data_len,
+                                     p->scan_rsp_len);
+          struct mgos_bt_adv_index idx;
+          mgos_bt_adv_index_init(&idx, arg.adv_data, arg.scan_rsp);
+          if (s_scan_filter != NULL &&
+              !mgos_bt_gap_scan_filter_match(s_scan_filter, &arg, &idx)) {
+            s_scan_stats.num_rejected++;
+            break;
+          }
+          if (s_dedup != NULL && !dedup_check(s_dedup, &arg)) {
+            s_scan_stats.num_dups++;
+            break;
+          }
+          s_scan_stats.num_accepted++;
+          const struct mg_str name = mgos_bt_adv_index_get_name(&idx);
           LOG(LL_DEBUG,
               ("SCAN_RESULT %d %s [%.*s] dt %d at %d et %d rssi %d "
                "adl %d [%s] srl %d [%s]",
                p->search_evt, esp32_bt_addr_to_str(p->bda, buf), (int) name.len,
                name.p, p->dev_type, p->ble_addr_type, p->ble_evt_type, p->rssi,
-               (int) arg.adv_data.len, ad_hex, (int) arg.scan_rsp.len, sr_hex));
+               (int) arg.adv_data.len, to_hex(ad_hex, arg.adv_data),
+               (int) arg.scan_rsp.len, to_hex(sr_hex, arg.scan_rsp)));
           mgos_event_trigger_schedule(MGOS_BT_GAP_EVENT_SCAN_RESULT, &arg,
                                       sizeof(arg));
           break;
         }
         case ESP_GAP_SEARCH_INQ_CMPL_EVT:
         case ESP_GAP_SEARCH_SEARCH_CANCEL_CMPL_EVT: {
-          s_scanning = false;
-          LOG(LL_DEBUG, ("Scan finished"));
-          mgos_event_trigger_schedule(MGOS_BT_GAP_EVENT_SCAN_STOP, NULL, 0);
+          if (p->search_evt == ESP_GAP_SEARCH_INQ_CMPL_EVT &&
+              s_scan_continuous && !s_scan_stop_pending &&
+              esp_ble_gap_start_scanning(0) == ESP_OK) {
+            s_scan_restart_us = mgos_uptime_micros();
+            s_scan_stats.num_restarts++;
+            break;
+          }
+          /* Stop or pause in progress, SCAN_STOP_COMPLETE will finish it. */
+          if (s_scan_stop_pending || s_scan_pause_state != SCAN_PAUSE_NONE) {
+            break;
+          }
+          if (s_scanning) scan_done(true /* on_bt_task */);
+          esp32_bt_gattc_radio_free();
           break;
         }
         default: { LOG(LL_DEBUG, ("SCAN_RESULT search ev %d", p->search_evt)); }
@@ -239,10 +777,9 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
     case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
       const struct ble_scan_param_cmpl_evt_param *p = &ep->scan_param_cmpl;
       LOG(LL_DEBUG, ("ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE st %d", p->status));
-      if (p->status != ESP_BT_STATUS_SUCCESS) {
-        s_scanning = false;
-      } else if (esp_ble_gap_start_scanning(s_scan_duration_sec) != ESP_OK) {
-        s_scanning = false;
+      if (p->status != ESP_BT_STATUS_SUCCESS ||
+          esp_ble_gap_start_scanning(0 /* until stopped */) != ESP_OK) {
+        scan_done(true /* on_bt_task */);
       }
       break;
     }
@@ -287,6 +824,8 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
       LOG(ll, ("AUTH_CMPL peer %s at %d dt %d success %d (fr %d) kp %d kt %d",
                esp32_bt_addr_to_str(p->bd_addr, buf), p->addr_type, p->dev_type,
                p->success, p->fail_reason, p->key_present, p->key_type));
+      /* Peer is bonded if we asked for bonding (peer may not have). */
+      if (p->success && s_pairing_enable) bonds_add(p->bd_addr);
       esp32_bt_gatts_auth_cmpl(p->bd_addr, p->success);
       break;
     }
@@ -356,6 +895,13 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
                      "conn_int %u tout %u",
                      p->status, esp32_bt_addr_to_str(p->bda, buf), p->min_int,
                      p->max_int, p->latency, p->conn_int, p->timeout));
+      esp32_bt_gatts_conn_params_updated(p->bda,
+                                         (p->status == ESP_BT_STATUS_SUCCESS),
+                                         p->conn_int, p->latency, p->timeout);
+      if (p->status == ESP_BT_STATUS_SUCCESS) {
+        esp32_bt_gattc_conn_params_updated(p->bda, p->conn_int, p->latency,
+                                           p->timeout);
+      }
       break;
     }
     case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT: {
@@ -378,6 +924,9 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("REMOVE_BOND_DEV_COMPLETE st %d bda %s", p->status,
                esp32_bt_addr_to_str(p->bd_addr, buf)));
+      bool ok = (p->status == ESP_BT_STATUS_SUCCESS);
+      if (ok) bonds_remove(p->bd_addr);
+      bond_remove_done(p->bd_addr, false /* all */, ok);
       break;
     }
     case ESP_GAP_BLE_CLEAR_BOND_DEV_COMPLETE_EVT: {
@@ -385,6 +934,13 @@ static void esp32_gap_ev_handler(esp_gap_ble_cb_event_t ev,
           &ep->clear_bond_dev_cmpl;
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("CLEAR_BOND_DEV_COMPLETE st %d", p->status));
+      bool ok = (p->status == ESP_BT_STATUS_SUCCESS);
+      if (ok) {
+        mgos_rlock(s_bonds_lock);
+        s_num_bonds = 0;
+        mgos_runlock(s_bonds_lock);
+      }
+      bond_remove_done(NULL, true /* all */, ok);
       break;
     }
     case ESP_GAP_BLE_GET_BOND_DEV_COMPLETE_EVT: {
@@ -434,6 +990,9 @@ static void adv_enable_cb(void *arg) {
 }
 
 bool esp32_bt_gap_init(void) {
+  s_bonds_lock = mgos_rlock_create();
+  bonds_load();
+
   if (esp_ble_gap_register_callback(esp32_gap_ev_handler) != ESP_OK) {
     return false;
   }
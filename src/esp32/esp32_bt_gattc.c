@@ -26,10 +26,16 @@
 #include "esp_gattc_api.h"
 
 #include "common/cs_dbg.h"
+#include "common/cs_file.h"
+#include "common/mbuf.h"
 #include "common/queue.h"
 
 #include "mgos_bt_gattc.h"
+#include "mgos_bt_ring.h"
+#include "mgos_sys_config.h"
 #include "mgos_system.h"
+#include "mgos_timers.h"
+#include "mgos_utils.h"
 
 #include "esp32_bt.h"
 #include "esp32_bt_internal.h"
@@ -44,22 +50,188 @@ static const esp_bt_uuid_t notify_descr_uuid = {
         },
 };
 
-// TODO storing this in a global variable makes multiple concurrent subscribe
-// operations unreliable
-static uint16_t last_subscribe_conn_id = 0;
+struct gattc_discovery_done_info {
+  struct mgos_bt_gatt_conn conn;
+  esp_gatt_status_t status;
+  /* Owned by the receiver. */
+  struct mgos_bt_gattc_discovery_entry *chars;
+  int num_chars;
+  struct mgos_bt_uuid *svcs;
+  int num_svcs;
+};
 
 struct conn {
+  bool in_use;
   struct mgos_bt_gatt_conn c;
   bool connected;
   esp_gatt_if_t iface;
-  SLIST_ENTRY(conn) next;
+  struct mgos_bt_gattc_conn_params params; /* Zero until updated. */
+  /* Discovery in progress. Services to discover, NULL means all. */
+  struct mgos_bt_uuid *disc_svcs;
+  int disc_num_svcs;
+  int disc_svc_idx;
+  struct mbuf disc_buf; /* Discovery table being built. */
+  /*
+   * Completion that could not be scheduled, picked up by the timeout timer.
+   * Whoever clears disc_done_ready first owns the contents.
+   */
+  struct gattc_discovery_done_info disc_done;
+  bool disc_done_ready;
+  struct conn *next_by_addr;
+};
+
+/*
+ * Attribute cache.
+ *
+ * Discovered characteristics of bonded peers are stored on the filesystem,
+ * so that on reconnect discovery can be answered from the cache without
+ * any air time. Handles of bonded peers are stable unless the peer says
+ * otherwise with a Service Changed indication, upon which the cache is
+ * removed.
+ *
+ * File is written to a temporary file first and renamed into place.
+ * All the integers are little-endian:
+ *   header: magic (4), version (1), reserved (1), num_entries (2)
+ *   entry:  svc uuid, chr uuid, handle (2), cccd_handle (2), prop (1)
+ *   uuid:   length (1, 2, 4 or 16), followed by as many bytes.
+ */
+#define GATTC_CACHE_MAGIC 0x43544247 /* "GBTC" */
+#define GATTC_CACHE_VERSION 3
+#define GATTC_CACHE_HDR_SIZE 8
+
+/*
+ * Connections are kept in a table indexed by conn_id, with a small hash for
+ * lookups by address, so that per-event lookups are constant time and
+ * connecting does not allocate.
+ */
+static struct conn s_conns[ESP32_BT_MAX_CONNS];
+static struct conn *s_conns_by_addr[ESP32_BT_ADDR_HASH_SIZE];
+
+/*
+ * Client operations.
+ *
+ * Reads, writes and subscriptions are queued per connection and pipelined,
+ * up to MGOS_BT_GATTC_MAX_OPS_IN_FLIGHT at a time, fewer if the stack
+ * reports that its queue is full. Completions are matched to in-flight
+ * operations by type and handle. Operations that do not complete within
+ * bt.gattc.op_timeout_ms fail with MGOS_BT_GATT_STATUS_TIMEOUT.
+ *
+ * QUEUE_FULL does not say which operation was rejected. The stack runs
+ * a connection's commands one at a time, in order, so accepted operations
+ * complete in the order they were issued: when one completes, those issued
+ * before it that are still in flight must have been rejected. They are put
+ * back at the head of the queue, as are all the in-flight operations once
+ * as many as are in flight are known to have been rejected. The in-flight
+ * limit is lowered on QUEUE_FULL, so later rejections are unambiguous.
+ * Subscriptions write the CCCD after registering, out of order, so they
+ * are never assumed rejected and fall back to the timeout.
+ *
+ * Client operations can't run while scanning, so scan is paused first.
+ * Scan is resumed when all the operations issued during the pause complete
+ * or after MGOS_BT_GATTC_MAX_SCAN_PAUSE_MS.
+ *
+ * All of this state is only accessed on the mgos task, completions are
+ * forwarded from the BT task.
+ */
+#define MGOS_BT_GATTC_MAX_SCAN_PAUSE_MS 500
+#define MGOS_BT_GATTC_MAX_OPS_IN_FLIGHT 4
+#define MGOS_BT_GATTC_TIMEOUT_CHECK_INTERVAL_MS 200
+
+enum gattc_op_type {
+  GATTC_OP_CONNECT,
+  GATTC_OP_READ,
+  GATTC_OP_READ_MULTI,
+  GATTC_OP_WRITE,
+  GATTC_OP_WRITE_NR,
+  GATTC_OP_WRITE_DESCR,
+  GATTC_OP_SUBSCRIBE,
+  /* Completion notifications only. */
+  GATTC_OP_REG_FOR_NOTIFY,
+  GATTC_OP_QUEUE_FULL,
+  GATTC_OP_CONGEST,
+  GATTC_OP_DISCONNECT,
+};
+
+struct gattc_op {
+  enum gattc_op_type type;
+  int conn_id;
+  uint16_t handle;
+  uint16_t descr_handle; /* For subscribe, CCCD handle once known. */
+  struct mgos_bt_addr addr;
+  struct mg_str data;
+  mgos_bt_gattc_op_cb_t cb;
+  void *cb_arg;
+  bool deferred;  /* Had to wait for scan to pause. */
+  bool cancelled; /* Connect: cancelled after it was issued. */
+  /* Scan pause this op was counted in, 0 if issued while not scanning. */
+  uint32_t pause_gen;
+  int64_t queued_us;
+  int64_t deadline_us;
+  STAILQ_ENTRY(gattc_op) next;
+};
+
+STAILQ_HEAD(gattc_ops, gattc_op);
+
+/* Characteristic lookup by UUID, waiting for discovery. */
+struct gattc_resolve {
+  struct mgos_bt_uuid svc;
+  struct mgos_bt_uuid chr;
+  mgos_bt_gattc_op_cb_t cb;
+  void *cb_arg;
+  STAILQ_ENTRY(gattc_resolve) next;
+};
+
+STAILQ_HEAD(gattc_resolves, gattc_resolve);
+
+struct gattc_conn_ops {
+  bool in_use;
+  int conn_id;
+  int num_in_flight;
+  int max_in_flight;
+  bool queue_full;
+  int num_rejected; /* QUEUE_FULL rejections not matched to ops yet. */
+  bool congested;
+  bool no_read_multi; /* Peer does not support read multiple. */
+  struct gattc_ops pending;
+  struct gattc_ops in_flight;
+  /* Discovery table, from the last discovery or the attribute cache. */
+  struct mgos_bt_gattc_discovery_entry *chars;
+  int num_chars;
+  bool discovering;
+  struct gattc_resolves resolves;
+};
+
+/* Completion, forwarded from the BT task. Followed by data, if any. */
+struct gattc_op_done_info {
+  enum gattc_op_type type;
+  int conn_id;
+  uint16_t handle;
+  esp_gatt_status_t status;
+  bool flag; /* QUEUE_FULL: is_full, CONGEST: congested. */
+  uint16_t len;
 };
 
-static SLIST_HEAD(s_conns, conn) s_conns = SLIST_HEAD_INITIALIZER(s_conns);
+static struct gattc_ops s_deferred_conns =
+    STAILQ_HEAD_INITIALIZER(s_deferred_conns);
+/* Connects issued to the stack, waiting for OPEN. */
+static struct gattc_ops s_connecting = STAILQ_HEAD_INITIALIZER(s_connecting);
+/* Indexed by conn_id, like s_conns. */
+static struct gattc_conn_ops s_conn_ops[ESP32_BT_MAX_CONNS];
+/* Registration for notifications does not specify connection, so only one
+ * subscription can be registering at a time. */
+static struct gattc_op *s_reg_notify_op = NULL;
+static int s_num_active_ops = 0;
+/* Incremented when the pause is cut short, ops of earlier ones don't count. */
+static uint32_t s_pause_gen = 1;
+static mgos_timer_id s_pause_timer = MGOS_INVALID_TIMER_ID;
+static mgos_timer_id s_timeout_timer = MGOS_INVALID_TIMER_ID;
+static struct mgos_bt_gattc_stats s_stats;
+static uint64_t s_deferred_wait_us = 0, s_op_latency_us = 0;
+static uint64_t s_connect_time_us = 0;
 
 static struct conn *find_by_addr(const esp_bd_addr_t addr) {
-  struct conn *conn;
-  SLIST_FOREACH(conn, &s_conns, next) {
+  struct conn *conn = s_conns_by_addr[esp32_bt_addr_hash(addr)];
+  for (; conn != NULL; conn = conn->next_by_addr) {
     if (memcmp(addr, conn->c.addr.addr, sizeof(conn->c.addr.addr)) == 0)
       return conn;
   }
@@ -67,58 +239,1719 @@ static struct conn *find_by_addr(const esp_bd_addr_t addr) {
 }
 
 static struct conn *find_by_conn_id(int conn_id) {
-  struct conn *conn;
-  SLIST_FOREACH(conn, &s_conns, next) {
-    if (conn->c.conn_id == conn_id) return conn;
+  if (conn_id < 0 || conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct conn *conn = &s_conns[conn_id];
+  return (conn->in_use ? conn : NULL);
+}
+
+static struct conn *conn_add(int conn_id, const esp_bd_addr_t addr) {
+  if (conn_id < 0 || conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct conn *conn = &s_conns[conn_id];
+  if (conn->in_use) return NULL;
+  unsigned int h = esp32_bt_addr_hash(addr);
+  memset(conn, 0, sizeof(*conn));
+  conn->in_use = true;
+  conn->c.conn_id = conn_id;
+  memcpy(conn->c.addr.addr, addr, sizeof(conn->c.addr.addr));
+  conn->next_by_addr = s_conns_by_addr[h];
+  s_conns_by_addr[h] = conn;
+  return conn;
+}
+
+static void conn_remove(struct conn *conn) {
+  struct conn **pc = &s_conns_by_addr[esp32_bt_addr_hash(conn->c.addr.addr)];
+  for (; *pc != NULL; pc = &(*pc)->next_by_addr) {
+    if (*pc == conn) {
+      *pc = conn->next_by_addr;
+      break;
+    }
+  }
+  mbuf_free(&conn->disc_buf);
+  free(conn->disc_svcs);
+  if (__atomic_exchange_n(&conn->disc_done_ready, false, __ATOMIC_ACQ_REL)) {
+    free(conn->disc_done.chars);
+    free(conn->disc_done.svcs);
+  }
+  memset(conn, 0, sizeof(*conn));
+}
+
+static struct gattc_conn_ops *find_conn_ops(int conn_id) {
+  if (conn_id < 0 || conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct gattc_conn_ops *co = &s_conn_ops[conn_id];
+  return (co->in_use ? co : NULL);
+}
+
+static struct gattc_conn_ops *get_conn_ops(int conn_id) {
+  if (conn_id < 0 || conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct gattc_conn_ops *co = &s_conn_ops[conn_id];
+  if (co->in_use) return co;
+  co->in_use = true;
+  co->conn_id = conn_id;
+  co->max_in_flight = MGOS_BT_GATTC_MAX_OPS_IN_FLIGHT;
+  STAILQ_INIT(&co->pending);
+  STAILQ_INIT(&co->in_flight);
+  STAILQ_INIT(&co->resolves);
+  return co;
+}
+
+static void gattc_op_complete(struct gattc_op *op,
+                              enum mgos_bt_gatt_status status,
+                              struct mg_str data) {
+  LOG((status == MGOS_BT_GATT_STATUS_OK ? LL_DEBUG : LL_ERROR),
+      ("op %d cid %d h %u st %d", op->type, op->conn_id, op->handle, status));
+  s_stats.num_completed++;
+  s_op_latency_us += mgos_uptime_micros() - op->queued_us;
+  if (op->cb != NULL) {
+    struct mgos_bt_gattc_op_result res = {
+        .conn_id = op->conn_id,
+        .handle = op->handle,
+        .status = status,
+        .data = data,
+    };
+    op->cb(&res, op->cb_arg);
+  }
+  if (op == s_reg_notify_op) s_reg_notify_op = NULL;
+  free(op);
+}
+
+static esp_err_t gattc_issue(struct gattc_op *op) {
+  switch (op->type) {
+    case GATTC_OP_CONNECT: {
+      return esp_ble_gattc_open(s_gattc_if, op->addr.addr, op->addr.type - 1,
+                                true);
+    }
+    case GATTC_OP_READ: {
+      return esp_ble_gattc_read_char(s_gattc_if, op->conn_id, op->handle,
+                                     ESP_GATT_AUTH_REQ_NONE);
+    }
+    case GATTC_OP_READ_MULTI: {
+      return esp_ble_gattc_read_multiple(s_gattc_if, op->conn_id,
+                                         (esp_gattc_multi_t *) op->data.p,
+                                         ESP_GATT_AUTH_REQ_NONE);
+    }
+    case GATTC_OP_WRITE: {
+      return esp_ble_gattc_write_char(
+          s_gattc_if, op->conn_id, op->handle, op->data.len,
+          (uint8_t *) op->data.p, ESP_GATT_WRITE_TYPE_RSP,
+          ESP_GATT_AUTH_REQ_NONE);
+    }
+    case GATTC_OP_WRITE_NR: {
+      return esp_ble_gattc_write_char(
+          s_gattc_if, op->conn_id, op->handle, op->data.len,
+          (uint8_t *) op->data.p, ESP_GATT_WRITE_TYPE_NO_RSP,
+          ESP_GATT_AUTH_REQ_NONE);
+    }
+    case GATTC_OP_WRITE_DESCR: {
+      return esp_ble_gattc_write_char_descr(
+          s_gattc_if, op->conn_id, op->handle, op->data.len,
+          (uint8_t *) op->data.p, ESP_GATT_WRITE_TYPE_RSP,
+          ESP_GATT_AUTH_REQ_NONE);
+    }
+    case GATTC_OP_SUBSCRIBE: {
+      struct conn *conn = find_by_conn_id(op->conn_id);
+      if (conn == NULL) return ESP_FAIL;
+      return esp_ble_gattc_register_for_notify(conn->iface, conn->c.addr.addr,
+                                               op->handle);
+    }
+    default:
+      break;
+  }
+  return ESP_FAIL;
+}
+
+static void gattc_check_timeouts(void *arg);
+static void gattc_discovery_poll(struct conn *conn);
+
+/* Ops issued while scan is paused hold the radio until they complete. */
+static void gattc_op_started(struct gattc_op *op) {
+  if (!esp32_bt_is_scanning()) return;
+  op->pause_gen = s_pause_gen;
+  s_num_active_ops++;
+}
+
+static void gattc_start_timeout_timer(void) {
+  if (s_timeout_timer != MGOS_INVALID_TIMER_ID) return;
+  s_timeout_timer = mgos_set_timer(MGOS_BT_GATTC_TIMEOUT_CHECK_INTERVAL_MS,
+                                   MGOS_TIMER_REPEAT, gattc_check_timeouts,
+                                   NULL);
+}
+
+static void gattc_pump(struct gattc_conn_ops *co) {
+  struct gattc_op *op;
+  int64_t now = mgos_uptime_micros();
+  while ((op = STAILQ_FIRST(&co->pending)) != NULL) {
+    if (co->queue_full || co->congested ||
+        co->num_in_flight >= co->max_in_flight) {
+      break;
+    }
+    if (op->type == GATTC_OP_SUBSCRIBE && s_reg_notify_op != NULL) break;
+    /* Wait for the radio, we'll be called again once scan pauses. */
+    if (!esp32_bt_gap_scan_pause()) break;
+    STAILQ_REMOVE_HEAD(&co->pending, next);
+    if (op->deferred) {
+      s_deferred_wait_us += now - op->queued_us;
+      op->deferred = false;
+    }
+    esp_err_t err = gattc_issue(op);
+    if (err != ESP_OK) {
+      gattc_op_complete(op, MGOS_BT_GATT_STATUS_UNLIKELY_ERROR,
+                        mg_mk_str_n(NULL, 0));
+      continue;
+    }
+    gattc_op_started(op);
+    if (op->type == GATTC_OP_SUBSCRIBE) s_reg_notify_op = op;
+    op->deadline_us =
+        now + mgos_sys_config_get_bt_gattc_op_timeout_ms() * 1000LL;
+    STAILQ_INSERT_TAIL(&co->in_flight, op, next);
+    co->num_in_flight++;
+  }
+  if (co->num_in_flight > 0) gattc_start_timeout_timer();
+}
+
+static void gattc_pump_all(void) {
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    if (s_conn_ops[i].in_use) gattc_pump(&s_conn_ops[i]);
+  }
+}
+
+static void gattc_pause_timer_cb(void *arg) {
+  s_pause_timer = MGOS_INVALID_TIMER_ID;
+  LOG(LL_DEBUG, ("%d ops still active, resuming scan", s_num_active_ops));
+  s_num_active_ops = 0;
+  if (++s_pause_gen == 0) s_pause_gen = 1;
+  if (STAILQ_EMPTY(&s_deferred_conns)) esp32_bt_gap_scan_resume();
+  (void) arg;
+}
+
+static void gattc_maybe_resume_scan(void) {
+  if (s_num_active_ops > 0) {
+    if (s_pause_timer == MGOS_INVALID_TIMER_ID) {
+      s_pause_timer = mgos_set_timer(MGOS_BT_GATTC_MAX_SCAN_PAUSE_MS, 0,
+                                     gattc_pause_timer_cb, NULL);
+    }
+    return;
+  }
+  mgos_clear_timer(s_pause_timer);
+  s_pause_timer = MGOS_INVALID_TIMER_ID;
+  if (STAILQ_EMPTY(&s_deferred_conns)) esp32_bt_gap_scan_resume();
+}
+
+static void gattc_op_finished(struct gattc_op *op) {
+  /* Only ops counted in the current pause hold it. */
+  if (op->pause_gen != s_pause_gen) return;
+  op->pause_gen = 0;
+  if (--s_num_active_ops == 0) gattc_maybe_resume_scan();
+}
+
+static struct gattc_op *find_connecting(const struct mg_str addr) {
+  struct gattc_op *op;
+  STAILQ_FOREACH(op, &s_connecting, next) {
+    if (addr.len == sizeof(op->addr.addr) &&
+        memcmp(op->addr.addr, addr.p, addr.len) == 0) {
+      return op;
+    }
+  }
+  /* Address is not known, e.g. MTU exchange failed, take the oldest. */
+  return (addr.len == 0 ? STAILQ_FIRST(&s_connecting) : NULL);
+}
+
+/* Connect failed or could not be issued after it was accepted, report it. */
+static void gattc_connect_failed_ev(const struct mgos_bt_addr *addr) {
+  struct mgos_bt_gatt_conn c = {.addr = *addr, .conn_id = -1};
+  mgos_event_trigger(MGOS_BT_GATTC_EV_DISCONNECT, &c);
+}
+
+/* Failure is reported, cancelled or not: callers wait for the outcome. */
+static void gattc_connect_done(struct gattc_op *op, int conn_id, bool ok) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  STAILQ_REMOVE(&s_connecting, op, gattc_op, next);
+  gattc_op_finished(op);
+  s_stats.num_connects++;
+  if (ok) {
+    s_connect_time_us += mgos_uptime_micros() - op->queued_us;
+    /* Opened despite the cancel, close it. */
+    if (op->cancelled) {
+      LOG(LL_DEBUG, ("%s: cancelled, closing",
+                     mgos_bt_addr_to_str(&op->addr, 0, buf)));
+      mgos_bt_gattc_disconnect(conn_id);
+    }
+  } else {
+    s_stats.num_connect_fails++;
+    LOG(LL_DEBUG, ("%s: connect failed",
+                   mgos_bt_addr_to_str(&op->addr, 0, buf)));
+    gattc_connect_failed_ev(&op->addr);
+  }
+  free(op);
+}
+
+static void gattc_check_timeouts(void *arg) {
+  bool any_in_flight = false;
+  int64_t now = mgos_uptime_micros();
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    struct gattc_conn_ops *co = &s_conn_ops[i];
+    struct gattc_op *op, *opt;
+    if (!co->in_use) continue;
+    STAILQ_FOREACH_SAFE(op, &co->in_flight, next, opt) {
+      if (now < op->deadline_us) continue;
+      STAILQ_REMOVE(&co->in_flight, op, gattc_op, next);
+      co->num_in_flight--;
+      /* Most likely the rejected one, don't count it against the others. */
+      if (op->type != GATTC_OP_SUBSCRIBE && co->num_rejected > 0) {
+        co->num_rejected--;
+      }
+      s_stats.num_timeouts++;
+      gattc_op_finished(op);
+      gattc_op_complete(op, MGOS_BT_GATT_STATUS_TIMEOUT, mg_mk_str_n(NULL, 0));
+    }
+    gattc_pump(co);
+    if (co->discovering) gattc_discovery_poll(&s_conns[i]);
+    if (co->num_in_flight > 0 || co->discovering) any_in_flight = true;
+  }
+  /* Connects have the same timeout, so they expire in order. */
+  struct gattc_op *op;
+  while ((op = STAILQ_FIRST(&s_connecting)) != NULL &&
+         now >= op->deadline_us) {
+    gattc_connect_done(op, -1, false /* ok */);
+  }
+  if (!any_in_flight && STAILQ_EMPTY(&s_connecting)) {
+    mgos_clear_timer(s_timeout_timer);
+    s_timeout_timer = MGOS_INVALID_TIMER_ID;
+  }
+  (void) arg;
+}
+
+/*
+ * Put rejected ops back at the head of the queue, in order, see above.
+ * With done_op, ops issued before it are rejected; without, all the
+ * in-flight ops are if that many have been rejected.
+ */
+static void gattc_requeue_rejected(struct gattc_conn_ops *co,
+                                   const struct gattc_op *done_op) {
+  int n = 0;
+  struct gattc_op *op, *opt, *last = NULL;
+  if (co->num_rejected == 0) return;
+  STAILQ_FOREACH(op, &co->in_flight, next) {
+    if (op->type != GATTC_OP_SUBSCRIBE) n++;
+  }
+  if (done_op == NULL && n > co->num_rejected) return;
+  STAILQ_FOREACH_SAFE(op, &co->in_flight, next, opt) {
+    if (op == done_op || co->num_rejected == 0) break;
+    if (op->type == GATTC_OP_SUBSCRIBE) continue;
+    STAILQ_REMOVE(&co->in_flight, op, gattc_op, next);
+    co->num_in_flight--;
+    co->num_rejected--;
+    n--;
+    gattc_op_finished(op);
+    if (last == NULL) {
+      STAILQ_INSERT_HEAD(&co->pending, op, next);
+    } else {
+      STAILQ_INSERT_AFTER(&co->pending, last, op, next);
+    }
+    last = op;
+  }
+  /* Rejected ops that timed out or subscriptions, nothing left to match. */
+  if (n == 0) co->num_rejected = 0;
+  /* Nothing in flight to clear the flag, probe with one op. */
+  if (co->num_in_flight == 0) co->queue_full = false;
+}
+
+static struct gattc_op *find_in_flight_op(struct gattc_conn_ops *co,
+                                          enum gattc_op_type type,
+                                          uint16_t handle) {
+  struct gattc_op *op, *res = NULL;
+  STAILQ_FOREACH(op, &co->in_flight, next) {
+    bool type_match = (op->type == type);
+    /* Writes without response complete with the same event. */
+    if (type == GATTC_OP_WRITE && op->type == GATTC_OP_WRITE_NR) {
+      type_match = true;
+    }
+    uint16_t op_handle = op->handle;
+    if (type == GATTC_OP_WRITE_DESCR && op->type == GATTC_OP_SUBSCRIBE &&
+        op->descr_handle != 0) {
+      type_match = true;
+      op_handle = op->descr_handle;
+    }
+    if (!type_match) continue;
+    if (op_handle == handle) return op;
+    /* Handle may be missing on error, fall back to the oldest one. */
+    if (res == NULL) res = op;
+  }
+  return res;
+}
+
+static uint16_t gattc_cached_cccd_handle(int conn_id, uint16_t handle) {
+  struct gattc_conn_ops *co = find_conn_ops(conn_id);
+  if (co == NULL) return 0;
+  for (int i = 0; i < co->num_chars; i++) {
+    if (co->chars[i].handle == handle) return co->chars[i].cccd_handle;
+  }
+  return 0;
+}
+
+/* Write CCCD once registration for notifications is done. */
+static esp_err_t gattc_subscribe_write_cccd(struct gattc_op *op) {
+  static const uint16_t notify_en = 1;
+  uint16_t count = 1;
+  esp_gattc_descr_elem_t descr;
+  /* Discovery table has it, unless peer has not been discovered. */
+  uint16_t descr_handle = gattc_cached_cccd_handle(op->conn_id, op->handle);
+  if (descr_handle == 0) {
+    esp_gatt_status_t st = esp_ble_gattc_get_descr_by_char_handle(
+        s_gattc_if, op->conn_id, op->handle, notify_descr_uuid, &descr,
+        &count);
+    if (st != ESP_GATT_OK || count == 0) {
+      LOG(LL_ERROR, ("CCCD not found h %u cid %d st %d", op->handle,
+                     op->conn_id, st));
+      return ESP_FAIL;
+    }
+    descr_handle = descr.handle;
+  }
+  op->descr_handle = descr_handle;
+  return esp_ble_gattc_write_char_descr(
+      s_gattc_if, op->conn_id, descr_handle, sizeof(notify_en),
+      (uint8_t *) &notify_en, ESP_GATT_WRITE_TYPE_RSP, ESP_GATT_AUTH_REQ_NONE);
+}
+
+static void gattc_resolve_complete(struct gattc_conn_ops *co,
+                                   struct gattc_resolve *r,
+                                   enum mgos_bt_gatt_status status,
+                                   uint16_t handle) {
+  struct mgos_bt_gattc_op_result res = {
+      .conn_id = co->conn_id,
+      .handle = handle,
+      .status = status,
+  };
+  STAILQ_REMOVE(&co->resolves, r, gattc_resolve, next);
+  r->cb(&res, r->cb_arg);
+  free(r);
+}
+
+static void gattc_conn_ops_free(struct gattc_conn_ops *co) {
+  struct gattc_op *op, *opt;
+  STAILQ_FOREACH_SAFE(op, &co->in_flight, next, opt) {
+    gattc_op_finished(op);
+    gattc_op_complete(op, MGOS_BT_GATT_STATUS_NOT_CONNECTED,
+                      mg_mk_str_n(NULL, 0));
+  }
+  STAILQ_FOREACH_SAFE(op, &co->pending, next, opt) {
+    gattc_op_complete(op, MGOS_BT_GATT_STATUS_NOT_CONNECTED,
+                      mg_mk_str_n(NULL, 0));
+  }
+  struct gattc_resolve *r, *rt;
+  STAILQ_FOREACH_SAFE(r, &co->resolves, next, rt) {
+    gattc_resolve_complete(co, r, MGOS_BT_GATT_STATUS_NOT_CONNECTED, 0);
+  }
+  free(co->chars);
+  memset(co, 0, sizeof(*co));
+}
+
+/*
+ * Per-handle notification callbacks.
+ *
+ * Registrations are added and removed on the mgos task and looked up on
+ * the BT task, under s_notify_lock. BT task callbacks are invoked with the
+ * lock held, so once removal returns the callback is not running and will
+ * not be called again. Callbacks that run on the BT task get the stack's
+ * buffer, others get the data in place in the BT event channel, so in
+ * neither case is the data copied to the heap.
+ */
+#define MGOS_BT_GATTC_MAX_NOTIFY_CBS 4 /* Per handle. */
+
+struct gattc_notify_reg {
+  int conn_id;
+  uint16_t handle;
+  uint32_t flags;
+  mgos_bt_gattc_notify_cb_t cb;
+  void *cb_arg;
+  SLIST_ENTRY(gattc_notify_reg) next;
+};
+
+static SLIST_HEAD(s_notify_regs, gattc_notify_reg) s_notify_regs =
+    SLIST_HEAD_INITIALIZER(s_notify_regs);
+static struct mgos_rlock_type *s_notify_lock = NULL;
+
+/* Notification forwarded to the mgos task. Followed by data. */
+struct gattc_notify_info {
+  int conn_id;
+  uint16_t handle;
+  bool is_notify;
+  uint16_t len;
+};
+
+/* Returns the number of matching registrations, copied to regs. */
+static int gattc_find_notify_regs(int conn_id, uint16_t handle,
+                                  uint32_t flags_mask, uint32_t flags,
+                                  struct gattc_notify_reg *regs) {
+  int n = 0;
+  struct gattc_notify_reg *r;
+  mgos_rlock(s_notify_lock);
+  SLIST_FOREACH(r, &s_notify_regs, next) {
+    if (r->conn_id != conn_id || r->handle != handle) continue;
+    if ((r->flags & flags_mask) != flags) continue;
+    regs[n++] = *r;
+  }
+  mgos_runlock(s_notify_lock);
+  return n;
+}
+
+/* Checks that reg has not been removed by an earlier callback. */
+static bool gattc_notify_reg_present(const struct gattc_notify_reg *reg) {
+  bool res = false;
+  struct gattc_notify_reg *r;
+  mgos_rlock(s_notify_lock);
+  SLIST_FOREACH(r, &s_notify_regs, next) {
+    if (r->conn_id == reg->conn_id && r->handle == reg->handle &&
+        r->cb == reg->cb && r->cb_arg == reg->cb_arg) {
+      res = true;
+      break;
+    }
+  }
+  mgos_runlock(s_notify_lock);
+  return res;
+}
+
+static void gattc_notify_mgos(void *arg) {
+  const struct gattc_notify_info *ni = (struct gattc_notify_info *) arg;
+  struct gattc_notify_reg regs[MGOS_BT_GATTC_MAX_NOTIFY_CBS];
+  struct mg_str data = mg_mk_str_n((const char *) (ni + 1), ni->len);
+  int n = gattc_find_notify_regs(ni->conn_id, ni->handle,
+                                 MGOS_BT_GATTC_NOTIFY_CB_BT_TASK, 0, regs);
+  for (int i = 0; i < n; i++) {
+    if (i > 0 && !gattc_notify_reg_present(&regs[i])) continue;
+    regs[i].cb(ni->conn_id, ni->handle, ni->is_notify, data, regs[i].cb_arg);
   }
-  return NULL;
+}
+
+/*
+ * Called on the BT task. Returns false if there are no callbacks for
+ * the handle, in which case the notification is delivered as an event.
+ */
+static bool gattc_notify_dispatch(const struct gattc_notify_evt_param *p) {
+  bool have_mgos_cbs = false, res = false;
+  struct gattc_notify_reg *r;
+  struct mg_str data = mg_mk_str_n((const char *) p->value, p->value_len);
+  /* Unlocked peek, for the common case of no registrations. */
+  if (SLIST_EMPTY(&s_notify_regs)) return false;
+  /* Held across the callbacks, see above. */
+  mgos_rlock(s_notify_lock);
+  SLIST_FOREACH(r, &s_notify_regs, next) {
+    if (r->conn_id != p->conn_id || r->handle != p->handle) continue;
+    res = true;
+    if (!(r->flags & MGOS_BT_GATTC_NOTIFY_CB_BT_TASK)) {
+      have_mgos_cbs = true;
+    } else {
+      r->cb(p->conn_id, p->handle, p->is_notify, data, r->cb_arg);
+    }
+  }
+  mgos_runlock(s_notify_lock);
+  if (have_mgos_cbs) {
+    struct gattc_notify_info *ni = (struct gattc_notify_info *)
+        mgos_bt_sched_reserve_bulk(gattc_notify_mgos, sizeof(*ni) + data.len);
+    if (ni == NULL) return res;
+    ni->conn_id = p->conn_id;
+    ni->handle = p->handle;
+    ni->is_notify = p->is_notify;
+    ni->len = data.len;
+    memcpy(ni + 1, data.p, data.len);
+    mgos_bt_sched_commit();
+  }
+  return res;
+}
+
+bool mgos_bt_gattc_add_notify_cb(int conn_id, uint16_t handle, uint32_t flags,
+                                 mgos_bt_gattc_notify_cb_t cb, void *cb_arg) {
+  int n = 0;
+  bool res = false;
+  struct gattc_notify_reg *r, *nr = NULL;
+  if (cb == NULL) return false;
+  mgos_rlock(s_notify_lock);
+  SLIST_FOREACH(r, &s_notify_regs, next) {
+    if (r->conn_id == conn_id && r->handle == handle) n++;
+  }
+  if (n >= MGOS_BT_GATTC_MAX_NOTIFY_CBS) {
+    LOG(LL_ERROR, ("%d/%u: too many notify callbacks", conn_id, handle));
+    goto out;
+  }
+  nr = (struct gattc_notify_reg *) calloc(1, sizeof(*nr));
+  if (nr == NULL) goto out;
+  nr->conn_id = conn_id;
+  nr->handle = handle;
+  nr->flags = flags;
+  nr->cb = cb;
+  nr->cb_arg = cb_arg;
+  SLIST_INSERT_HEAD(&s_notify_regs, nr, next);
+  res = true;
+out:
+  mgos_runlock(s_notify_lock);
+  return res;
+}
+
+/* Removes matching registrations; cb == NULL matches any. */
+static bool gattc_remove_notify_cbs(int conn_id, int handle,
+                                    mgos_bt_gattc_notify_cb_t cb,
+                                    void *cb_arg) {
+  bool res = false;
+  struct gattc_notify_reg *r, *rt;
+  mgos_rlock(s_notify_lock);
+  SLIST_FOREACH_SAFE(r, &s_notify_regs, next, rt) {
+    if (r->conn_id != conn_id) continue;
+    if (handle >= 0 && r->handle != handle) continue;
+    if (cb != NULL && (r->cb != cb || r->cb_arg != cb_arg)) continue;
+    SLIST_REMOVE(&s_notify_regs, r, gattc_notify_reg, next);
+    free(r);
+    res = true;
+  }
+  mgos_runlock(s_notify_lock);
+  return res;
+}
+
+bool mgos_bt_gattc_remove_notify_cb(int conn_id, uint16_t handle,
+                                    mgos_bt_gattc_notify_cb_t cb,
+                                    void *cb_arg) {
+  return gattc_remove_notify_cbs(conn_id, handle, cb, cb_arg);
+}
+
+/*
+ * A new connection got this id: anything still held for it belongs to an
+ * earlier one whose disconnect was not delivered (discovery table, notify
+ * registrations, queued ops) and must not be inherited.
+ */
+static void gattc_conn_reset(int conn_id) {
+  struct gattc_conn_ops *co = find_conn_ops(conn_id);
+  gattc_remove_notify_cbs(conn_id, -1, NULL, NULL);
+  if (co == NULL) return;
+  LOG(LL_WARN, ("cid %d: dropping state of the previous connection", conn_id));
+  gattc_conn_ops_free(co);
+}
+
+static void gattc_op_done_mgos(void *arg) {
+  const struct gattc_op_done_info *di = (struct gattc_op_done_info *) arg;
+  struct mg_str data = mg_mk_str_n((const char *) (di + 1), di->len);
+  enum mgos_bt_gatt_status st = esp32_bt_gatt_status_from_esp(di->status);
+  struct gattc_conn_ops *co = find_conn_ops(di->conn_id);
+  struct gattc_op *op = NULL;
+  switch (di->type) {
+    case GATTC_OP_CONNECT:
+      if (st == MGOS_BT_GATT_STATUS_OK) gattc_conn_reset(di->conn_id);
+      op = find_connecting(data);
+      if (op != NULL) {
+        gattc_connect_done(op, di->conn_id, (st == MGOS_BT_GATT_STATUS_OK));
+      }
+      return;
+    case GATTC_OP_DISCONNECT:
+      gattc_remove_notify_cbs(di->conn_id, -1, NULL, NULL);
+      if (co != NULL) gattc_conn_ops_free(co);
+      gattc_pump_all();
+      return;
+    case GATTC_OP_QUEUE_FULL: {
+      if (co == NULL) return;
+      co->queue_full = di->flag;
+      if (di->flag && !STAILQ_EMPTY(&co->in_flight)) {
+        /* One of the in-flight ops was rejected, back off. */
+        co->max_in_flight = MAX(co->num_in_flight - 1, 1);
+        co->num_rejected++;
+        gattc_requeue_rejected(co, NULL);
+        s_stats.num_queue_full++;
+      }
+      break;
+    }
+    case GATTC_OP_CONGEST: {
+      if (co == NULL) return;
+      co->congested = di->flag;
+      break;
+    }
+    case GATTC_OP_REG_FOR_NOTIFY: {
+      op = s_reg_notify_op;
+      s_reg_notify_op = NULL;
+      if (op == NULL) break;
+      co = find_conn_ops(op->conn_id);
+      if (st == MGOS_BT_GATT_STATUS_OK &&
+          gattc_subscribe_write_cccd(op) != ESP_OK) {
+        st = MGOS_BT_GATT_STATUS_UNLIKELY_ERROR;
+      }
+      if (st != MGOS_BT_GATT_STATUS_OK) {
+        STAILQ_REMOVE(&co->in_flight, op, gattc_op, next);
+        co->num_in_flight--;
+        gattc_op_finished(op);
+        gattc_op_complete(op, st, data);
+      }
+      /* Other subscriptions may be waiting. */
+      gattc_pump_all();
+      return;
+    }
+    default: {
+      if (co == NULL) return;
+      co->queue_full = false;
+      op = find_in_flight_op(co, di->type, di->handle);
+      if (op == NULL) break;
+      gattc_requeue_rejected(co, op);
+      STAILQ_REMOVE(&co->in_flight, op, gattc_op, next);
+      co->num_in_flight--;
+      if (co->max_in_flight < MGOS_BT_GATTC_MAX_OPS_IN_FLIGHT) {
+        co->max_in_flight++;
+      }
+      gattc_op_finished(op);
+      gattc_op_complete(op, st, data);
+      gattc_requeue_rejected(co, NULL);
+      break;
+    }
+  }
+  gattc_pump(co);
+}
+
+/* Forward completion to the mgos task. Must be called on the BT task. */
+static void gattc_op_done(enum gattc_op_type type, int conn_id,
+                          uint16_t handle, esp_gatt_status_t status,
+                          const void *data, size_t len) {
+  struct gattc_op_done_info *di =
+      (struct gattc_op_done_info *) mgos_bt_sched_reserve(
+          gattc_op_done_mgos, sizeof(*di) + len);
+  if (di == NULL) return;
+  di->type = type;
+  di->conn_id = conn_id;
+  di->handle = handle;
+  di->status = status;
+  di->flag = false;
+  di->len = len;
+  if (len > 0) memcpy(di + 1, data, len);
+  mgos_bt_sched_commit();
+}
+
+/* Connect has been issued, track it until OPEN. */
+static void gattc_connect_issued(struct gattc_op *op) {
+  gattc_op_started(op);
+  op->deadline_us =
+      mgos_uptime_micros() + MGOS_BT_GATTC_MAX_CONNECT_TIME_MS * 1000LL;
+  STAILQ_INSERT_TAIL(&s_connecting, op, next);
+  gattc_start_timeout_timer();
+}
+
+static void gattc_run_deferred(void *arg) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  struct gattc_op *op;
+  int64_t now = mgos_uptime_micros();
+  while ((op = STAILQ_FIRST(&s_deferred_conns)) != NULL) {
+    STAILQ_REMOVE_HEAD(&s_deferred_conns, next);
+    s_deferred_wait_us += now - op->queued_us;
+    if (gattc_issue(op) == ESP_OK) {
+      gattc_connect_issued(op);
+      continue;
+    }
+    LOG(LL_ERROR, ("%s: deferred connect failed",
+                   mgos_bt_addr_to_str(&op->addr, 0, buf)));
+    s_stats.num_connects++;
+    s_stats.num_connect_fails++;
+    gattc_connect_failed_ev(&op->addr);
+    free(op);
+  }
+  gattc_pump_all();
+  gattc_maybe_resume_scan();
+  (void) arg;
+}
+
+void esp32_bt_gattc_radio_free(void) {
+  if (mgos_bt_sched_reserve(gattc_run_deferred, 0) == NULL) return;
+  mgos_bt_sched_commit();
+}
+
+static struct gattc_op *gattc_op_new(enum gattc_op_type type, int conn_id,
+                                     uint16_t handle, const void *data,
+                                     int len, mgos_bt_gattc_op_cb_t cb,
+                                     void *cb_arg) {
+  struct gattc_op *op = (struct gattc_op *) calloc(1, sizeof(*op) + len);
+  if (op == NULL) return NULL;
+  op->type = type;
+  op->conn_id = conn_id;
+  op->handle = handle;
+  if (len > 0) {
+    memcpy(op + 1, data, len);
+    op->data = mg_mk_str_n((const char *) (op + 1), len);
+  }
+  op->cb = cb;
+  op->cb_arg = cb_arg;
+  op->queued_us = mgos_uptime_micros();
+  return op;
+}
+
+static bool gattc_submit(struct gattc_op *op) {
+  if (op == NULL) return false;
+  s_stats.num_ops++;
+  op->deferred = !esp32_bt_gap_scan_pause();
+  if (op->deferred) s_stats.num_deferred++;
+  if (op->type == GATTC_OP_CONNECT) {
+    if (op->deferred) {
+      STAILQ_INSERT_TAIL(&s_deferred_conns, op, next);
+      return true;
+    }
+    if (gattc_issue(op) != ESP_OK) {
+      free(op);
+      return false;
+    }
+    gattc_connect_issued(op);
+    return true;
+  }
+  struct gattc_conn_ops *co = NULL;
+  if (find_by_conn_id(op->conn_id) == NULL ||
+      (co = get_conn_ops(op->conn_id)) == NULL) {
+    free(op);
+    return false;
+  }
+  STAILQ_INSERT_TAIL(&co->pending, op, next);
+  gattc_pump(co);
+  return true;
+}
+
+bool mgos_bt_gattc_read_cb(int conn_id, uint16_t handle,
+                           mgos_bt_gattc_op_cb_t cb, void *cb_arg) {
+  LOG(LL_DEBUG, ("READ %d %u", conn_id, handle));
+  return gattc_submit(
+      gattc_op_new(GATTC_OP_READ, conn_id, handle, NULL, 0, cb, cb_arg));
+}
+
+bool mgos_bt_gattc_write_cb(int conn_id, uint16_t handle, const void *data,
+                            int len, mgos_bt_gattc_op_cb_t cb, void *cb_arg) {
+  LOG(LL_DEBUG, ("WRITE %d %u %d", conn_id, handle, len));
+  return gattc_submit(
+      gattc_op_new(GATTC_OP_WRITE, conn_id, handle, data, len, cb, cb_arg));
+}
+
+bool mgos_bt_gattc_write_descr_cb(int conn_id, uint16_t handle,
+                                  const void *data, int len,
+                                  mgos_bt_gattc_op_cb_t cb, void *cb_arg) {
+  LOG(LL_DEBUG, ("WRITE_DESCR %d %u %d", conn_id, handle, len));
+  return gattc_submit(gattc_op_new(GATTC_OP_WRITE_DESCR, conn_id, handle, data,
+                                   len, cb, cb_arg));
+}
+
+bool mgos_bt_gattc_subscribe_cb(int conn_id, uint16_t handle,
+                                mgos_bt_gattc_op_cb_t cb, void *cb_arg) {
+  LOG(LL_DEBUG, ("SUBSCRIBE %d %u", conn_id, handle));
+  return gattc_submit(
+      gattc_op_new(GATTC_OP_SUBSCRIBE, conn_id, handle, NULL, 0, cb, cb_arg));
+}
+
+/*
+ * Streaming writes.
+ *
+ * Buffer is split into chunks which are sent through the connection's
+ * operation queue, a window of chunks at a time. Writes without response
+ * complete as soon as they are handed to L2CAP, so the queue, paused while
+ * the link is congested, paces the stream.
+ */
+#define MGOS_BT_GATTC_STREAM_WINDOW (2 * MGOS_BT_GATTC_MAX_OPS_IN_FLIGHT)
+#define MGOS_BT_GATTC_MAX_LONG_WRITE_LEN 512
+
+struct gattc_stream {
+  int conn_id;
+  uint16_t handle;
+  bool no_rsp;
+  bool pumping;
+  uint16_t chunk_size;
+  size_t len, off;
+  int num_in_flight;
+  enum mgos_bt_gatt_status status;
+  int64_t start_us;
+  mgos_bt_gattc_op_cb_t cb;
+  void *cb_arg;
+  const char *data; /* Follows the struct. */
+};
+
+static uint8_t gattc_char_props(int conn_id, uint16_t handle) {
+  struct gattc_conn_ops *co = find_conn_ops(conn_id);
+  if (co == NULL) return 0;
+  for (int i = 0; i < co->num_chars; i++) {
+    if (co->chars[i].handle == handle) return co->chars[i].prop;
+  }
+  return 0;
+}
+
+static void gattc_stream_pump(struct gattc_stream *st);
+
+static void gattc_stream_chunk_cb(const struct mgos_bt_gattc_op_result *res,
+                                  void *cb_arg) {
+  struct gattc_stream *st = (struct gattc_stream *) cb_arg;
+  st->num_in_flight--;
+  if (res->status != MGOS_BT_GATT_STATUS_OK &&
+      st->status == MGOS_BT_GATT_STATUS_OK) {
+    st->status = res->status;
+  }
+  gattc_stream_pump(st);
+}
+
+static void gattc_stream_pump(struct gattc_stream *st) {
+  /* Chunks may complete synchronously, the outer loop will continue. */
+  if (st->pumping) return;
+  st->pumping = true;
+  while (st->status == MGOS_BT_GATT_STATUS_OK && st->off < st->len &&
+         st->num_in_flight < MGOS_BT_GATTC_STREAM_WINDOW) {
+    size_t n = MIN(st->len - st->off, st->chunk_size);
+    struct gattc_op *op = gattc_op_new(
+        (st->no_rsp ? GATTC_OP_WRITE_NR : GATTC_OP_WRITE), st->conn_id,
+        st->handle, NULL, 0, gattc_stream_chunk_cb, st);
+    if (op == NULL) {
+      st->status = MGOS_BT_GATT_STATUS_INSUF_RESOURCES;
+      break;
+    }
+    op->data = mg_mk_str_n(st->data + st->off, n);
+    st->off += n;
+    st->num_in_flight++;
+    if (!gattc_submit(op)) {
+      st->num_in_flight--;
+      st->status = MGOS_BT_GATT_STATUS_NOT_CONNECTED;
+    }
+  }
+  st->pumping = false;
+  if (st->num_in_flight > 0) return;
+  if (st->status == MGOS_BT_GATT_STATUS_OK && st->off < st->len) return;
+  int64_t elapsed_us = mgos_uptime_micros() - st->start_us;
+  LOG((st->status == MGOS_BT_GATT_STATUS_OK ? LL_DEBUG : LL_ERROR),
+      ("stream cid %d h %u%s: %u of %u bytes in %d ms (%d B/s), st %d",
+       st->conn_id, st->handle, (st->no_rsp ? " nr" : ""),
+       (unsigned) st->off, (unsigned) st->len, (int) (elapsed_us / 1000),
+       (int) (elapsed_us > 0 ? st->off * 1000000LL / elapsed_us : 0),
+       st->status));
+  if (st->cb != NULL) {
+    struct mgos_bt_gattc_op_result res = {
+        .conn_id = st->conn_id,
+        .handle = st->handle,
+        .status = st->status,
+    };
+    st->cb(&res, st->cb_arg);
+  }
+  free(st);
+}
+
+bool mgos_bt_gattc_write_stream(int conn_id, uint16_t handle, const void *data,
+                                size_t len, mgos_bt_gattc_op_cb_t cb,
+                                void *cb_arg) {
+  int mtu;
+  struct gattc_stream *st = NULL;
+  struct conn *conn = find_by_conn_id(conn_id);
+  if (conn == NULL || len == 0) return false;
+  mtu = MAX(conn->c.mtu, ESP_GATT_DEF_BLE_MTU_SIZE);
+  st = (struct gattc_stream *) calloc(1, sizeof(*st) + len);
+  if (st == NULL) return false;
+  st->conn_id = conn_id;
+  st->handle = handle;
+  st->no_rsp =
+      ((gattc_char_props(conn_id, handle) & ESP_GATT_CHAR_PROP_BIT_WRITE_NR) !=
+       0);
+  /* Longer request writes are done by the stack as prepared writes. */
+  st->chunk_size = (st->no_rsp ? mtu - 3 : MGOS_BT_GATTC_MAX_LONG_WRITE_LEN);
+  st->len = len;
+  st->status = MGOS_BT_GATT_STATUS_OK;
+  st->start_us = mgos_uptime_micros();
+  st->cb = cb;
+  st->cb_arg = cb_arg;
+  memcpy(st + 1, data, len);
+  st->data = (const char *) (st + 1);
+  LOG(LL_DEBUG, ("WRITE_STREAM %d %u %u%s", conn_id, handle, (unsigned) len,
+                 (st->no_rsp ? " nr" : "")));
+  gattc_stream_pump(st);
+  return true;
+}
+
+/*
+ * Batched reads.
+ *
+ * Values are read with a single Read Multiple request, if the peer supports
+ * it, and the response is split according to the expected lengths.
+ * Otherwise single reads are issued, all at once, and pipelined by the
+ * connection's operation queue.
+ */
+struct gattc_read_multi {
+  int conn_id;
+  int num_values;
+  int num_pending;
+  const uint16_t *lens;
+  struct mgos_bt_gattc_op_result *values;
+  char *data; /* Response of read multiple. */
+  mgos_bt_gattc_read_multi_cb_t cb;
+  void *cb_arg;
+};
+
+static void gattc_read_multi_done(struct gattc_read_multi *rm) {
+  enum mgos_bt_gatt_status st = MGOS_BT_GATT_STATUS_OK;
+  for (int i = 0; i < rm->num_values; i++) {
+    if (rm->values[i].status != MGOS_BT_GATT_STATUS_OK) {
+      st = rm->values[i].status;
+      break;
+    }
+  }
+  rm->cb(rm->conn_id, st, rm->num_values, rm->values, rm->cb_arg);
+  if (rm->data == NULL) {
+    for (int i = 0; i < rm->num_values; i++) {
+      free((void *) rm->values[i].data.p);
+    }
+  }
+  free(rm->data);
+  free(rm);
+}
+
+static void gattc_read_single_cb(const struct mgos_bt_gattc_op_result *res,
+                                 void *cb_arg) {
+  struct gattc_read_multi *rm = (struct gattc_read_multi *) cb_arg;
+  for (int i = 0; i < rm->num_values; i++) {
+    struct mgos_bt_gattc_op_result *v = &rm->values[i];
+    /* Duplicate handles are filled in order. */
+    if (v->handle != res->handle || v->data.len != (size_t) -1) continue;
+    v->status = res->status;
+    v->data = mg_strdup(res->data);
+    break;
+  }
+  if (--rm->num_pending == 0) gattc_read_multi_done(rm);
+}
+
+static void gattc_read_singles(struct gattc_read_multi *rm) {
+  rm->num_pending = rm->num_values + 1;
+  for (int i = 0; i < rm->num_values; i++) {
+    struct mgos_bt_gattc_op_result *v = &rm->values[i];
+    v->status = MGOS_BT_GATT_STATUS_OK;
+    v->data = mg_mk_str_n(NULL, (size_t) -1); /* Pending. */
+  }
+  for (int i = 0; i < rm->num_values; i++) {
+    struct mgos_bt_gattc_op_result *v = &rm->values[i];
+    if (!mgos_bt_gattc_read_cb(rm->conn_id, v->handle, gattc_read_single_cb,
+                               rm)) {
+      v->status = MGOS_BT_GATT_STATUS_NOT_CONNECTED;
+      v->data = mg_mk_str_n(NULL, 0);
+      rm->num_pending--;
+    }
+  }
+  /* Extra reference held while submitting, reads may complete right away. */
+  if (--rm->num_pending == 0) gattc_read_multi_done(rm);
+}
+
+/* Splits read multiple response. Returns false if lengths do not match. */
+static bool gattc_read_multi_split(struct gattc_read_multi *rm,
+                                   struct mg_str data) {
+  size_t off = 0;
+  rm->data = (char *) malloc(data.len > 0 ? data.len : 1);
+  if (rm->data == NULL) return false;
+  memcpy(rm->data, data.p, data.len);
+  for (int i = 0; i < rm->num_values; i++) {
+    struct mgos_bt_gattc_op_result *v = &rm->values[i];
+    bool last = (i == rm->num_values - 1);
+    size_t len = (last && rm->lens[i] == 0 ? data.len - off : rm->lens[i]);
+    if (off + len > data.len || (last && off + len != data.len)) {
+      free(rm->data);
+      rm->data = NULL;
+      return false;
+    }
+    v->status = MGOS_BT_GATT_STATUS_OK;
+    v->data = mg_mk_str_n(rm->data + off, len);
+    off += len;
+  }
+  return true;
+}
+
+static void gattc_read_multi_cb(const struct mgos_bt_gattc_op_result *res,
+                                void *cb_arg) {
+  struct gattc_read_multi *rm = (struct gattc_read_multi *) cb_arg;
+  switch (res->status) {
+    case MGOS_BT_GATT_STATUS_OK:
+      if (gattc_read_multi_split(rm, res->data)) {
+        gattc_read_multi_done(rm);
+        return;
+      }
+      LOG(LL_ERROR, ("Unexpected read multiple response length %d",
+                     (int) res->data.len));
+      break;
+    case MGOS_BT_GATT_STATUS_REQUEST_NOT_SUPPORTED: {
+      struct gattc_conn_ops *co = find_conn_ops(rm->conn_id);
+      if (co != NULL) co->no_read_multi = true;
+      break;
+    }
+    case MGOS_BT_GATT_STATUS_NOT_CONNECTED:
+    case MGOS_BT_GATT_STATUS_TIMEOUT:
+      for (int i = 0; i < rm->num_values; i++) {
+        rm->values[i].status = res->status;
+      }
+      gattc_read_multi_done(rm);
+      return;
+    default:
+      /* Single reads will tell which of the values could not be read. */
+      break;
+  }
+  gattc_read_singles(rm);
+}
+
+bool mgos_bt_gattc_read_multi(int conn_id, const uint16_t *handles,
+                              const uint16_t *lens, int num_handles,
+                              mgos_bt_gattc_read_multi_cb_t cb,
+                              void *cb_arg) {
+  struct gattc_read_multi *rm = NULL;
+  struct gattc_conn_ops *co = NULL;
+  struct gattc_op *op = NULL;
+  esp_gattc_multi_t multi;
+  if (cb == NULL || num_handles <= 0 || find_by_conn_id(conn_id) == NULL) {
+    return false;
+  }
+  rm = (struct gattc_read_multi *) calloc(
+      1, sizeof(*rm) + num_handles * (sizeof(*rm->values) + sizeof(*lens)));
+  if (rm == NULL) return false;
+  rm->conn_id = conn_id;
+  rm->num_values = num_handles;
+  rm->values = (struct mgos_bt_gattc_op_result *) (rm + 1);
+  rm->cb = cb;
+  rm->cb_arg = cb_arg;
+  for (int i = 0; i < num_handles; i++) {
+    rm->values[i].conn_id = conn_id;
+    rm->values[i].handle = handles[i];
+  }
+  co = find_conn_ops(conn_id);
+  if (lens == NULL || num_handles == 1 ||
+      num_handles > ESP_GATT_MAX_READ_MULTI_HANDLES ||
+      (co != NULL && co->no_read_multi)) {
+    gattc_read_singles(rm);
+    return true;
+  }
+  memcpy(rm->values + num_handles, lens, num_handles * sizeof(*lens));
+  rm->lens = (const uint16_t *) (rm->values + num_handles);
+  memset(&multi, 0, sizeof(multi));
+  multi.num_attr = num_handles;
+  memcpy(multi.handles, handles, num_handles * sizeof(*handles));
+  op = gattc_op_new(GATTC_OP_READ_MULTI, conn_id, handles[0], &multi,
+                    sizeof(multi), gattc_read_multi_cb, rm);
+  if (!gattc_submit(op)) {
+    free(rm);
+    return false;
+  }
+  return true;
 }
 
 bool mgos_bt_gattc_read(int conn_id, uint16_t handle) {
-  if (esp32_bt_is_scanning()) return false;
-  esp_err_t err = esp_ble_gattc_read_char(s_gattc_if, conn_id, handle, 0);
-  LOG(LL_DEBUG, ("READ %d: %d", conn_id, err));
-  return err == ESP_OK;
+  return mgos_bt_gattc_read_cb(conn_id, handle, NULL, NULL);
 }
 
 bool mgos_bt_gattc_subscribe(int conn_id, uint16_t handle) {
-  if (esp32_bt_is_scanning()) return false;
-  struct conn *conn = find_by_conn_id(conn_id);
-  if (conn == NULL) return false;
-  last_subscribe_conn_id = conn_id;
-  esp_err_t err =
-      esp_ble_gattc_register_for_notify(conn->iface, conn->c.addr.addr, handle);
-  LOG(LL_DEBUG, ("REG_NOTIF %d: %d", conn_id, err));
-  return err == ESP_OK;
+  return mgos_bt_gattc_subscribe_cb(conn_id, handle, NULL, NULL);
 }
 
 bool mgos_bt_gattc_write(int conn_id, uint16_t handle, const void *data,
                          int len) {
-  if (esp32_bt_is_scanning()) return false;
+  return mgos_bt_gattc_write_cb(conn_id, handle, data, len, NULL, NULL);
+}
+
+bool mgos_bt_gattc_connect_opts(const struct mgos_bt_addr *addr,
+                                const struct mgos_bt_gattc_conn_params *cp) {
+  /* Used by the stack when the connection is established. */
+  if (cp != NULL && cp->min_int > 0 &&
+      esp_ble_gap_set_prefer_conn_params((uint8_t *) addr->addr, cp->min_int,
+                                         cp->max_int, cp->latency,
+                                         cp->timeout) != ESP_OK) {
+    return false;
+  }
+  return mgos_bt_gattc_connect(addr);
+}
+
+bool mgos_bt_gattc_connect_cancel(const struct mgos_bt_addr *addr) {
+  struct gattc_op *op, *opt;
+  STAILQ_FOREACH_SAFE(op, &s_deferred_conns, next, opt) {
+    if (memcmp(op->addr.addr, addr->addr, sizeof(addr->addr)) != 0) continue;
+    STAILQ_REMOVE(&s_deferred_conns, op, gattc_op, next);
+    free(op);
+    return true;
+  }
+  /*
+   * Already issued. There is no way to cancel a pending open through GATTC,
+   * so try to drop it at the GAP level but keep tracking it: the outcome is
+   * reported as usual and the connection is closed if it opens anyway.
+   */
+  STAILQ_FOREACH(op, &s_connecting, next) {
+    if (memcmp(op->addr.addr, addr->addr, sizeof(addr->addr)) != 0) continue;
+    op->cancelled = true;
+    esp_ble_gap_disconnect((uint8_t *) addr->addr);
+    break;
+  }
+  return false;
+}
+
+bool mgos_bt_gattc_get_conn(int conn_id, struct mgos_bt_gatt_conn *conn) {
+  struct conn *c = find_by_conn_id(conn_id);
+  if (c == NULL) return false;
+  *conn = c->c;
+  return true;
+}
+
+bool mgos_bt_gattc_get_conn_params(int conn_id,
+                                   struct mgos_bt_gattc_conn_params *cp) {
   struct conn *conn = find_by_conn_id(conn_id);
-  if (conn == NULL) return false;
-  esp_err_t err =
-      esp_ble_gattc_write_char(conn->iface, conn_id, handle, len, (void *) data,
-                               ESP_GATT_WRITE_TYPE_RSP, 0);
-  LOG(LL_DEBUG, ("WRITE %d: %d", conn_id, err));
-  return err == ESP_OK;
+  if (conn == NULL || conn->params.min_int == 0) return false;
+  *cp = conn->params;
+  return true;
+}
+
+/* Called on the BT task. */
+void esp32_bt_gattc_conn_params_updated(const esp_bd_addr_t addr,
+                                        uint16_t conn_int, uint16_t latency,
+                                        uint16_t timeout) {
+  struct conn *conn = find_by_addr(addr);
+  if (conn == NULL) return;
+  conn->params.min_int = conn->params.max_int = conn_int;
+  conn->params.latency = latency;
+  conn->params.timeout = timeout;
 }
 
 bool mgos_bt_gattc_connect(const struct mgos_bt_addr *addr) {
   char buf[MGOS_BT_ADDR_STR_LEN];
-  uint8_t *a = (uint8_t *) addr->addr;
-  if (esp32_bt_is_scanning()) return false;
-  esp_err_t err = esp_ble_gattc_open(s_gattc_if, a, addr->type - 1, true);
   LOG(LL_DEBUG,
-      ("CONNECT %s: %d",
-       mgos_bt_addr_to_str(addr, MGOS_BT_ADDR_STRINGIFY_TYPE, buf), err));
-  return err == ESP_OK;
+      ("CONNECT %s",
+       mgos_bt_addr_to_str(addr, MGOS_BT_ADDR_STRINGIFY_TYPE, buf)));
+  struct gattc_op *op =
+      gattc_op_new(GATTC_OP_CONNECT, -1, 0, NULL, 0, NULL, NULL);
+  if (op != NULL) op->addr = *addr;
+  return gattc_submit(op);
+}
+
+void mgos_bt_gattc_get_stats(struct mgos_bt_gattc_stats *stats) {
+  *stats = s_stats;
+  if (s_stats.num_deferred > 0) {
+    stats->avg_deferred_wait_ms =
+        s_deferred_wait_us / 1000.0 / s_stats.num_deferred;
+  }
+  if (s_stats.num_completed > 0) {
+    stats->avg_op_latency_ms = s_op_latency_us / 1000.0 / s_stats.num_completed;
+  }
+  uint32_t num_ok = s_stats.num_connects - s_stats.num_connect_fails;
+  if (num_ok > 0) stats->avg_connect_ms = s_connect_time_us / 1000.0 / num_ok;
+}
+
+static void gattc_cache_file_name(const uint8_t *addr, char *buf,
+                                  size_t buf_size) {
+  snprintf(buf, buf_size, "btc_%02x%02x%02x%02x%02x%02x.bin", addr[0], addr[1],
+           addr[2], addr[3], addr[4], addr[5]);
+}
+
+static bool gattc_cache_enabled(const uint8_t *addr) {
+  return (mgos_sys_config_get_bt_gattc_attr_cache() &&
+          esp32_bt_gap_is_paired(addr));
+}
+
+static void gattc_cache_invalidate_mgos(void *arg) {
+  esp32_bt_gattc_cache_invalidate((const uint8_t *) arg);
+}
+
+void esp32_bt_gattc_cache_invalidate(const esp_bd_addr_t addr) {
+  char fname[32];
+  gattc_cache_file_name(addr, fname, sizeof(fname));
+  if (remove(fname) == 0) LOG(LL_DEBUG, ("Removed %s", fname));
+}
+
+static void gattc_cache_put_u16(struct mbuf *mb, uint16_t v) {
+  uint8_t b[2] = {v & 0xff, v >> 8};
+  mbuf_append(mb, b, sizeof(b));
+}
+
+static void gattc_cache_put_uuid(struct mbuf *mb,
+                                 const struct mgos_bt_uuid *uuid) {
+  uint8_t len = uuid->len;
+  mbuf_append(mb, &len, 1);
+  switch (uuid->len) {
+    case 2:
+      gattc_cache_put_u16(mb, uuid->uuid.uuid16);
+      break;
+    case 4:
+      gattc_cache_put_u16(mb, uuid->uuid.uuid32 & 0xffff);
+      gattc_cache_put_u16(mb, uuid->uuid.uuid32 >> 16);
+      break;
+    case 16:
+      mbuf_append(mb, uuid->uuid.uuid128, len);
+      break;
+  }
+}
+
+static void gattc_cache_save(const uint8_t *addr,
+                             const struct gattc_conn_ops *co) {
+  char fname[32], tmp_fname[36];
+  FILE *fp = NULL;
+  bool ok = false;
+  struct mbuf mb;
+  if (co->num_chars == 0 || !gattc_cache_enabled(addr)) return;
+  mbuf_init(&mb, GATTC_CACHE_HDR_SIZE + co->num_chars * 16);
+  gattc_cache_put_u16(&mb, GATTC_CACHE_MAGIC & 0xffff);
+  gattc_cache_put_u16(&mb, GATTC_CACHE_MAGIC >> 16);
+  uint8_t ver[2] = {GATTC_CACHE_VERSION, 0};
+  mbuf_append(&mb, ver, sizeof(ver));
+  gattc_cache_put_u16(&mb, co->num_chars);
+  for (int i = 0; i < co->num_chars; i++) {
+    const struct mgos_bt_gattc_discovery_entry *e = &co->chars[i];
+    gattc_cache_put_uuid(&mb, &e->svc);
+    gattc_cache_put_uuid(&mb, &e->chr);
+    gattc_cache_put_u16(&mb, e->handle);
+    gattc_cache_put_u16(&mb, e->cccd_handle);
+    mbuf_append(&mb, &e->prop, 1);
+  }
+  gattc_cache_file_name(addr, fname, sizeof(fname));
+  snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", fname);
+  fp = fopen(tmp_fname, "w");
+  if (fp == NULL) goto out;
+  ok = (fwrite(mb.buf, mb.len, 1, fp) == 1);
+  if (fclose(fp) != 0) ok = false;
+  /* Some filesystems can't rename over an existing file. */
+  if (ok && rename(tmp_fname, fname) != 0) {
+    remove(fname);
+    ok = (rename(tmp_fname, fname) == 0);
+  }
+  if (!ok) {
+    LOG(LL_ERROR, ("Failed to write %s", fname));
+    remove(tmp_fname);
+    goto out;
+  }
+  LOG(LL_DEBUG, ("Saved %d chars to %s", co->num_chars, fname));
+out:
+  mbuf_free(&mb);
+}
+
+/*
+ * Triggers DISCOVERY_RESULT events for the newly discovered entries,
+ * then DISCOVERY_DONE with the whole table.
+ */
+static void gattc_discovery_deliver(
+    const struct mgos_bt_gatt_conn *conn, enum mgos_bt_gatt_status st,
+    const struct mgos_bt_gattc_discovery_entry *entries, int num_entries,
+    const struct gattc_conn_ops *co) {
+  struct mgos_bt_gattc_discovery_done_arg da = {
+      .conn = *conn,
+      .status = st,
+  };
+  for (int i = 0; i < num_entries; i++) {
+    const struct mgos_bt_gattc_discovery_entry *e = &entries[i];
+    struct mgos_bt_gattc_discovery_result_arg di = {
+        .conn = *conn,
+        .svc = e->svc,
+        .chr = e->chr,
+        .handle = e->handle,
+        .prop = e->prop,
+    };
+    mgos_event_trigger(MGOS_BT_GATTC_EV_DISCOVERY_RESULT, &di);
+  }
+  if (co != NULL) {
+    da.num_entries = co->num_chars;
+    da.entries = co->chars;
+  }
+  mgos_event_trigger(MGOS_BT_GATTC_EV_DISCOVERY_DONE, &da);
+}
+
+static const struct mgos_bt_gattc_discovery_entry *gattc_find_char(
+    const struct gattc_conn_ops *co, const struct mgos_bt_uuid *svc,
+    const struct mgos_bt_uuid *chr) {
+  for (int i = 0; i < co->num_chars; i++) {
+    const struct mgos_bt_gattc_discovery_entry *e = &co->chars[i];
+    if (mgos_bt_uuid_cmp(&e->svc, svc) == 0 &&
+        mgos_bt_uuid_cmp(&e->chr, chr) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static bool gattc_svc_in_list(const struct mgos_bt_uuid *svc,
+                              const struct mgos_bt_uuid *svcs, int num_svcs) {
+  for (int i = 0; i < num_svcs; i++) {
+    if (mgos_bt_uuid_cmp(svc, &svcs[i]) == 0) return true;
+  }
+  return false;
+}
+
+/*
+ * Merges results of a partial discovery into the table, replacing entries
+ * of the services that have been rediscovered. Takes ownership of chars.
+ * Returns the number of entries added, which are at the end of the table.
+ */
+static int gattc_table_merge(struct gattc_conn_ops *co,
+                              struct mgos_bt_gattc_discovery_entry *chars,
+                              int num_chars) {
+  int n = 0, res = 0;
+  struct mgos_bt_gattc_discovery_entry *nc;
+  for (int i = 0; i < co->num_chars; i++) {
+    bool stale = false;
+    for (int j = 0; j < num_chars && !stale; j++) {
+      stale = (mgos_bt_uuid_cmp(&co->chars[i].svc, &chars[j].svc) == 0);
+    }
+    if (!stale) co->chars[n++] = co->chars[i];
+  }
+  co->num_chars = n;
+  if (num_chars == 0) goto out;
+  nc = (struct mgos_bt_gattc_discovery_entry *) realloc(
+      co->chars, (n + num_chars) * sizeof(*nc));
+  if (nc == NULL) goto out;
+  memcpy(nc + n, chars, num_chars * sizeof(*nc));
+  co->chars = nc;
+  co->num_chars = n + num_chars;
+  res = num_chars;
+out:
+  free(chars);
+  return res;
+}
+
+static bool gattc_start_discovery(int conn_id, const struct mgos_bt_uuid *svcs,
+                                  int num_svcs) {
+  esp_err_t err;
+  struct mgos_bt_uuid *svcs_copy = NULL;
+  struct conn *conn = find_by_conn_id(conn_id);
+  struct gattc_conn_ops *co = get_conn_ops(conn_id);
+  if (conn == NULL || co == NULL || co->discovering) return false;
+  if (num_svcs > 0) {
+    svcs_copy = (struct mgos_bt_uuid *) malloc(num_svcs * sizeof(*svcs));
+    if (svcs_copy == NULL) return false;
+    memcpy(svcs_copy, svcs, num_svcs * sizeof(*svcs));
+  }
+  /* Picked up on the BT task as searches complete. */
+  conn->disc_svcs = svcs_copy;
+  conn->disc_num_svcs = num_svcs;
+  conn->disc_svc_idx = 0;
+  err = esp_ble_gattc_search_service(
+      s_gattc_if, conn_id, (esp_bt_uuid_t *) svcs_copy /* NULL - all */);
+  LOG(LL_DEBUG, ("SRCH %d %d: %d", conn_id, num_svcs, err));
+  if (err != ESP_OK) {
+    conn->disc_svcs = NULL;
+    conn->disc_num_svcs = 0;
+    free(svcs_copy);
+    return false;
+  }
+  co->discovering = true;
+  /* Checks for a completion that could not be scheduled. */
+  gattc_start_timeout_timer();
+  return true;
+}
+
+/*
+ * Completes the lookups that can be completed after discovery of the
+ * given services (all, if num_svcs is 0) and starts discovery for the rest.
+ */
+static void gattc_run_resolves(struct gattc_conn_ops *co,
+                               enum mgos_bt_gatt_status st,
+                               const struct mgos_bt_uuid *svcs,
+                               int num_svcs) {
+  struct gattc_resolve *r, *rt;
+  STAILQ_FOREACH_SAFE(r, &co->resolves, next, rt) {
+    const struct mgos_bt_gattc_discovery_entry *e =
+        gattc_find_char(co, &r->svc, &r->chr);
+    if (e != NULL) {
+      gattc_resolve_complete(co, r, MGOS_BT_GATT_STATUS_OK, e->handle);
+    } else if (num_svcs == 0 || gattc_svc_in_list(&r->svc, svcs, num_svcs)) {
+      gattc_resolve_complete(co, r,
+                             (st == MGOS_BT_GATT_STATUS_OK
+                                  ? MGOS_BT_GATT_STATUS_INVALID_HANDLE
+                                  : st),
+                             0);
+    }
+  }
+  r = STAILQ_FIRST(&co->resolves);
+  if (r == NULL || co->discovering) return;
+  if (!gattc_start_discovery(co->conn_id, &r->svc, 1)) {
+    STAILQ_FOREACH_SAFE(r, &co->resolves, next, rt) {
+      gattc_resolve_complete(co, r, MGOS_BT_GATT_STATUS_UNLIKELY_ERROR, 0);
+    }
+  }
+}
+
+static void gattc_discovery_done_mgos(void *arg) {
+  struct gattc_discovery_done_info *di =
+      (struct gattc_discovery_done_info *) arg;
+  enum mgos_bt_gatt_status st = esp32_bt_gatt_status_from_esp(di->status);
+  struct gattc_conn_ops *co = get_conn_ops(di->conn.conn_id);
+  int num_new = di->num_chars;
+  if (co == NULL) {
+    free(di->chars);
+    gattc_discovery_deliver(&di->conn, MGOS_BT_GATT_STATUS_INSUF_RESOURCES,
+                            NULL, 0, NULL);
+    goto out;
+  }
+  co->discovering = false;
+  if (di->num_svcs == 0 && st == MGOS_BT_GATT_STATUS_OK) {
+    free(co->chars);
+    co->chars = di->chars;
+    co->num_chars = di->num_chars;
+    gattc_cache_save(di->conn.addr.addr, co);
+  } else {
+    /* Partial table would make the attribute cache incomplete, no saving. */
+    num_new = gattc_table_merge(co, di->chars, di->num_chars);
+  }
+  gattc_discovery_deliver(&di->conn, st, co->chars + co->num_chars - num_new,
+                          num_new, co);
+  gattc_run_resolves(co, st, di->svcs, di->num_svcs);
+out:
+  free(di->svcs);
+}
+
+/*
+ * Called on the BT task for every discovered service.
+ * Characteristics are fetched from the stack's database in one go,
+ * along with their CCCD handles, and appended to the discovery table.
+ */
+static void gattc_discovery_add_svc(
+    struct conn *conn, esp_gatt_if_t iface,
+    const struct gattc_search_res_evt_param *p) {
+  char buf[MGOS_BT_UUID_STR_LEN];
+  uint16_t count = 0;
+  esp_gattc_char_elem_t *els = NULL;
+  if (esp_ble_gattc_get_attr_count(iface, p->conn_id,
+                                   ESP_GATT_DB_CHARACTERISTIC, p->start_handle,
+                                   p->end_handle, 0, &count) != ESP_GATT_OK ||
+      count == 0) {
+    goto out;
+  }
+  els = (esp_gattc_char_elem_t *) calloc(count, sizeof(*els));
+  if (els == NULL) goto out;
+  if (esp_ble_gattc_get_all_char(iface, p->conn_id, p->start_handle,
+                                 p->end_handle, els, &count,
+                                 0) != ESP_GATT_OK) {
+    goto out;
+  }
+  LOG(LL_DEBUG, ("  svc %s: %u chars",
+                 esp32_bt_uuid_to_str(&p->srvc_id.uuid, buf), count));
+  for (uint16_t i = 0; i < count; i++) {
+    const esp_gattc_char_elem_t *el = &els[i];
+    struct mgos_bt_gattc_discovery_entry e = {
+        .svc = *(const struct mgos_bt_uuid *) &p->srvc_id.uuid,
+        .chr = *(const struct mgos_bt_uuid *) &el->uuid,
+        .handle = el->char_handle,
+        .prop = el->properties,
+    };
+    if (el->properties &
+        (ESP_GATT_CHAR_PROP_BIT_NOTIFY | ESP_GATT_CHAR_PROP_BIT_INDICATE)) {
+      uint16_t dcount = 1;
+      esp_gattc_descr_elem_t descr;
+      if (esp_ble_gattc_get_descr_by_char_handle(
+              iface, p->conn_id, el->char_handle, notify_descr_uuid, &descr,
+              &dcount) == ESP_GATT_OK &&
+          dcount > 0) {
+        e.cccd_handle = descr.handle;
+      }
+    }
+    mbuf_append(&conn->disc_buf, &e, sizeof(e));
+  }
+out:
+  free(els);
+}
+
+/* Called on the BT task when discovery completes, hands the table over. */
+static void gattc_discovery_done(struct conn *conn, esp_gatt_status_t status) {
+  struct gattc_discovery_done_info info = {
+      .conn = conn->c,
+      .status = status,
+      .svcs = conn->disc_svcs,
+      .num_svcs = conn->disc_num_svcs,
+  };
+  if (status == ESP_GATT_OK) {
+    mbuf_trim(&conn->disc_buf);
+    info.chars = (struct mgos_bt_gattc_discovery_entry *) conn->disc_buf.buf;
+    info.num_chars = conn->disc_buf.len / sizeof(*info.chars);
+    /* Ownership of the buffer has been passed on. */
+    mbuf_init(&conn->disc_buf, 0);
+  } else {
+    mbuf_free(&conn->disc_buf);
+  }
+  conn->disc_svcs = NULL;
+  conn->disc_num_svcs = 0;
+  struct gattc_discovery_done_info *di =
+      (struct gattc_discovery_done_info *) mgos_bt_sched_reserve(
+          gattc_discovery_done_mgos, sizeof(*di));
+  if (di != NULL) {
+    *di = info;
+    mgos_bt_sched_commit();
+    return;
+  }
+  /* Event queue is full, leave it for the timer so discovery is not stuck. */
+  conn->disc_done = info;
+  __atomic_store_n(&conn->disc_done_ready, true, __ATOMIC_RELEASE);
+}
+
+/* Called on the mgos task, delivers completion left by the BT task. */
+static void gattc_discovery_poll(struct conn *conn) {
+  if (!__atomic_load_n(&conn->disc_done_ready, __ATOMIC_ACQUIRE)) return;
+  struct gattc_discovery_done_info info = conn->disc_done;
+  /* Connection may have been removed meanwhile, then the copy is stale. */
+  if (!__atomic_exchange_n(&conn->disc_done_ready, false, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  gattc_discovery_done_mgos(&info);
+}
+
+/* Called on the BT task when a search completes. */
+static void gattc_discovery_next(struct conn *conn, esp_gatt_if_t iface,
+                                 esp_gatt_status_t status) {
+  if (status == ESP_GATT_OK && conn->disc_svc_idx + 1 < conn->disc_num_svcs) {
+    conn->disc_svc_idx++;
+    esp_bt_uuid_t *svc = (esp_bt_uuid_t *) &conn->disc_svcs[conn->disc_svc_idx];
+    if (esp_ble_gattc_search_service(iface, conn->c.conn_id, svc) == ESP_OK) {
+      return;
+    }
+    status = ESP_GATT_ERROR;
+  }
+  gattc_discovery_done(conn, status);
+}
+
+/* Bounds-checked reader of the cache file. */
+struct gattc_cache_reader {
+  const uint8_t *p, *end;
+  bool ok;
+};
+
+static const uint8_t *gattc_cache_get(struct gattc_cache_reader *r,
+                                      size_t len) {
+  const uint8_t *p = r->p;
+  if (!r->ok || (size_t)(r->end - r->p) < len) {
+    r->ok = false;
+    return NULL;
+  }
+  r->p += len;
+  return p;
+}
+
+static uint8_t gattc_cache_get_u8(struct gattc_cache_reader *r) {
+  const uint8_t *p = gattc_cache_get(r, 1);
+  return (p != NULL ? p[0] : 0);
+}
+
+static uint16_t gattc_cache_get_u16(struct gattc_cache_reader *r) {
+  const uint8_t *p = gattc_cache_get(r, 2);
+  return (p != NULL ? p[0] | (p[1] << 8) : 0);
+}
+
+static void gattc_cache_get_uuid(struct gattc_cache_reader *r,
+                                 struct mgos_bt_uuid *uuid) {
+  memset(uuid, 0, sizeof(*uuid));
+  uuid->len = gattc_cache_get_u8(r);
+  switch (uuid->len) {
+    case 2:
+      uuid->uuid.uuid16 = gattc_cache_get_u16(r);
+      break;
+    case 4:
+      uuid->uuid.uuid32 = gattc_cache_get_u16(r);
+      uuid->uuid.uuid32 |= ((uint32_t) gattc_cache_get_u16(r)) << 16;
+      break;
+    case 16: {
+      const uint8_t *p = gattc_cache_get(r, 16);
+      if (p != NULL) memcpy(uuid->uuid.uuid128, p, 16);
+      break;
+    }
+    default:
+      r->ok = false;
+      break;
+  }
+}
+
+/* Loads discovery table from the cache, if there is one. */
+static struct gattc_conn_ops *gattc_cache_load(int conn_id) {
+  struct gattc_conn_ops *res = NULL;
+  char fname[32];
+  size_t size = 0;
+  char *data = NULL;
+  struct gattc_conn_ops *co = NULL;
+  struct mgos_bt_gattc_discovery_entry *chars = NULL;
+  struct gattc_cache_reader r;
+  struct conn *conn = find_by_conn_id(conn_id);
+  if (conn == NULL || !gattc_cache_enabled(conn->c.addr.addr)) goto out;
+  gattc_cache_file_name(conn->c.addr.addr, fname, sizeof(fname));
+  data = cs_read_file(fname, &size);
+  if (data == NULL) goto out;
+  r.p = (const uint8_t *) data;
+  r.end = r.p + size;
+  r.ok = true;
+  uint32_t magic = gattc_cache_get_u16(&r);
+  magic |= ((uint32_t) gattc_cache_get_u16(&r)) << 16;
+  uint8_t version = gattc_cache_get_u8(&r);
+  gattc_cache_get_u8(&r); /* reserved */
+  int num_chars = gattc_cache_get_u16(&r);
+  if (r.ok && magic == GATTC_CACHE_MAGIC && version == GATTC_CACHE_VERSION &&
+      num_chars > 0) {
+    chars = (struct mgos_bt_gattc_discovery_entry *) calloc(num_chars,
+                                                            sizeof(*chars));
+    if (chars == NULL) goto out;
+    for (int i = 0; i < num_chars && r.ok; i++) {
+      struct mgos_bt_gattc_discovery_entry *e = &chars[i];
+      gattc_cache_get_uuid(&r, &e->svc);
+      gattc_cache_get_uuid(&r, &e->chr);
+      e->handle = gattc_cache_get_u16(&r);
+      e->cccd_handle = gattc_cache_get_u16(&r);
+      e->prop = gattc_cache_get_u8(&r);
+    }
+  }
+  if (!r.ok || r.p != r.end || chars == NULL) {
+    LOG(LL_ERROR, ("Invalid cache file %s", fname));
+    remove(fname);
+    goto out;
+  }
+  co = get_conn_ops(conn_id);
+  if (co == NULL) goto out;
+  free(co->chars);
+  co->chars = chars;
+  co->num_chars = num_chars;
+  chars = NULL;
+  LOG(LL_DEBUG, ("%d chars from %s", co->num_chars, fname));
+  res = co;
+out:
+  free(chars);
+  free(data);
+  return res;
+}
+
+/* Answers discovery from the cache, if there is one. */
+static bool gattc_cache_discover(int conn_id) {
+  struct conn *conn = find_by_conn_id(conn_id);
+  struct gattc_conn_ops *co = find_conn_ops(conn_id);
+  if (conn == NULL || (co != NULL && co->discovering)) return false;
+  co = gattc_cache_load(conn_id);
+  if (co == NULL) return false;
+  gattc_discovery_deliver(&conn->c, MGOS_BT_GATT_STATUS_OK, co->chars,
+                          co->num_chars, co);
+  gattc_run_resolves(co, MGOS_BT_GATT_STATUS_OK, NULL, 0);
+  return true;
+}
+
+const struct mgos_bt_gattc_discovery_entry *mgos_bt_gattc_get_discovery_table(
+    int conn_id, int *num_entries) {
+  struct gattc_conn_ops *co = find_conn_ops(conn_id);
+  *num_entries = (co != NULL ? co->num_chars : 0);
+  return (co != NULL ? co->chars : NULL);
 }
 
 bool mgos_bt_gattc_discover(int conn_id) {
-  esp_err_t err = esp_ble_gattc_search_service(s_gattc_if, conn_id, NULL);
-  LOG(LL_DEBUG, ("SRCH %d: %d", conn_id, err));
-  return err == ESP_OK;
+  if (gattc_cache_discover(conn_id)) {
+    s_stats.num_cache_hits++;
+    return true;
+  }
+  s_stats.num_cache_misses++;
+  return gattc_start_discovery(conn_id, NULL, 0);
+}
+
+bool mgos_bt_gattc_discover_svcs(int conn_id, const struct mgos_bt_uuid *svcs,
+                                 int num_svcs) {
+  if (num_svcs <= 0) return mgos_bt_gattc_discover(conn_id);
+  return gattc_start_discovery(conn_id, svcs, num_svcs);
+}
+
+bool mgos_bt_gattc_resolve_char(int conn_id, const struct mgos_bt_uuid *svc,
+                                const struct mgos_bt_uuid *chr,
+                                mgos_bt_gattc_op_cb_t cb, void *cb_arg) {
+  const struct mgos_bt_gattc_discovery_entry *e;
+  struct gattc_conn_ops *co = NULL;
+  struct gattc_resolve *r = NULL;
+  if (cb == NULL || find_by_conn_id(conn_id) == NULL ||
+      (co = get_conn_ops(conn_id)) == NULL) {
+    return false;
+  }
+  if (co->num_chars == 0 && !co->discovering) gattc_cache_load(conn_id);
+  r = (struct gattc_resolve *) calloc(1, sizeof(*r));
+  if (r == NULL) return false;
+  r->svc = *svc;
+  r->chr = *chr;
+  r->cb = cb;
+  r->cb_arg = cb_arg;
+  STAILQ_INSERT_TAIL(&co->resolves, r, next);
+  e = gattc_find_char(co, svc, chr);
+  if (e != NULL) {
+    gattc_resolve_complete(co, r, MGOS_BT_GATT_STATUS_OK, e->handle);
+  } else if (!co->discovering && !gattc_start_discovery(conn_id, svc, 1)) {
+    STAILQ_REMOVE(&co->resolves, r, gattc_resolve, next);
+    free(r);
+    return false;
+  }
+  /* Otherwise it will be looked at when current discovery completes. */
+  return true;
 }
 
 bool mgos_bt_gattc_disconnect(int conn_id) {
@@ -131,13 +1964,10 @@ static void disconnect(int conn_id, const esp_bd_addr_t addr) {
   struct mgos_bt_gatt_conn c = {.conn_id = conn_id};
   memcpy(c.addr.addr, addr, sizeof(c.addr.addr));
   LOG(LL_DEBUG, (" %d %s", conn_id, esp32_bt_addr_to_str(addr, buf)));
+  gattc_op_done(GATTC_OP_DISCONNECT, conn_id, 0, ESP_GATT_OK, NULL, 0);
   mgos_event_trigger_schedule(MGOS_BT_GATTC_EV_DISCONNECT, &c, sizeof(c));
-  while ((conn = find_by_conn_id(conn_id)) != NULL ||
-         (conn = find_by_addr(addr)) != NULL) {
-    SLIST_REMOVE(&s_conns, conn, conn, next);
-    LOG(LL_DEBUG, ("  removing %p", conn));
-    free(conn);
-  }
+  if ((conn = find_by_conn_id(conn_id)) != NULL) conn_remove(conn);
+  if ((conn = find_by_addr(addr)) != NULL) conn_remove(conn);
 }
 
 static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
@@ -156,16 +1986,27 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("OPEN if %d cid %u addr %s st %#hx mtu %d", iface, p->conn_id,
                esp32_bt_addr_to_str(p->remote_bda, buf), p->status, p->mtu));
+      if (p->status != ESP_GATT_OK) {
+        gattc_op_done(GATTC_OP_CONNECT, p->conn_id, 0, p->status,
+                      p->remote_bda, sizeof(p->remote_bda));
+      }
       if (p->status == ESP_GATT_OK) {
         struct conn *conn = find_by_addr(p->remote_bda);
+        if (conn != NULL && conn->c.conn_id != p->conn_id) {
+          /* Stale entry, peer reconnected with a different id. */
+          conn_remove(conn);
+          conn = NULL;
+        }
         if (conn == NULL) {
-          conn = calloc(1, sizeof(*conn));
+          conn = conn_add(p->conn_id, p->remote_bda);
+          if (conn == NULL) {
+            LOG(LL_ERROR, ("No slot for cid %u", p->conn_id));
+            esp_ble_gattc_close(iface, p->conn_id);
+            break;
+          }
           conn->iface = iface;
-          memcpy(conn->c.addr.addr, p->remote_bda, sizeof(conn->c.addr.addr));
           esp_ble_gattc_send_mtu_req(iface, p->conn_id);
-          SLIST_INSERT_HEAD(&s_conns, conn, next);
         }
-        conn->c.conn_id = p->conn_id;
         conn->c.mtu = p->mtu;
       } else {
         // We are about to disconnect anyway, no action needed.
@@ -190,46 +2031,33 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
     case ESP_GATTC_SEARCH_RES_EVT: {
       const struct gattc_search_res_evt_param *p = &ep->search_res;
       struct conn *conn = find_by_conn_id(p->conn_id);
-      uint16_t i = 0, count = 1;
-      esp_gattc_char_elem_t el;
-      LOG(LL_DEBUG, ("SEARCH_RES cid %u svc %s %hd", p->conn_id,
-                     esp32_bt_uuid_to_str(&p->srvc_id.uuid, buf), count));
-      while (esp_ble_gattc_get_all_char(iface, p->conn_id, p->start_handle,
-                                        p->end_handle, &el, &count,
-                                        i) == ESP_GATT_OK) {
-        char buf1[MGOS_BT_DEV_NAME_LEN], buf2[MGOS_BT_UUID_STR_LEN],
-            buf3[MGOS_BT_UUID_STR_LEN];
-        struct mgos_bt_gattc_discovery_result_arg di;
-        if (conn != NULL) di.conn = conn->c;
-        di.svc = *(struct mgos_bt_uuid *) &p->srvc_id.uuid;
-        di.chr = *(struct mgos_bt_uuid *) &el.uuid;
-        di.handle = el.char_handle;
-        di.prop = el.properties;
-        LOG(LL_DEBUG, ("  discovery: %s %s %s %hhx",
-                       mgos_bt_addr_to_str(&di.conn.addr, 1, buf1),
-                       mgos_bt_uuid_to_str(&di.svc, buf2),
-                       mgos_bt_uuid_to_str(&di.chr, buf3), di.prop));
-        mgos_event_trigger_schedule(MGOS_BT_GATTC_EV_DISCOVERY_RESULT, &di,
-                                    sizeof(di));
-        count = 1;
-        i++;
-      }
+      LOG(LL_DEBUG, ("SEARCH_RES cid %u svc %s %u-%u", p->conn_id,
+                     esp32_bt_uuid_to_str(&p->srvc_id.uuid, buf),
+                     p->start_handle, p->end_handle));
+      if (conn != NULL) gattc_discovery_add_svc(conn, iface, p);
       break;
     }
     case ESP_GATTC_SEARCH_CMPL_EVT: {
       const struct gattc_search_cmpl_evt_param *p = &ep->search_cmpl;
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("SEARCH_CMPL st %d cid %u", p->status, p->conn_id));
+      struct conn *conn = find_by_conn_id(p->conn_id);
+      if (conn != NULL) gattc_discovery_next(conn, iface, p->status);
       break;
     }
     case ESP_GATTC_READ_CHAR_EVT: {
       const struct gattc_read_char_evt_param *p = &ep->read;
+      enum cs_log_level ll = ll_from_status(p->status);
+      LOG(ll, ("READ st %d cid %u h %u val_len %u", p->status, p->conn_id,
+               p->handle, p->value_len));
+      gattc_op_done(GATTC_OP_READ, p->conn_id, p->handle, p->status, p->value,
+                    (p->status == ESP_GATT_OK ? p->value_len : 0));
       struct conn *conn = find_by_conn_id(p->conn_id);
       if (conn == NULL) break;
       struct mgos_bt_gattc_read_result res = {
           .conn = conn->c,
           .handle = p->handle,
-          .data = mg_strdup(mg_mk_str_n((char *) p->value, p->value_len))};
+          .data = mg_mk_str_n((char *) p->value, p->value_len)};
       mgos_event_trigger_schedule(MGOS_BT_GATTC_EV_READ_RESULT, &res,
                                   sizeof(res));
       break;
@@ -242,6 +2070,7 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       const struct gattc_write_evt_param *p = &ep->write;
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("WRITE st %d cid %u h %u", p->status, p->conn_id, p->handle));
+      gattc_op_done(GATTC_OP_WRITE, p->conn_id, p->handle, p->status, NULL, 0);
       break;
     }
     case ESP_GATTC_READ_DESCR_EVT: {
@@ -256,6 +2085,8 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll,
           ("WRITE_DESCR st %d cid %u h %u", p->status, p->conn_id, p->handle));
+      gattc_op_done(GATTC_OP_WRITE_DESCR, p->conn_id, p->handle, p->status,
+                    NULL, 0);
       break;
     }
     case ESP_GATTC_NOTIFY_EVT: {
@@ -264,12 +2095,13 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
           ("%s cid %u addr %s handle %u val_len %d",
            (p->is_notify ? "NOTIFY" : "INDICATE"), p->conn_id,
            esp32_bt_addr_to_str(p->remote_bda, buf), p->handle, p->value_len));
+      if (gattc_notify_dispatch(p)) break;
       struct conn *conn = find_by_conn_id(p->conn_id);
       if (conn == NULL) break;
       struct mgos_bt_gattc_notify_arg arg = {
           .conn = conn->c,
           .handle = p->handle,
-          .data = mg_strdup(mg_mk_str_n((char *) p->value, p->value_len)),
+          .data = mg_mk_str_n((char *) p->value, p->value_len),
       };
       mgos_event_trigger_schedule(MGOS_BT_GATTC_EV_NOTIFY, &arg, sizeof(arg));
       break;
@@ -295,6 +2127,11 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
     case ESP_GATTC_SRVC_CHG_EVT: {
       const struct gattc_srvc_chg_evt_param *p = &ep->srvc_chg;
       LOG(LL_DEBUG, ("SRVC_CHG %s", esp32_bt_addr_to_str(p->remote_bda, buf)));
+      void *addr = mgos_bt_sched_reserve(gattc_cache_invalidate_mgos,
+                                         sizeof(p->remote_bda));
+      if (addr == NULL) break;
+      memcpy(addr, p->remote_bda, sizeof(p->remote_bda));
+      mgos_bt_sched_commit();
       break;
     }
     case ESP_GATTC_ENC_CMPL_CB_EVT: {
@@ -306,8 +2143,13 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("CFG_MTU st %d cid %u mtu %d", p->status, p->conn_id, p->mtu));
       struct conn *conn = find_by_conn_id(p->conn_id);
+      /* The link is up even if the exchange failed, MTU stays default. */
+      gattc_op_done(GATTC_OP_CONNECT, p->conn_id, 0,
+                    (conn != NULL ? ESP_GATT_OK : p->status),
+                    (conn != NULL ? conn->c.addr.addr : NULL),
+                    (conn != NULL ? sizeof(conn->c.addr.addr) : 0));
       if (conn != NULL) {
-        conn->c.mtu = p->mtu;
+        if (p->status == ESP_GATT_OK) conn->c.mtu = p->mtu;
         mgos_event_trigger_schedule(MGOS_BT_GATTC_EV_CONNECT, &conn->c,
                                     sizeof(conn->c));
       }
@@ -337,6 +2179,15 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       const struct gattc_congest_evt_param *p = &ep->congest;
       LOG(LL_DEBUG,
           ("CONGEST cid %u%s", p->conn_id, (p->congested ? " congested" : "")));
+      struct gattc_op_done_info *di =
+          (struct gattc_op_done_info *) mgos_bt_sched_reserve(
+              gattc_op_done_mgos, sizeof(*di));
+      if (di == NULL) break;
+      memset(di, 0, sizeof(*di));
+      di->type = GATTC_OP_CONGEST;
+      di->conn_id = p->conn_id;
+      di->flag = p->congested;
+      mgos_bt_sched_commit();
       break;
     }
     case ESP_GATTC_BTH_SCAN_ENB_EVT: {
@@ -382,65 +2233,10 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
     case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
       const struct gattc_reg_for_notify_evt_param *p = &ep->reg_for_notify;
       enum cs_log_level ll = ll_from_status(p->status);
-      LOG(ll, ("REG_FOR_NOTIFY st %d h %u cid %d", p->status, p->handle,
-               last_subscribe_conn_id));
-
-      if (p->status != ESP_GATT_OK) {
-        break;
-      }
-
-      uint16_t count = 0;
-      uint16_t notify_en = 1;
-      esp_gatt_status_t ret_status = esp_ble_gattc_get_attr_count(
-          s_gattc_if, last_subscribe_conn_id, ESP_GATT_DB_DESCRIPTOR, 0, 0,
-          p->handle, &count);
-
-      if (ret_status != ESP_GATT_OK) {
-        LOG(LL_ERROR, ("esp_ble_gattc_get_attr_count h %u cid %d err %d",
-                       p->handle, last_subscribe_conn_id, ret_status));
-        break;
-      }
-
-      if (count <= 0) {
-        LOG(LL_ERROR,
-            ("descr not found h %u cid %d", p->handle, last_subscribe_conn_id));
-        break;
-      }
-
-      esp_gattc_descr_elem_t *descr_elem_result =
-          (esp_gattc_descr_elem_t *) calloc(count, sizeof(*descr_elem_result));
-      if (descr_elem_result == NULL) {
-        LOG(LL_ERROR, ("malloc error, gattc no mem"));
-        break;
-      }
-
-      ret_status = esp_ble_gattc_get_descr_by_char_handle(
-          s_gattc_if, last_subscribe_conn_id, p->handle, notify_descr_uuid,
-          descr_elem_result, &count);
-
-      if (ret_status != ESP_GATT_OK) {
-        LOG(LL_ERROR,
-            ("esp_ble_gattc_get_descr_by_char_handle h %u cid %d err %d",
-             p->handle, last_subscribe_conn_id, ret_status));
-      }
-
-      if (count > 0 && descr_elem_result[0].uuid.len == ESP_UUID_LEN_16 &&
-          descr_elem_result[0].uuid.uuid.uuid16 ==
-              ESP_GATT_UUID_CHAR_CLIENT_CONFIG) {
-        ret_status = esp_ble_gattc_write_char_descr(
-            s_gattc_if, last_subscribe_conn_id, descr_elem_result[0].handle,
-            sizeof(notify_en), (uint8_t *) &notify_en, ESP_GATT_WRITE_TYPE_RSP,
-            ESP_GATT_AUTH_REQ_NONE);
-      }
-
-      if (ret_status != ESP_GATT_OK) {
-        LOG(LL_ERROR,
-            ("esp_ble_gattc_write_char_descr h %u cid %d err %d",
-             descr_elem_result[0].handle, last_subscribe_conn_id, ret_status));
-      }
-
-      free(descr_elem_result);
-
+      LOG(ll, ("REG_FOR_NOTIFY st %d h %u", p->status, p->handle));
+      /* CCCD is written on the mgos task, which knows the connection. */
+      gattc_op_done(GATTC_OP_REG_FOR_NOTIFY, -1, p->handle, p->status, NULL,
+                    0);
       break;
     }
     case ESP_GATTC_UNREG_FOR_NOTIFY_EVT: {
@@ -460,6 +2256,8 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("READ_MUTIPLE st %d cid %u h %u val_len %u", p->status,
                p->conn_id, p->handle, p->value_len));
+      gattc_op_done(GATTC_OP_READ_MULTI, p->conn_id, p->handle, p->status,
+                    p->value, (p->status == ESP_GATT_OK ? p->value_len : 0));
       break;
     }
     case ESP_GATTC_QUEUE_FULL_EVT: {
@@ -467,6 +2265,16 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
       enum cs_log_level ll = ll_from_status(p->status);
       LOG(ll, ("QUEUE_FULL st %d cid %u is_full %d", p->status, p->conn_id,
                p->is_full));
+      struct gattc_op_done_info *di =
+          (struct gattc_op_done_info *) mgos_bt_sched_reserve(
+              gattc_op_done_mgos, sizeof(*di));
+      if (di == NULL) break;
+      memset(di, 0, sizeof(*di));
+      di->type = GATTC_OP_QUEUE_FULL;
+      di->conn_id = p->conn_id;
+      di->status = p->status;
+      di->flag = p->is_full;
+      mgos_bt_sched_commit();
       break;
     }
     case ESP_GATTC_SET_ASSOC_EVT: {
@@ -485,6 +2293,7 @@ static void esp32_bt_gattc_ev(esp_gattc_cb_event_t ev, esp_gatt_if_t iface,
 }
 
 bool esp32_bt_gattc_init(void) {
+  s_notify_lock = mgos_rlock_create();
   return (esp_ble_gattc_register_callback(esp32_bt_gattc_ev) == ESP_OK &&
           esp_ble_gattc_app_register(0) == ESP_OK);
 }
@@ -18,6 +18,7 @@
 #include "mgos_bt_gatts.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -31,71 +32,131 @@
 #include "common/mbuf.h"
 #include "common/queue.h"
 
+#include "mgos_bt_attr_tab.h"
+#include "mgos_bt_notify_queue.h"
+#include "mgos_bt_ring.h"
 #include "mgos_hal.h"
 #include "mgos_sys_config.h"
+#include "mgos_timers.h"
+#include "mgos_utils.h"
 
 #include "esp32_bt_gap.h"
+#include "esp32_bt_gatts.h"
 #include "esp32_bt_internal.h"
 
 #ifndef MGOS_BT_GATTS_MAX_PREPARED_WRITE_LEN
 #define MGOS_BT_GATTS_MAX_PREPARED_WRITE_LEN 4096
 #endif
 
-struct esp32_bt_service_attr_info;
-
+/*
+ * Attribute table and attribute info are either built at registration time
+ * or point to the static tables provided by the user, only handles are
+ * always allocated.
+ */
 struct esp32_bt_gatts_service_entry {
   const esp_gatts_attr_db_t *attr_db;
-  const struct esp32_bt_service_attr_info *attr_info;
+  const struct esp32_bt_gatts_attr_info *attr_info; /* May be NULL. */
+  uint16_t *handles; /* Assigned by the stack. */
   uint16_t num_attrs;
   uint16_t num_cccds;
+  uint16_t idx; /* Index of the service, in order of registration. */
   enum mgos_bt_gatt_sec_level sec_level;
   bool registered;
-  struct mgos_bt_uuid *uuids;
+  mgos_bt_gatts_ev_handler_t handler;
+  void *handler_arg;
+  enum mgos_bt_gatts_conn_profile conn_profile;
   SLIST_ENTRY(esp32_bt_gatts_service_entry) next;
 };
 
-struct esp32_bt_service_attr_info {
+/* Write without response credits, see mgos_bt_gatts_write_nr_grant(). */
+struct esp32_bt_gatts_write_nr_credits {
   uint16_t handle;
-  uint8_t char_prop;
-  mgos_bt_gatts_ev_handler_t handler;
-  void *handler_arg;
+  uint16_t credits_handle; /* Where grants are notified. */
+  uint32_t granted;
+  uint32_t used;
+  SLIST_ENTRY(esp32_bt_gatts_write_nr_credits) next;
+};
+
+/* Stored characteristic value, see mgos_bt_gatts_set_value(). */
+struct esp32_bt_gatts_value {
+  struct mgos_bt_notify_buf *buf;
+  uint32_t version;
+};
+
+/* Handle table entry, maps attribute handle to its service and attribute. */
+struct esp32_bt_gatts_attr_ref {
+  struct esp32_bt_gatts_service_entry *se;
+  uint16_t ai; /* Index of the attribute within the service. */
+  int16_t ci;  /* Index of the CCCD value if attribute is a CCCD, -1 if not. */
+  struct esp32_bt_gatts_value *val; /* Stored value, if any. */
 };
 
 struct esp32_bt_gatts_pending_write {
   uint16_t handle;
+  /* Chunks go straight to the handler, value is not buffered. */
+  bool stream;
+  size_t stream_len;
   struct mbuf value;
   SLIST_ENTRY(esp32_bt_gatts_pending_write) next;
 };
 
-struct esp32_bt_gatts_pending_ind {
-  uint16_t handle;
-  struct mg_str value;
-  bool need_confirm;
-  STAILQ_ENTRY(esp32_bt_gatts_pending_ind) next;
-};
-
 struct esp32_bt_gatts_connection_entry;
 
 struct esp32_bt_gatts_session_entry {
   struct esp32_bt_gatts_connection_entry *ce;
   struct mgos_bt_gatts_conn gsc;
   struct esp32_bt_gatts_service_entry *se;
+  enum mgos_bt_gatts_conn_profile conn_profile;
   uint16_t *cccd_values;
+  /* Snapshot of the stored value being read with a long read. */
+  struct mgos_bt_notify_buf *read_snap;
+  uint16_t read_snap_handle;
   SLIST_HEAD(pending_writes, esp32_bt_gatts_pending_write) pending_writes;
+  SLIST_HEAD(write_nr_credits, esp32_bt_gatts_write_nr_credits) credits;
   SLIST_ENTRY(esp32_bt_gatts_session_entry) next;
 };
 
 struct esp32_bt_gatts_connection_entry {
+  bool in_use;
   esp_gatt_if_t gatt_if;
   struct mgos_bt_gatt_conn gc;
   enum mgos_bt_gatt_sec_level sec_level;
   bool need_auth;
+  /*
+   * Indications are sent strictly one at a time, nothing else is sent while
+   * an indication is in flight. Notifications are pipelined, up to
+   * notify_window of them can be in flight. The window shrinks when the stack
+   * reports congestion and grows back as notifications are confirmed.
+   */
   bool ind_in_flight;
-  /* Notifications/indications are finicky, so we keep at most one in flight. */
-  int ind_queue_len;
-  STAILQ_HEAD(pending_inds, esp32_bt_gatts_pending_ind) pending_inds;
+  bool congested;
+  uint16_t notify_window;
+  uint16_t num_in_flight;
+  /* Not sent yet, capped at max_notify_queue_len. */
+  struct mgos_bt_notify_queue queue;
+  STAILQ_HEAD(in_flight_inds, mgos_bt_notify_entry) in_flight_inds;
+  /* Copied to the sessions' gsc.params whenever it changes. */
+  struct mgos_bt_gatts_conn_params params;
+  /*
+   * Profile of the parameter update in progress, NONE if there is none.
+   * params.profile only changes when the update succeeds.
+   */
+  enum mgos_bt_gatts_conn_profile pending_profile;
+  /* Update in progress times out or a failed one is retried at this time. */
+  int64_t profile_check_us;
+  /* No activity for bt.gatts.idle_timeout_ms, IDLE profile requested. */
+  bool idle;
+  int64_t last_activity_us;
+  /* Stats */
+  uint32_t num_sent;
+  uint32_t num_congested;
+  double busy_start;
+  double busy_time;
   SLIST_HEAD(sessions, esp32_bt_gatts_session_entry) sessions;
-  SLIST_ENTRY(esp32_bt_gatts_connection_entry) next;
+  /* Sessions indexed by service index, for quick lookup. */
+  struct esp32_bt_gatts_session_entry **sessions_by_svc;
+  uint16_t num_sessions_by_svc;
+  struct esp32_bt_gatts_connection_entry *next_by_addr;
 };
 
 struct esp32_bt_gatts_ev_info {
@@ -106,11 +167,20 @@ struct esp32_bt_gatts_ev_info {
 
 static SLIST_HEAD(s_svcs, esp32_bt_gatts_service_entry) s_svcs =
     SLIST_HEAD_INITIALIZER(s_svcs);
-static SLIST_HEAD(s_conns, esp32_bt_gatts_connection_entry) s_conns =
-    SLIST_HEAD_INITIALIZER(s_conns);
+static mgos_timer_id s_conn_check_timer = MGOS_INVALID_TIMER_ID;
+/* Indexed by conn_id, plus a hash by address. */
+static struct esp32_bt_gatts_connection_entry s_conns[ESP32_BT_MAX_CONNS];
+static struct esp32_bt_gatts_connection_entry
+    *s_conns_by_addr[ESP32_BT_ADDR_HASH_SIZE];
 
 static bool s_gatts_registered = false;
 static esp_gatt_if_t s_gatts_if;
+static uint16_t s_num_svcs = 0;
+
+/* Attributes of all services, struct esp32_bt_gatts_attr_ref entries. */
+static struct mgos_bt_attr_tab s_attr_tab = {
+    .entry_size = sizeof(struct esp32_bt_gatts_attr_ref),
+};
 
 const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
 const uint16_t char_decl_uuid = ESP_GATT_UUID_CHAR_DECLARE;
@@ -118,8 +188,17 @@ const uint16_t char_client_config_uuid = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
 
 static void esp32_bt_gatts_send_next_ind(
     struct esp32_bt_gatts_connection_entry *ce);
+static void esp32_dbe_to_uuid(const esp_gatts_attr_db_t *dbe,
+                              struct mgos_bt_uuid *uuid);
+static enum mgos_bt_gatt_status esp32_bt_gatts_call_handler(
+    struct esp32_bt_gatts_session_entry *sse, int ai, enum mgos_bt_gatts_ev ev,
+    void *ev_arg);
+static bool esp32_bt_gatts_read_value(struct esp32_bt_gatts_session_entry *sse,
+                                      const struct gatts_read_evt_param *p);
+static uint16_t get_max_notify_in_flight(void);
 static void esp32_bt_gatts_create_sessions(
     struct esp32_bt_gatts_connection_entry *ce);
+static void conn_active(struct esp32_bt_gatts_connection_entry *ce);
 static void esp32_bt_gatts_send_resp(struct mgos_bt_gatts_conn *gsc,
                                      uint16_t handle, uint32_t trans_id,
                                      enum mgos_bt_gatt_status status);
@@ -148,10 +227,40 @@ esp_gatt_status_t esp32_bt_gatt_get_status(enum mgos_bt_gatt_status st) {
       return ESP_GATT_ERR_UNLIKELY;
     case MGOS_BT_GATT_STATUS_INSUF_RESOURCES:
       return ESP_GATT_INSUF_RESOURCE;
+    case MGOS_BT_GATT_STATUS_TIMEOUT:
+    case MGOS_BT_GATT_STATUS_NOT_CONNECTED:
+      break;
   }
   return ESP_GATT_INTERNAL_ERROR;
 }
 
+enum mgos_bt_gatt_status esp32_bt_gatt_status_from_esp(esp_gatt_status_t st) {
+  switch (st) {
+    case ESP_GATT_OK:
+      return MGOS_BT_GATT_STATUS_OK;
+    case ESP_GATT_INVALID_HANDLE:
+      return MGOS_BT_GATT_STATUS_INVALID_HANDLE;
+    case ESP_GATT_READ_NOT_PERMIT:
+      return MGOS_BT_GATT_STATUS_READ_NOT_PERMITTED;
+    case ESP_GATT_WRITE_NOT_PERMIT:
+      return MGOS_BT_GATT_STATUS_WRITE_NOT_PERMITTED;
+    case ESP_GATT_INSUF_AUTHENTICATION:
+      return MGOS_BT_GATT_STATUS_INSUF_AUTHENTICATION;
+    case ESP_GATT_REQ_NOT_SUPPORTED:
+      return MGOS_BT_GATT_STATUS_REQUEST_NOT_SUPPORTED;
+    case ESP_GATT_INVALID_OFFSET:
+      return MGOS_BT_GATT_STATUS_INVALID_OFFSET;
+    case ESP_GATT_INSUF_AUTHORIZATION:
+      return MGOS_BT_GATT_STATUS_INSUF_AUTHORIZATION;
+    case ESP_GATT_INVALID_ATTR_LEN:
+      return MGOS_BT_GATT_STATUS_INVALID_ATT_VAL_LENGTH;
+    case ESP_GATT_INSUF_RESOURCE:
+      return MGOS_BT_GATT_STATUS_INSUF_RESOURCES;
+    default:
+      return MGOS_BT_GATT_STATUS_UNLIKELY_ERROR;
+  }
+}
+
 static void esp32_bt_register_services(void) {
   struct esp32_bt_gatts_service_entry *se;
   if (!s_gatts_registered) return;
@@ -178,29 +287,91 @@ static struct esp32_bt_gatts_service_entry *find_service_by_uuid(
   return NULL;
 }
 
+static struct esp32_bt_gatts_attr_ref *find_attr(uint16_t attr_handle) {
+  struct esp32_bt_gatts_attr_ref *ar =
+      (struct esp32_bt_gatts_attr_ref *) mgos_bt_attr_tab_get(&s_attr_tab,
+                                                              attr_handle);
+  return (ar != NULL && ar->se != NULL ? ar : NULL);
+}
+
 static struct esp32_bt_gatts_service_entry *find_service_by_attr_handle(
     uint16_t attr_handle, int *ai) {
-  struct esp32_bt_gatts_service_entry *se;
-  SLIST_FOREACH(se, &s_svcs, next) {
-    for (size_t i = 0; i < se->num_attrs; i++) {
-      if (se->attr_info[i].handle == attr_handle) {
-        if (ai != NULL) *ai = i;
-        return se;
-      }
-    }
+  const struct esp32_bt_gatts_attr_ref *ar = find_attr(attr_handle);
+  if (ar == NULL) return NULL;
+  if (ai != NULL) *ai = ar->ai;
+  return ar->se;
+}
+
+static bool is_cccd(const esp_gatts_attr_db_t *dbe);
+
+/* Add service's attributes to the handle table. */
+static bool add_attr_handles(struct esp32_bt_gatts_service_entry *se) {
+  uint16_t min_h = 0xffff, max_h = 0;
+  for (uint16_t i = 0; i < se->num_attrs; i++) {
+    uint16_t h = se->handles[i];
+    if (h < min_h) min_h = h;
+    if (h > max_h) max_h = h;
   }
-  return NULL;
+  if (se->num_attrs == 0) return true;
+  if (!mgos_bt_attr_tab_extend(&s_attr_tab, min_h, max_h)) return false;
+  int16_t ci = 0;
+  for (uint16_t i = 0; i < se->num_attrs; i++) {
+    struct esp32_bt_gatts_attr_ref *ar =
+        (struct esp32_bt_gatts_attr_ref *) mgos_bt_attr_tab_get(
+            &s_attr_tab, se->handles[i]);
+    ar->se = se;
+    ar->ai = i;
+    ar->ci = (is_cccd(&se->attr_db[i]) ? ci++ : -1);
+  }
+  return true;
 }
 
 static struct esp32_bt_gatts_connection_entry *find_connection(
     esp_gatt_if_t gatt_if, uint16_t conn_id) {
-  struct esp32_bt_gatts_connection_entry *ce = NULL;
-  SLIST_FOREACH(ce, &s_conns, next) {
-    if (ce->gatt_if == gatt_if && ce->gc.conn_id == conn_id) return ce;
+  if (conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct esp32_bt_gatts_connection_entry *ce = &s_conns[conn_id];
+  return (ce->in_use && ce->gatt_if == gatt_if ? ce : NULL);
+}
+
+static struct esp32_bt_gatts_connection_entry *find_connection_by_addr(
+    const esp_bd_addr_t addr) {
+  struct esp32_bt_gatts_connection_entry *ce =
+      s_conns_by_addr[esp32_bt_addr_hash(addr)];
+  for (; ce != NULL; ce = ce->next_by_addr) {
+    if (esp32_bt_addr_cmp(ce->gc.addr.addr, addr) == 0) return ce;
   }
   return NULL;
 }
 
+static struct esp32_bt_gatts_connection_entry *add_connection(
+    esp_gatt_if_t gatt_if, uint16_t conn_id, const esp_bd_addr_t addr) {
+  if (conn_id >= ESP32_BT_MAX_CONNS) return NULL;
+  struct esp32_bt_gatts_connection_entry *ce = &s_conns[conn_id];
+  if (ce->in_use) return NULL;
+  unsigned int h = esp32_bt_addr_hash(addr);
+  memset(ce, 0, sizeof(*ce));
+  ce->in_use = true;
+  ce->gatt_if = gatt_if;
+  ce->gc.conn_id = conn_id;
+  memcpy(ce->gc.addr.addr, addr, ESP_BD_ADDR_LEN);
+  ce->next_by_addr = s_conns_by_addr[h];
+  s_conns_by_addr[h] = ce;
+  return ce;
+}
+
+static void remove_connection(struct esp32_bt_gatts_connection_entry *ce) {
+  struct esp32_bt_gatts_connection_entry **pce =
+      &s_conns_by_addr[esp32_bt_addr_hash(ce->gc.addr.addr)];
+  for (; *pce != NULL; pce = &(*pce)->next_by_addr) {
+    if (*pce == ce) {
+      *pce = ce->next_by_addr;
+      break;
+    }
+  }
+  free(ce->sessions_by_svc);
+  memset(ce, 0, sizeof(*ce));
+}
+
 static struct esp32_bt_gatts_session_entry *find_session(esp_gatt_if_t gatt_if,
                                                          uint16_t conn_id,
                                                          uint16_t handle,
@@ -210,28 +381,44 @@ static struct esp32_bt_gatts_session_entry *find_session(esp_gatt_if_t gatt_if,
   if (ce == NULL) return NULL;
   struct esp32_bt_gatts_service_entry *se =
       find_service_by_attr_handle(handle, ai);
-  if (se == NULL) return NULL;
-  struct esp32_bt_gatts_session_entry *sse;
-  SLIST_FOREACH(sse, &ce->sessions, next) {
-    if (sse->se == se) return sse;
-  }
-  return NULL;
+  if (se == NULL || se->idx >= ce->num_sessions_by_svc) return NULL;
+  return ce->sessions_by_svc[se->idx];
 }
 
-static bool is_paired(const esp_bd_addr_t addr) {
-  bool result = false;
-  int num = esp_ble_get_bond_device_num();
-  esp_ble_bond_dev_t *list = (esp_ble_bond_dev_t *) calloc(num, sizeof(*list));
-  if (list != NULL && esp_ble_get_bond_device_list(&num, list) == ESP_OK) {
-    for (int i = 0; i < num; i++) {
-      if (esp32_bt_addr_cmp(addr, list[i].bd_addr) == 0) {
-        result = true;
-        break;
-      }
-    }
+static bool is_streamed(const struct esp32_bt_gatts_attr_ref *ar) {
+  return (ar->ci < 0 && ar->se->attr_info != NULL &&
+          ar->se->attr_info[ar->ai].stream_prepared_writes);
+}
+
+static enum mgos_bt_gatt_status esp32_bt_gatts_stream_write(
+    struct esp32_bt_gatts_session_entry *sse, uint16_t handle,
+    uint32_t trans_id, uint16_t offset, struct mg_str data,
+    enum mgos_bt_gatts_write_stage stage) {
+  const struct esp32_bt_gatts_attr_ref *ar = find_attr(handle);
+  struct mgos_bt_gatts_write_arg arg = {
+      .handle = handle,
+      .trans_id = trans_id,
+      .offset = offset,
+      .data = data,
+      .need_rsp = true,
+      .stage = stage,
+  };
+  esp32_dbe_to_uuid(&ar->se->attr_db[ar->ai], &arg.uuid);
+  return esp32_bt_gatts_call_handler(sse, ar->ai, MGOS_BT_GATTS_EV_WRITE, &arg);
+}
+
+/* If any chunks were delivered to the handler, tells it to discard them. */
+static void esp32_bt_gatts_free_pending_write(
+    struct esp32_bt_gatts_session_entry *sse,
+    struct esp32_bt_gatts_pending_write *pw, uint32_t trans_id, bool cancel) {
+  if (cancel && pw->stream && pw->stream_len > 0) {
+    esp32_bt_gatts_stream_write(sse, pw->handle, trans_id, 0,
+                                mg_mk_str_n(NULL, 0),
+                                MGOS_BT_GATTS_WRITE_STAGE_CANCEL);
   }
-  free(list);
-  return result;
+  mbuf_free(&pw->value);
+  memset(pw, 0, sizeof(*pw));
+  free(pw);
 }
 
 static void esp32_bt_gatts_add_pending_write(
@@ -244,7 +431,8 @@ static void esp32_bt_gatts_add_pending_write(
   if (pw == NULL) {
     pw = (struct esp32_bt_gatts_pending_write *) calloc(1, sizeof(*pw));
     pw->handle = handle;
-    mbuf_init(&pw->value, data.len);
+    pw->stream = is_streamed(find_attr(handle));
+    if (!pw->stream) mbuf_init(&pw->value, data.len);
     SLIST_INSERT_HEAD(&sse->pending_writes, pw, next);
   }
   esp_gatt_status_t status = ESP_GATT_OK;
@@ -254,23 +442,31 @@ static void esp32_bt_gatts_add_pending_write(
       .attr_value.len = data.len,
       .attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE,
   };
-  if (offset != pw->value.len) {
+  size_t len = (pw->stream ? pw->stream_len : pw->value.len);
+  if (offset != len) {
     LOG(LL_ERROR, ("Invalid prepare write request: %u vs %u",
-                   (unsigned int) pw->value.len, offset));
+                   (unsigned int) len, offset));
     status = ESP_GATT_INVALID_OFFSET;
+  } else if (pw->stream) {
+    enum mgos_bt_gatt_status st = esp32_bt_gatts_stream_write(
+        sse, handle, trans_id, offset, data, MGOS_BT_GATTS_WRITE_STAGE_CHUNK);
+    status = esp32_bt_gatt_get_status(st);
+    if (status == ESP_GATT_OK) pw->stream_len += data.len;
   } else if (pw->value.len > MGOS_BT_GATTS_MAX_PREPARED_WRITE_LEN) {
     status = ESP_GATT_PREPARE_Q_FULL;
   } else {
     mbuf_append(&pw->value, data.p, data.len);
-    memcpy(rsp.attr_value.value, data.p, data.len);
     LOG(LL_DEBUG, ("%d bytes pending for %u", (int) pw->value.len, pw->handle));
   }
   if (status != ESP_GATT_OK) {
     SLIST_REMOVE(&sse->pending_writes, pw, esp32_bt_gatts_pending_write, next);
-    mbuf_free(&pw->value);
-    free(pw);
+    esp32_bt_gatts_free_pending_write(sse, pw, trans_id, true /* cancel */);
   }
   if (need_rsp) {
+    /* Prepare write response echoes the value back. */
+    if (status == ESP_GATT_OK) {
+      memcpy(rsp.attr_value.value, data.p, data.len);
+    }
     esp_ble_gatts_send_response(sse->ce->gatt_if, sse->ce->gc.conn_id, trans_id,
                                 status, &rsp);
   }
@@ -294,28 +490,44 @@ static enum mgos_bt_gatt_status esp32_bt_gatts_call_handler(
   struct esp32_bt_gatts_service_entry *se = sse->se;
   /* Invoke attr handler if defined, otherwise fall back to service-wide
    * handler. */
-  if (se->attr_info[ai].handler != NULL) {
+  if (se->attr_info != NULL && se->attr_info[ai].handler != NULL) {
     return se->attr_info[ai].handler(&sse->gsc, ev, ev_arg,
                                      se->attr_info[ai].handler_arg);
   } else {
-    return se->attr_info[0].handler(&sse->gsc, ev, ev_arg,
-                                    se->attr_info[0].handler_arg);
+    return se->handler(&sse->gsc, ev, ev_arg, se->handler_arg);
+  }
+}
+
+static struct esp32_bt_gatts_write_nr_credits *find_credits(
+    struct esp32_bt_gatts_session_entry *sse, uint16_t handle) {
+  struct esp32_bt_gatts_write_nr_credits *cr;
+  SLIST_FOREACH(cr, &sse->credits, next) {
+    if (cr->handle == handle) return cr;
   }
+  return NULL;
+}
+
+/* Returns false if the client has run out of credits for the handle. */
+static bool take_credit(struct esp32_bt_gatts_session_entry *sse,
+                        uint16_t handle) {
+  struct esp32_bt_gatts_write_nr_credits *cr = find_credits(sse, handle);
+  if (cr == NULL) return true; /* Not flow controlled. */
+  if (cr->used == cr->granted) return false;
+  cr->used++;
+  return true;
 }
 
 static void esp32_bt_gatts_do_write(struct esp32_bt_gatts_session_entry *sse,
                                     uint16_t handle, uint32_t trans_id,
                                     uint16_t offset, struct mg_str data,
                                     bool need_rsp, bool prepared) {
-  int ai;
   char buf[MGOS_BT_UUID_STR_LEN], buf2[MGOS_BT_UUID_STR_LEN];
   struct esp32_bt_gatts_service_entry *se = sse->se;
-  for (ai = 0; ai < se->num_attrs; ai++) {
-    if (se->attr_info[ai].handle == handle) break;
-  }
+  const struct esp32_bt_gatts_attr_ref *ar = find_attr(handle);
+  if (ar == NULL || ar->se != se) return;
+  int ai = ar->ai;
   const esp_gatts_attr_db_t *dbe = &se->attr_db[ai];
-  if (dbe == NULL) return;
-  if (is_cccd(dbe)) {
+  if (ar->ci >= 0) {
     /* Write to client config descriptor - handle notification flag change. */
     if (offset != 0 || data.len != 2) {
       LOG(LL_ERROR, ("Invalid CCCD write request: %d bytes @ %d",
@@ -324,15 +536,10 @@ static void esp32_bt_gatts_do_write(struct esp32_bt_gatts_session_entry *sse,
                                MGOS_BT_GATT_STATUS_REQUEST_NOT_SUPPORTED);
       return;
     }
-    int ci = 0;
-    /* Find the corresponding value. Can't fail since we found the session. */
-    for (int i = 0; i < se->num_attrs; i++) {
-      if (se->attr_info[i].handle == handle) break;
-      if (is_cccd(&se->attr_db[i])) ci++;
-    }
+    int ci = ar->ci;
     ai--; /* Previous entry is the char value attr. */
     struct mgos_bt_gatts_notify_mode_arg arg = {
-        .handle = se->attr_info[ai].handle,
+        .handle = se->handles[ai],
     };
     switch (data.p[0]) {
       case 1:
@@ -343,11 +550,12 @@ static void esp32_bt_gatts_do_write(struct esp32_bt_gatts_session_entry *sse,
         break;
     }
     esp32_dbe_to_uuid(&se->attr_db[ai], &arg.uuid);
+    /* Set before calling the handler, so it can grant credits right away. */
+    uint16_t old_cccd = sse->cccd_values[ci];
+    memcpy(&sse->cccd_values[ci], data.p, 2);
     enum mgos_bt_gatt_status st = esp32_bt_gatts_call_handler(
         sse, ai, MGOS_BT_GATTS_EV_NOTIFY_MODE, &arg);
-    if (st == MGOS_BT_GATT_STATUS_OK) {
-      memcpy(&sse->cccd_values[ci], data.p, 2);
-    }
+    if (st != MGOS_BT_GATT_STATUS_OK) sse->cccd_values[ci] = old_cccd;
     LOG(LL_DEBUG, ("%s: notify mode %d st %d",
                    mgos_bt_uuid_to_str(&arg.uuid, buf), arg.mode, st));
     if (need_rsp) {
@@ -355,11 +563,16 @@ static void esp32_bt_gatts_do_write(struct esp32_bt_gatts_session_entry *sse,
     }
     return;
   }
+  if (!need_rsp && !prepared && !take_credit(sse, handle)) {
+    LOG(LL_DEBUG, ("h %u: out of credits, write dropped", handle));
+    return;
+  }
   struct mgos_bt_gatts_write_arg arg = {
+      .handle = handle,
       .trans_id = trans_id,
       .offset = offset,
       .data = data,
-      .need_rsp = true,
+      .need_rsp = need_rsp,
   };
   esp32_dbe_to_uuid(dbe, &arg.uuid);
   LOG(LL_DEBUG,
@@ -385,15 +598,16 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
       struct esp32_bt_gatts_service_entry *se =
           find_service_by_uuid(&p->svc_uuid);
       if (se == NULL || se->num_attrs != p->num_handle) break;
-      for (uint16_t i = 0; i < p->num_handle; i++) {
-        ((struct esp32_bt_service_attr_info *) se->attr_info)[i].handle =
-            p->handles[i];
+      memcpy(se->handles, p->handles, p->num_handle * sizeof(*se->handles));
+      if (!add_attr_handles(se)) {
+        LOG(LL_ERROR, ("Failed to add %s to handle table",
+                       esp32_bt_uuid_to_str(&p->svc_uuid, buf)));
+        break;
       }
-      uint16_t svch = se->attr_info[0].handle;
+      uint16_t svch = se->handles[0];
       LOG(LL_INFO,
           ("Starting BT service %s", esp32_bt_uuid_to_str(&p->svc_uuid, buf)));
       esp_ble_gatts_start_service(svch);
-      free(ei->ep.add_attr_tab.handles);
       break;
     }
     case ESP_GATTS_CONNECT_EVT: {
@@ -420,7 +634,7 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
       if (mgos_sys_config_get_bt_gatts_require_pairing()) {
         esp32_bt_addr_to_str(p->remote_bda, buf);
         int max_devices = mgos_sys_config_get_bt_max_paired_devices();
-        if (is_paired(p->remote_bda)) {
+        if (esp32_bt_gap_is_paired(p->remote_bda)) {
           LOG(LL_INFO, ("%s: Already paired", buf));
         } else if (!mgos_bt_gap_get_pairing_enable()) {
           LOG(LL_ERROR, ("%s: pairing required but is not allowed", buf));
@@ -443,13 +657,17 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
         break;
       }
       struct esp32_bt_gatts_connection_entry *ce =
-          (struct esp32_bt_gatts_connection_entry *) calloc(1, sizeof(*ce));
-      ce->gatt_if = ei->gatts_if;
-      ce->gc.conn_id = p->conn_id;
+          add_connection(ei->gatts_if, p->conn_id, p->remote_bda);
+      if (ce == NULL) {
+        LOG(LL_ERROR, ("%s: no slot for cid %u, dropping connection",
+                       esp32_bt_addr_to_str(p->remote_bda, buf), p->conn_id));
+        esp_ble_gatts_close(ei->gatts_if, p->conn_id);
+        break;
+      }
       ce->gc.mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
-      memcpy(ce->gc.addr.addr, p->remote_bda, ESP_BD_ADDR_LEN);
-      STAILQ_INIT(&ce->pending_inds);
-      SLIST_INSERT_HEAD(&s_conns, ce, next);
+      mgos_bt_notify_queue_init(&ce->queue);
+      STAILQ_INIT(&ce->in_flight_inds);
+      ce->notify_window = get_max_notify_in_flight();
       if (sec_act != 0) {
         LOG(LL_DEBUG,
             ("%s: Requesting encryption%s",
@@ -489,17 +707,11 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
                                     ESP_GATT_INVALID_HANDLE, NULL);
         break;
       }
+      conn_active(sse->ce);
       const esp_gatts_attr_db_t *dbe = &sse->se->attr_db[ai];
-      if (is_cccd(dbe)) {
+      int ci = find_attr(p->handle)->ci;
+      if (ci >= 0) {
         /* Read of CCCD - send notification flag value. */
-        struct esp32_bt_gatts_service_entry *se = sse->se;
-        int ci = 0;
-        /* Find the corresponding value. Can't fail since we found the session.
-         */
-        for (int i = 0; i < se->num_attrs; i++) {
-          if (se->attr_info[i].handle == p->handle) break;
-          if (is_cccd(&se->attr_db[i])) ci++;
-        }
         esp_gatt_rsp_t rsp = {
             .attr_value =
                 {
@@ -515,6 +727,7 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
                                     ESP_GATT_OK, &rsp);
         break;
       }
+      if (esp32_bt_gatts_read_value(sse, p)) break;
       struct mgos_bt_gatts_write_arg arg = {
           .handle = p->handle,
           .trans_id = p->trans_id,
@@ -538,6 +751,7 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
           find_session(ei->gatts_if, p->conn_id, p->handle, NULL);
       if (sse != NULL) {
         struct mg_str data = MG_MK_STR_N((char *) p->value, p->len);
+        conn_active(sse->ce);
         if (p->is_prep) {
           esp32_bt_gatts_add_pending_write(sse, p->handle, p->trans_id,
                                            p->offset, data, p->need_rsp);
@@ -549,7 +763,6 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
         esp_ble_gatts_send_response(ei->gatts_if, p->conn_id, p->trans_id,
                                     ESP_GATT_INVALID_HANDLE, NULL);
       }
-      free(ei->ep.write.value);
       break;
     }
     case ESP_GATTS_EXEC_WRITE_EVT: {
@@ -557,23 +770,27 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
       struct esp32_bt_gatts_connection_entry *ce =
           find_connection(ei->gatts_if, p->conn_id);
       if (ce == NULL) break;
+      conn_active(ce);
       struct esp32_bt_gatts_session_entry *sse;
       SLIST_FOREACH(sse, &ce->sessions, next) {
         struct esp32_bt_gatts_pending_write *pw, *pwt;
         SLIST_FOREACH_SAFE(pw, &sse->pending_writes, next, pwt) {
           SLIST_REMOVE(&sse->pending_writes, pw, esp32_bt_gatts_pending_write,
                        next);
-          if (p->exec_write_flag == ESP_GATT_PREP_WRITE_EXEC) {
+          bool exec = (p->exec_write_flag == ESP_GATT_PREP_WRITE_EXEC);
+          if (exec && pw->stream) {
+            enum mgos_bt_gatt_status st = esp32_bt_gatts_stream_write(
+                sse, pw->handle, p->trans_id, pw->stream_len,
+                mg_mk_str_n(NULL, 0), MGOS_BT_GATTS_WRITE_STAGE_COMMIT);
+            esp32_bt_gatts_send_resp(&sse->gsc, pw->handle, p->trans_id, st);
+          } else if (exec) {
             esp32_bt_gatts_do_write(sse, pw->handle, p->trans_id, 0,
                                     mg_mk_str_n(pw->value.buf, pw->value.len),
                                     true /* need_rsp */, true /* is_prep */);
-
           } else {
-            /* Must be cancel - do nothing, simply discard the write. */
+            /* Must be cancel - discard the write. */
           }
-          mbuf_free(&pw->value);
-          memset(pw, 0, sizeof(*pw));
-          free(pw);
+          esp32_bt_gatts_free_pending_write(sse, pw, p->trans_id, !exec);
         }
       }
       break;
@@ -587,22 +804,23 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
       SLIST_FOREACH_SAFE(sse, &ce->sessions, next, sset) {
         struct esp32_bt_gatts_pending_write *pw, *pwt;
         SLIST_FOREACH_SAFE(pw, &sse->pending_writes, next, pwt) {
-          mbuf_free(&pw->value);
-          memset(pw, 0, sizeof(*pw));
-          free(pw);
+          esp32_bt_gatts_free_pending_write(sse, pw, 0, true /* cancel */);
+        }
+        struct esp32_bt_gatts_write_nr_credits *cr, *crt;
+        SLIST_FOREACH_SAFE(cr, &sse->credits, next, crt) {
+          free(cr);
         }
         esp32_bt_gatts_call_handler(sse, 0, MGOS_BT_GATTS_EV_DISCONNECT, NULL);
+        mgos_bt_notify_buf_unref(sse->read_snap);
         free(sse->cccd_values);
         free(sse);
       }
-      struct esp32_bt_gatts_pending_ind *pi, *pit;
-      STAILQ_FOREACH_SAFE(pi, &ce->pending_inds, next, pit) {
-        free((void *) pi->value.p);
-        memset(pi, 0, sizeof(*pi));
-        free(pi);
+      struct mgos_bt_notify_entry *pi, *pit;
+      STAILQ_FOREACH_SAFE(pi, &ce->in_flight_inds, next, pit) {
+        mgos_bt_notify_entry_free(pi);
       }
-      SLIST_REMOVE(&s_conns, ce, esp32_bt_gatts_connection_entry, next);
-      free(ce);
+      mgos_bt_notify_queue_clear(&ce->queue);
+      remove_connection(ce);
       break;
     }
     case ESP_GATTS_CONF_EVT: {
@@ -610,11 +828,17 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
       struct esp32_bt_gatts_connection_entry *ce =
           find_connection(ei->gatts_if, p->conn_id);
       if (ce == NULL) break;
-      ce->ind_in_flight = false;
-      if (!STAILQ_EMPTY(&ce->pending_inds)) {
-        struct esp32_bt_gatts_pending_ind *pi = STAILQ_FIRST(&ce->pending_inds);
-        STAILQ_REMOVE_HEAD(&ce->pending_inds, next);
-        ce->ind_queue_len--;
+      /* Confirmations arrive in the order notifications were sent. */
+      if (!STAILQ_EMPTY(&ce->in_flight_inds)) {
+        struct mgos_bt_notify_entry *pi = STAILQ_FIRST(&ce->in_flight_inds);
+        STAILQ_REMOVE_HEAD(&ce->in_flight_inds, next);
+        ce->num_in_flight--;
+        if (pi->need_confirm) {
+          ce->ind_in_flight = false;
+        } else if (!ce->congested &&
+                   ce->notify_window < get_max_notify_in_flight()) {
+          ce->notify_window++;
+        }
         /*
          * NB: p->handle is invalid for indications.
          * https://github.com/espressif/esp-idf/issues/2838
@@ -630,48 +854,197 @@ static void esp32_bt_gatts_ev_mgos(void *arg) {
           esp32_bt_gatts_call_handler(sse, ai, MGOS_BT_GATTS_EV_IND_CONFIRM,
                                       &arg);
         }
-        free((void *) pi->value.p);
-        memset(pi, 0, sizeof(*pi));
-        free(pi);
+        mgos_bt_notify_entry_free(pi);
       }
       esp32_bt_gatts_send_next_ind(ce);
       break;
     }
+    case ESP_GATTS_CONGEST_EVT: {
+      const struct gatts_congest_evt_param *p = &ei->ep.congest;
+      struct esp32_bt_gatts_connection_entry *ce =
+          find_connection(ei->gatts_if, p->conn_id);
+      if (ce == NULL) break;
+      if (p->congested && !ce->congested) {
+        /* Halve the window and wait for congestion to clear. */
+        ce->notify_window = MAX(ce->notify_window / 2, 1);
+        ce->num_congested++;
+      }
+      ce->congested = p->congested;
+      esp32_bt_gatts_send_next_ind(ce);
+      break;
+    }
     default:
       break;
   }
-  memset(ei, 0, sizeof(*ei));
-  free(ei);
 };
 
 static void run_on_mgos_task(esp_gatt_if_t gatts_if, esp_gatts_cb_event_t ev,
                              esp_ble_gatts_cb_param_t *ep) {
+  /* Variable-length data is copied inline, right after the event info. */
+  size_t extra_len = 0;
+  switch (ev) {
+    case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+      extra_len =
+          ep->add_attr_tab.num_handle * sizeof(*ep->add_attr_tab.handles);
+      break;
+    case ESP_GATTS_WRITE_EVT:
+      extra_len = ep->write.len;
+      break;
+    default:
+      break;
+  }
   struct esp32_bt_gatts_ev_info *ei =
-      (struct esp32_bt_gatts_ev_info *) calloc(1, sizeof(*ei));
+      (struct esp32_bt_gatts_ev_info *) mgos_bt_sched_reserve(
+          esp32_bt_gatts_ev_mgos, sizeof(*ei) + extra_len);
+  if (ei == NULL) return;
   ei->gatts_if = gatts_if;
   ei->ev = ev;
   memcpy(&ei->ep, ep, sizeof(ei->ep));
-  switch (ei->ev) {
+  switch (ev) {
     case ESP_GATTS_CREAT_ATTR_TAB_EVT: {
-      /* Make a copy of handles */
-      size_t len =
-          ep->add_attr_tab.num_handle * sizeof(*ep->add_attr_tab.handles);
-      uint16_t *handles_copy = (uint16_t *) malloc(len);
-      memcpy(handles_copy, ep->add_attr_tab.handles, len);
+      uint16_t *handles_copy = (uint16_t *) (ei + 1);
+      memcpy(handles_copy, ep->add_attr_tab.handles, extra_len);
       ei->ep.add_attr_tab.handles = handles_copy;
       break;
     }
     case ESP_GATTS_WRITE_EVT: {
-      /* Make a copy of the value */
-      uint8_t *value_copy = (uint8_t *) malloc(ep->write.len);
-      memcpy(value_copy, ep->write.value, ep->write.len);
+      uint8_t *value_copy = (uint8_t *) (ei + 1);
+      memcpy(value_copy, ep->write.value, extra_len);
       ei->ep.write.value = value_copy;
       break;
     }
     default:
       break;
   }
-  mgos_invoke_cb(esp32_bt_gatts_ev_mgos, ei, false /* from_isr */);
+  mgos_bt_sched_commit();
+}
+
+/* Connection parameters of the profiles, in BLE units. */
+static const struct {
+  uint16_t min_int, max_int, latency, timeout;
+} s_conn_profiles[] = {
+    [MGOS_BT_GATTS_CONN_PROFILE_NONE] = {0, 0, 0, 0},
+    /* Timeout must exceed (1 + latency) * max_int * 2 = 5 s. */
+    [MGOS_BT_GATTS_CONN_PROFILE_IDLE] = {0x140, 0x190, 4, 600},
+    [MGOS_BT_GATTS_CONN_PROFILE_INTERACTIVE] = {0x30, 0x50, 0, 400},
+    [MGOS_BT_GATTS_CONN_PROFILE_BULK] = {0x06, 0x0c, 0, 400},
+};
+
+#define ESP32_BT_GATTS_CONN_CHECK_MS 1000
+/* Controller gives up on the procedure after 40 s, allow for that. */
+#define ESP32_BT_GATTS_PROFILE_UPDATE_TIMEOUT_MS 45000
+#define ESP32_BT_GATTS_PROFILE_RETRY_MS 5000
+
+static void conn_check(void *arg);
+
+static void conn_check_timer_start(void) {
+  if (s_conn_check_timer != MGOS_INVALID_TIMER_ID) return;
+  s_conn_check_timer = mgos_set_timer(ESP32_BT_GATTS_CONN_CHECK_MS,
+                                      MGOS_TIMER_REPEAT, conn_check, NULL);
+}
+
+static void conn_profile_retry_later(
+    struct esp32_bt_gatts_connection_entry *ce) {
+  ce->profile_check_us =
+      mgos_uptime_micros() + ESP32_BT_GATTS_PROFILE_RETRY_MS * 1000LL;
+  conn_check_timer_start();
+}
+
+static void sync_conn_params(struct esp32_bt_gatts_connection_entry *ce) {
+  struct esp32_bt_gatts_session_entry *sse;
+  SLIST_FOREACH(sse, &ce->sessions, next) {
+    sse->gsc.params = ce->params;
+  }
+}
+
+/*
+ * Requests the most demanding profile of the sessions, if it changed.
+ * One update at a time: with one in progress, this is re-evaluated when it
+ * completes.
+ */
+static void conn_apply_profile(struct esp32_bt_gatts_connection_entry *ce) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  enum mgos_bt_gatts_conn_profile prof = MGOS_BT_GATTS_CONN_PROFILE_NONE;
+  struct esp32_bt_gatts_session_entry *sse;
+  if (ce->idle) {
+    prof = MGOS_BT_GATTS_CONN_PROFILE_IDLE;
+  } else {
+    SLIST_FOREACH(sse, &ce->sessions, next) {
+      enum mgos_bt_gatts_conn_profile sp =
+          (sse->conn_profile != MGOS_BT_GATTS_CONN_PROFILE_NONE
+               ? sse->conn_profile
+               : sse->se->conn_profile);
+      if (sp > prof) prof = sp;
+    }
+    if (prof == MGOS_BT_GATTS_CONN_PROFILE_NONE) {
+      prof = MGOS_BT_GATTS_CONN_PROFILE_INTERACTIVE;
+    }
+  }
+  if (ce->pending_profile != MGOS_BT_GATTS_CONN_PROFILE_NONE) return;
+  if (prof == ce->params.profile) {
+    ce->profile_check_us = 0;
+    return;
+  }
+  /* Last update failed, wait for the retry. */
+  if (ce->profile_check_us > mgos_uptime_micros()) return;
+  esp_ble_conn_update_params_t conn_params = {0};
+  memcpy(conn_params.bda, ce->gc.addr.addr, ESP_BD_ADDR_LEN);
+  conn_params.min_int = s_conn_profiles[prof].min_int;
+  conn_params.max_int = s_conn_profiles[prof].max_int;
+  conn_params.latency = s_conn_profiles[prof].latency;
+  conn_params.timeout = s_conn_profiles[prof].timeout;
+  if (esp_ble_gap_update_conn_params(&conn_params) != ESP_OK) {
+    conn_profile_retry_later(ce);
+    return;
+  }
+  LOG(LL_DEBUG, ("%s: conn profile %d -> %d",
+                 mgos_bt_addr_to_str(&ce->gc.addr, 0, buf), ce->params.profile,
+                 prof));
+  ce->pending_profile = prof;
+  ce->profile_check_us =
+      mgos_uptime_micros() + ESP32_BT_GATTS_PROFILE_UPDATE_TIMEOUT_MS * 1000LL;
+  conn_check_timer_start();
+}
+
+static void conn_active(struct esp32_bt_gatts_connection_entry *ce) {
+  ce->last_activity_us = mgos_uptime_micros();
+  if (ce->idle) {
+    ce->idle = false;
+    conn_apply_profile(ce);
+  }
+}
+
+/* Idle detection, profile update timeouts and retries. */
+static void conn_check(void *arg) {
+  int idle_timeout_ms = mgos_sys_config_get_bt_gatts_idle_timeout_ms();
+  int64_t now = mgos_uptime_micros();
+  bool need_timer = false;
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    struct esp32_bt_gatts_connection_entry *ce = &s_conns[i];
+    if (!ce->in_use || ce->sessions_by_svc == NULL) continue;
+    if (idle_timeout_ms > 0) {
+      need_timer = true;
+      if (!ce->idle &&
+          now - ce->last_activity_us >= idle_timeout_ms * 1000LL) {
+        ce->idle = true;
+        conn_apply_profile(ce);
+      }
+    }
+    if (ce->profile_check_us == 0) continue;
+    need_timer = true;
+    if (now < ce->profile_check_us) continue;
+    if (ce->pending_profile != MGOS_BT_GATTS_CONN_PROFILE_NONE) {
+      /* Result got lost, treat as failed. */
+      ce->pending_profile = MGOS_BT_GATTS_CONN_PROFILE_NONE;
+      ce->profile_check_us = 0;
+    }
+    conn_apply_profile(ce);
+  }
+  if (!need_timer) {
+    mgos_clear_timer(s_conn_check_timer);
+    s_conn_check_timer = MGOS_INVALID_TIMER_ID;
+  }
+  (void) arg;
 }
 
 static void esp32_bt_gatts_create_sessions(
@@ -681,14 +1054,19 @@ static void esp32_bt_gatts_create_sessions(
   esp_ble_gatts_cb_param_t ep;
   ep.connect.conn_id = ce->gc.conn_id;
   memcpy(ep.connect.remote_bda, ce->gc.addr.addr, ESP_BD_ADDR_LEN);
+  ce->sessions_by_svc = (struct esp32_bt_gatts_session_entry **) calloc(
+      s_num_svcs, sizeof(*ce->sessions_by_svc));
+  if (ce->sessions_by_svc == NULL) return;
+  ce->num_sessions_by_svc = s_num_svcs;
   SLIST_FOREACH(se, &s_svcs, next) {
     struct esp32_bt_gatts_session_entry *sse =
         (struct esp32_bt_gatts_session_entry *) calloc(1, sizeof(*sse));
     sse->ce = ce;
     sse->se = se;
     memcpy((void *) &sse->gsc.gc, &ce->gc, sizeof(sse->gsc.gc));
-    ;
+    sse->gsc.params = ce->params;
     SLIST_INIT(&sse->pending_writes);
+    SLIST_INIT(&sse->credits);
     enum mgos_bt_gatt_status st =
         esp32_bt_gatts_call_handler(sse, 0, MGOS_BT_GATTS_EV_CONNECT, NULL);
     if (st != MGOS_BT_GATT_STATUS_OK) {
@@ -698,14 +1076,13 @@ static void esp32_bt_gatts_create_sessions(
     }
     sse->cccd_values = calloc(sse->se->num_cccds, sizeof(*sse->cccd_values));
     SLIST_INSERT_HEAD(&ce->sessions, sse, next);
+    ce->sessions_by_svc[se->idx] = sse;
+  }
+  ce->last_activity_us = mgos_uptime_micros();
+  conn_apply_profile(ce);
+  if (mgos_sys_config_get_bt_gatts_idle_timeout_ms() > 0) {
+    conn_check_timer_start();
   }
-  esp_ble_conn_update_params_t conn_params = {0};
-  memcpy(conn_params.bda, ce->gc.addr.addr, ESP_BD_ADDR_LEN);
-  conn_params.latency = 0;
-  conn_params.max_int = 0x50; /* max_int = 0x50*1.25ms = 100ms */
-  conn_params.min_int = 0x30; /* min_int = 0x30*1.25ms = 60ms */
-  conn_params.timeout = 400;  /* timeout = 400*10ms = 4000ms */
-  esp_ble_gap_update_conn_params(&conn_params);
 }
 
 struct auth_cmpl_info {
@@ -716,30 +1093,27 @@ struct auth_cmpl_info {
 static void esp32_bt_gatts_auth_cmpl_mgos(void *arg) {
   char buf[MGOS_BT_ADDR_STR_LEN];
   struct auth_cmpl_info *aci = (struct auth_cmpl_info *) arg;
-  struct esp32_bt_gatts_connection_entry *ce, *ct;
+  struct esp32_bt_gatts_connection_entry *ce =
+      find_connection_by_addr(aci->addr);
+  if (ce == NULL || !ce->need_auth) return;
   esp32_bt_addr_to_str(aci->addr, buf);
-  SLIST_FOREACH_SAFE(ce, &s_conns, next, ct) {
-    if (esp32_bt_addr_cmp(ce->gc.addr.addr, aci->addr) != 0 || !ce->need_auth) {
-      continue;
-    }
-    if (aci->success) {
-      ce->need_auth = false;
-      LOG(LL_INFO, ("%s: auth completed, starting services", buf));
-      esp32_bt_gatts_create_sessions(ce);
-    } else {
-      LOG(LL_INFO, ("%s: auth failed, closing connection", buf));
-      esp_ble_gatts_close(ce->gatt_if, ce->gc.conn_id);
-    }
+  if (aci->success) {
+    ce->need_auth = false;
+    LOG(LL_INFO, ("%s: auth completed, starting services", buf));
+    esp32_bt_gatts_create_sessions(ce);
+  } else {
+    LOG(LL_INFO, ("%s: auth failed, closing connection", buf));
+    esp_ble_gatts_close(ce->gatt_if, ce->gc.conn_id);
   }
-  free(aci);
 }
 
 void esp32_bt_gatts_auth_cmpl(const esp_bd_addr_t addr, bool success) {
-  struct auth_cmpl_info *aci =
-      (struct auth_cmpl_info *) calloc(1, sizeof(*aci));
+  struct auth_cmpl_info *aci = (struct auth_cmpl_info *) mgos_bt_sched_reserve(
+      esp32_bt_gatts_auth_cmpl_mgos, sizeof(*aci));
+  if (aci == NULL) return;
   memcpy(aci->addr, addr, sizeof(aci->addr));
   aci->success = success;
-  mgos_invoke_cb(esp32_bt_gatts_auth_cmpl_mgos, aci, false /* from_isr */);
+  mgos_bt_sched_commit();
 }
 
 static void esp32_bt_gatts_ev(esp_gatts_cb_event_t ev, esp_gatt_if_t gatts_if,
@@ -893,6 +1267,7 @@ static void esp32_bt_gatts_ev(esp_gatts_cb_event_t ev, esp_gatt_if_t gatts_if,
       const struct gatts_congest_evt_param *p = &ep->congest;
       LOG(LL_DEBUG,
           ("CONGEST cid %d%s", p->conn_id, (p->congested ? " congested" : "")));
+      run_on_mgos_task(gatts_if, ev, ep);
       break;
     }
     case ESP_GATTS_RESPONSE_EVT: {
@@ -933,31 +1308,207 @@ static void esp32_bt_gatts_ev(esp_gatts_cb_event_t ev, esp_gatt_if_t gatts_if,
 
 int mgos_bt_gatts_get_num_connections(void) {
   int num = 0;
-  struct esp32_bt_gatts_connection_entry *ce;
-  SLIST_FOREACH(ce, &s_conns, next) num++;
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    if (s_conns[i].in_use) num++;
+  }
   return num;
 }
 
 bool mgos_bt_gatts_is_send_queue_empty(void) {
-  struct esp32_bt_gatts_connection_entry *ce;
-  SLIST_FOREACH(ce, &s_conns, next) {
-    if (!STAILQ_EMPTY(&ce->pending_inds)) return false;
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    struct esp32_bt_gatts_connection_entry *ce = &s_conns[i];
+    if (!ce->in_use) continue;
+    if (!STAILQ_EMPTY(&ce->queue.entries)) return false;
+    if (!STAILQ_EMPTY(&ce->in_flight_inds)) return false;
   }
   return true;
 }
 
 static void esp32_bt_gatts_send_next_ind(
     struct esp32_bt_gatts_connection_entry *ce) {
-  if (ce->ind_in_flight) return;
-  if (STAILQ_EMPTY(&ce->pending_inds)) return;
-  struct esp32_bt_gatts_pending_ind *pi = STAILQ_FIRST(&ce->pending_inds);
-  ce->ind_in_flight = true;
-  if (esp_ble_gatts_send_indicate(ce->gatt_if, ce->gc.conn_id, pi->handle,
-                                  pi->value.len, (uint8_t *) pi->value.p,
-                                  pi->need_confirm) == ESP_OK) {
-  } else {
-    ce->ind_in_flight = false;
+  double now = mgos_uptime();
+  while (!STAILQ_EMPTY(&ce->queue.entries)) {
+    struct mgos_bt_notify_entry *pi = STAILQ_FIRST(&ce->queue.entries);
+    if (ce->ind_in_flight || ce->congested) break;
+    if (pi->need_confirm ? ce->num_in_flight > 0
+                         : ce->num_in_flight >= ce->notify_window) {
+      break;
+    }
+    /* Longer values would be truncated by the stack anyway. */
+    struct mg_str data = mgos_bt_notify_entry_data(pi, ce->gc.mtu);
+    if (esp_ble_gatts_send_indicate(ce->gatt_if, ce->gc.conn_id, pi->handle,
+                                    data.len, (uint8_t *) data.p,
+                                    pi->need_confirm) != ESP_OK) {
+      break;
+    }
+    if (ce->num_in_flight == 0 && ce->busy_start == 0) ce->busy_start = now;
+    conn_active(ce);
+    mgos_bt_notify_queue_pop(&ce->queue);
+    STAILQ_INSERT_TAIL(&ce->in_flight_inds, pi, next);
+    ce->num_in_flight++;
+    ce->num_sent++;
+    if (pi->need_confirm) ce->ind_in_flight = true;
+  }
+  if (ce->num_in_flight == 0 && ce->busy_start != 0) {
+    ce->busy_time += now - ce->busy_start;
+    ce->busy_start = 0;
+  }
+}
+
+bool mgos_bt_gatts_get_notify_stats(struct mgos_bt_gatts_conn *gsc,
+                                    struct mgos_bt_gatts_notify_stats *stats) {
+  struct esp32_bt_gatts_connection_entry *ce =
+      find_connection(s_gatts_if, gsc->gc.conn_id);
+  if (ce == NULL) return false;
+  memset(stats, 0, sizeof(*stats));
+  stats->num_sent = ce->num_sent;
+  stats->num_congested = ce->num_congested;
+  stats->num_dropped = ce->queue.num_dropped;
+  stats->queue_len = ce->queue.len;
+  stats->num_in_flight = ce->num_in_flight;
+  stats->window = ce->notify_window;
+  stats->conn_int_ms = ce->params.conn_int * 1.25;
+  double busy_time = ce->busy_time;
+  if (ce->busy_start != 0) busy_time += mgos_uptime() - ce->busy_start;
+  if (ce->params.conn_int > 0 && busy_time > 0) {
+    stats->pkts_per_conn_int =
+        ce->num_sent / (busy_time * 1000 / stats->conn_int_ms);
+  }
+  return true;
+}
+
+struct conn_params_info {
+  esp_bd_addr_t addr;
+  bool ok;
+  uint16_t conn_int;
+  uint16_t latency;
+  uint16_t timeout;
+};
+
+static void esp32_bt_gatts_conn_params_mgos(void *arg) {
+  struct conn_params_info *cpi = (struct conn_params_info *) arg;
+  struct esp32_bt_gatts_connection_entry *ce =
+      find_connection_by_addr(cpi->addr);
+  if (ce == NULL) return;
+  enum mgos_bt_gatts_conn_profile prof = ce->pending_profile;
+  ce->pending_profile = MGOS_BT_GATTS_CONN_PROFILE_NONE;
+  ce->params.update_failed = !cpi->ok;
+  if (cpi->ok) {
+    if (prof != MGOS_BT_GATTS_CONN_PROFILE_NONE) ce->params.profile = prof;
+    ce->params.conn_int = cpi->conn_int;
+    ce->params.latency = cpi->latency;
+    ce->params.timeout = cpi->timeout;
+    ce->profile_check_us = 0;
+  } else if (prof != MGOS_BT_GATTS_CONN_PROFILE_NONE) {
+    conn_profile_retry_later(ce);
+  }
+  sync_conn_params(ce);
+  /* Requirements may have changed while the update was in progress. */
+  conn_apply_profile(ce);
+}
+
+void esp32_bt_gatts_conn_params_updated(const esp_bd_addr_t addr, bool ok,
+                                        uint16_t conn_int, uint16_t latency,
+                                        uint16_t timeout) {
+  struct conn_params_info *cpi =
+      (struct conn_params_info *) mgos_bt_sched_reserve(
+          esp32_bt_gatts_conn_params_mgos, sizeof(*cpi));
+  if (cpi == NULL) return;
+  memcpy(cpi->addr, addr, sizeof(cpi->addr));
+  cpi->ok = ok;
+  cpi->conn_int = conn_int;
+  cpi->latency = latency;
+  cpi->timeout = timeout;
+  mgos_bt_sched_commit();
+}
+
+bool mgos_bt_gatts_set_conn_profile(struct mgos_bt_gatts_conn *gsc,
+                                    enum mgos_bt_gatts_conn_profile profile) {
+  if (gsc == NULL || profile > MGOS_BT_GATTS_CONN_PROFILE_BULK) return false;
+  /* gsc is embedded in the session entry. */
+  size_t off = offsetof(struct esp32_bt_gatts_session_entry, gsc);
+  struct esp32_bt_gatts_session_entry *sse =
+      (struct esp32_bt_gatts_session_entry *) ((char *) gsc - off);
+  struct esp32_bt_gatts_connection_entry *ce = sse->ce;
+  sse->conn_profile = profile;
+  /* Called from the CONNECT handler, applied once sessions are created. */
+  if (ce->sessions_by_svc == NULL ||
+      ce->sessions_by_svc[sse->se->idx] != sse) {
+    return true;
+  }
+  ce->last_activity_us = mgos_uptime_micros();
+  ce->idle = false;
+  conn_apply_profile(ce);
+  return true;
+}
+
+bool mgos_bt_gatts_set_service_conn_profile(
+    const char *svc_uuid, enum mgos_bt_gatts_conn_profile profile) {
+  struct mgos_bt_uuid uuid;
+  if (profile > MGOS_BT_GATTS_CONN_PROFILE_BULK ||
+      !mgos_bt_uuid_from_str(mg_mk_str(svc_uuid), &uuid)) {
+    return false;
   }
+  struct esp32_bt_gatts_service_entry *se =
+      find_service_by_uuid((const esp_bt_uuid_t *) &uuid);
+  if (se == NULL) return false;
+  se->conn_profile = profile;
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    struct esp32_bt_gatts_connection_entry *ce = &s_conns[i];
+    if (ce->in_use && ce->sessions_by_svc != NULL) conn_apply_profile(ce);
+  }
+  return true;
+}
+
+bool mgos_bt_gatts_write_nr_grant(struct mgos_bt_gatts_conn *gsc,
+                                  uint16_t handle, uint16_t credits_handle,
+                                  uint16_t credits) {
+  if (gsc == NULL || credits_handle == handle) return false;
+  struct esp32_bt_gatts_session_entry *sse =
+      find_session(s_gatts_if, gsc->gc.conn_id, handle, NULL);
+  if (sse == NULL) return false;
+  struct esp32_bt_gatts_write_nr_credits *cr = find_credits(sse, handle);
+  if (cr != NULL && cr->credits_handle != credits_handle) {
+    LOG(LL_ERROR, ("%d/%u: credits go to %u, not %u", gsc->gc.conn_id, handle,
+                   cr->credits_handle, credits_handle));
+    return false;
+  }
+  /*
+   * Grants are only ever seen by the client as notifications, there is no
+   * point in granting credits it cannot learn about.
+   * CCCD, if present, immediately follows the value attribute.
+   */
+  const struct esp32_bt_gatts_attr_ref *car = find_attr(credits_handle + 1);
+  if (car == NULL || car->se != sse->se || car->ci < 0 ||
+      !(sse->cccd_values[car->ci] & 1)) {
+    LOG(LL_ERROR, ("%d/%u: notifications not enabled, can't grant credits",
+                   gsc->gc.conn_id, credits_handle));
+    return false;
+  }
+  bool is_new = false;
+  if (cr == NULL) {
+    cr = (struct esp32_bt_gatts_write_nr_credits *) calloc(1, sizeof(*cr));
+    if (cr == NULL) return false;
+    cr->handle = handle;
+    cr->credits_handle = credits_handle;
+    SLIST_INSERT_HEAD(&sse->credits, cr, next);
+    is_new = true;
+  }
+  uint32_t granted = cr->granted + credits;
+  uint8_t v[4] = {granted & 0xff, (granted >> 8) & 0xff,
+                  (granted >> 16) & 0xff, (granted >> 24) & 0xff};
+  if (!mgos_bt_gatts_notify(gsc, MGOS_BT_GATT_NOTIFY_MODE_NOTIFY,
+                            credits_handle,
+                            mg_mk_str_n((const char *) v, sizeof(v)))) {
+    /* The client won't know, don't enforce credits it has not been told of. */
+    if (is_new) {
+      SLIST_REMOVE(&sse->credits, cr, esp32_bt_gatts_write_nr_credits, next);
+      free(cr);
+    }
+    return false;
+  }
+  cr->granted = granted;
+  return true;
 }
 
 bool mgos_bt_gatts_disconnect(struct mgos_bt_gatts_conn *gsc) {
@@ -965,6 +1516,16 @@ bool mgos_bt_gatts_disconnect(struct mgos_bt_gatts_conn *gsc) {
   return esp_ble_gatts_close(s_gatts_if, gsc->gc.conn_id) == ESP_OK;
 }
 
+static uint16_t get_max_notify_in_flight(void) {
+  int max = mgos_sys_config_get_bt_gatts_max_notify_in_flight();
+  return (max > 0 ? max : 1);
+}
+
+static int get_max_notify_queue_len(void) {
+  int max = mgos_sys_config_get_bt_gatts_max_notify_queue_len();
+  return (max > 0 ? max : 1);
+}
+
 static uint16_t get_read_perm(enum mgos_bt_gatt_sec_level sec_level) {
   if (mgos_sys_config_get_bt_gatts_min_sec_level() > sec_level) {
     sec_level = mgos_sys_config_get_bt_gatts_min_sec_level();
@@ -1003,6 +1564,12 @@ static uint16_t get_write_perm(enum mgos_bt_gatt_sec_level sec_level) {
   return res;
 }
 
+static void add_service(struct esp32_bt_gatts_service_entry *se) {
+  se->idx = s_num_svcs++;
+  SLIST_INSERT_HEAD(&s_svcs, se, next);
+  esp32_bt_register_services();
+}
+
 bool mgos_bt_gatts_register_service(const char *svc_uuid,
                                     enum mgos_bt_gatt_sec_level sec_level,
                                     const struct mgos_bt_gatts_char_def *chars,
@@ -1010,6 +1577,13 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
                                     void *handler_arg) {
   bool res = false;
   uint16_t na = 0, nu = 0;
+  /* Permissions are the same for all the attributes of the service. */
+  uint16_t rperm = get_read_perm(sec_level);
+  uint16_t wperm = get_write_perm(sec_level);
+  esp_gatts_attr_db_t *db = NULL;
+  struct mgos_bt_uuid *uuids = NULL;
+  struct esp32_bt_gatts_attr_info *attr_info = NULL;
+  uint8_t *char_props = NULL;
   struct esp32_bt_gatts_service_entry *se =
       (struct esp32_bt_gatts_service_entry *) calloc(1, sizeof(*se));
   if (se == NULL) goto out;
@@ -1023,14 +1597,20 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
       na++;  // CCCD
     }
   }
-  esp_gatts_attr_db_t *db = (esp_gatts_attr_db_t *) calloc(na, sizeof(*db));
+  db = (esp_gatts_attr_db_t *) calloc(na, sizeof(*db));
+  uuids = (struct mgos_bt_uuid *) calloc(nu, sizeof(*uuids));
+  attr_info =
+      (struct esp32_bt_gatts_attr_info *) calloc(na, sizeof(*attr_info));
+  char_props = (uint8_t *) calloc(nu, 1);
+  se->handles = (uint16_t *) calloc(na, sizeof(*se->handles));
+  if (db == NULL || uuids == NULL || attr_info == NULL || char_props == NULL ||
+      se->handles == NULL) {
+    goto out;
+  }
   esp_gatts_attr_db_t *dbe = db;
-  struct mgos_bt_uuid *uuids =
-      (struct mgos_bt_uuid *) calloc(nu, sizeof(*uuids));
   struct mgos_bt_uuid *uuid = uuids;
-  struct esp32_bt_service_attr_info *attr_info =
-      (struct esp32_bt_service_attr_info *) calloc(na, sizeof(*attr_info));
-  struct esp32_bt_service_attr_info *ai = attr_info;
+  struct esp32_bt_gatts_attr_info *ai = attr_info;
+  uint8_t *cp = char_props;
   { /* Add primary service decl */
     if (!mgos_bt_uuid_from_str(mg_mk_str(svc_uuid), uuid)) {
       LOG(LL_ERROR, ("%s: Invalid svc UUID", svc_uuid));
@@ -1039,12 +1619,10 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
     dbe->attr_control.auto_rsp = ESP_GATT_AUTO_RSP;
     dbe->att_desc.uuid_length = ESP_UUID_LEN_16;
     dbe->att_desc.uuid_p = (uint8_t *) &primary_service_uuid;
-    dbe->att_desc.perm = get_read_perm(sec_level);
+    dbe->att_desc.perm = rperm;
     dbe->att_desc.max_length = uuid->len;
     dbe->att_desc.length = uuid->len;
     dbe->att_desc.value = (uint8_t *) &uuid->uuid;
-    ai->handler = handler;
-    ai->handler_arg = handler_arg;
     uuid++;
     ai++;
     dbe++;
@@ -1058,24 +1636,25 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
       dbe->attr_control.auto_rsp = ESP_GATT_AUTO_RSP;
       dbe->att_desc.uuid_length = ESP_UUID_LEN_16;
       dbe->att_desc.uuid_p = (uint8_t *) &char_decl_uuid;
-      dbe->att_desc.perm = get_read_perm(sec_level);
+      dbe->att_desc.perm = rperm;
       dbe->att_desc.max_length = dbe->att_desc.length = 1;
-      uint8_t cp = 0;
       if (cd->prop & MGOS_BT_GATT_PROP_READ) {
-        cp |= ESP_GATT_CHAR_PROP_BIT_READ;
+        *cp |= ESP_GATT_CHAR_PROP_BIT_READ;
       }
       if (cd->prop & MGOS_BT_GATT_PROP_WRITE) {
-        cp |= ESP_GATT_CHAR_PROP_BIT_WRITE;
-        //| ESP_GATT_CHAR_PROP_BIT_WRITE_NR);
+        *cp |= ESP_GATT_CHAR_PROP_BIT_WRITE;
+      }
+      if (cd->prop & MGOS_BT_GATT_PROP_WRITE_NR) {
+        *cp |= ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
       }
       if (cd->prop & MGOS_BT_GATT_PROP_NOTIFY) {
-        cp |= ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+        *cp |= ESP_GATT_CHAR_PROP_BIT_NOTIFY;
       }
       if (cd->prop & MGOS_BT_GATT_PROP_INDICATE) {
-        cp |= ESP_GATT_CHAR_PROP_BIT_INDICATE;
+        *cp |= ESP_GATT_CHAR_PROP_BIT_INDICATE;
       }
-      ai->char_prop = cp;
-      dbe->att_desc.value = &ai->char_prop;
+      dbe->att_desc.value = cp;
+      cp++;
       dbe++;
       ai++;
     }
@@ -1084,13 +1663,15 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
       dbe->att_desc.uuid_length = uuid->len;
       dbe->att_desc.uuid_p = (uint8_t *) &uuid->uuid;
       if (cd->prop & MGOS_BT_GATT_PROP_READ) {
-        dbe->att_desc.perm |= get_read_perm(sec_level);
+        dbe->att_desc.perm |= rperm;
       }
-      if (cd->prop & MGOS_BT_GATT_PROP_WRITE) {
-        dbe->att_desc.perm |= get_write_perm(sec_level);
+      if (cd->prop & (MGOS_BT_GATT_PROP_WRITE | MGOS_BT_GATT_PROP_WRITE_NR)) {
+        dbe->att_desc.perm |= wperm;
       }
       ai->handler = cd->handler;
       ai->handler_arg = cd->handler_arg;
+      ai->notify_qmode = cd->notify_qmode;
+      ai->stream_prepared_writes = cd->stream_prepared_writes;
       uuid++;
       dbe++;
       ai++;
@@ -1100,7 +1681,7 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
       dbe->attr_control.auto_rsp = ESP_GATT_RSP_BY_APP;
       dbe->att_desc.uuid_length = ESP_UUID_LEN_16;
       dbe->att_desc.uuid_p = (uint8_t *) &char_client_config_uuid;
-      dbe->att_desc.perm = get_read_perm(sec_level) | get_write_perm(sec_level);
+      dbe->att_desc.perm = rperm | wperm;
       se->num_cccds++;
       dbe++;
       ai++;
@@ -1110,14 +1691,58 @@ bool mgos_bt_gatts_register_service(const char *svc_uuid,
   se->sec_level = sec_level;
   se->attr_info = attr_info;
   se->num_attrs = na;
-  se->uuids = uuids;
-  SLIST_INSERT_HEAD(&s_svcs, se, next);
-  esp32_bt_register_services();
+  se->handler = handler;
+  se->handler_arg = handler_arg;
+  add_service(se);
   res = true;
 out:
+  if (!res) {
+    free(db);
+    free(uuids);
+    free(attr_info);
+    free(char_props);
+    if (se != NULL) free(se->handles);
+    free(se);
+  }
   return res;
 }
 
+static bool is_primary_svc_decl(const esp_gatts_attr_db_t *dbe) {
+  return (dbe->att_desc.uuid_length == ESP_UUID_LEN_16 &&
+          memcmp(dbe->att_desc.uuid_p, &primary_service_uuid,
+                 ESP_UUID_LEN_16) == 0 &&
+          (dbe->att_desc.length == ESP_UUID_LEN_16 ||
+           dbe->att_desc.length == ESP_UUID_LEN_128));
+}
+
+bool mgos_bt_gatts_register_service_static(
+    const esp_gatts_attr_db_t *attr_db, uint16_t num_attrs,
+    const struct esp32_bt_gatts_attr_info *attr_info,
+    enum mgos_bt_gatt_sec_level sec_level, mgos_bt_gatts_ev_handler_t handler,
+    void *handler_arg) {
+  struct esp32_bt_gatts_service_entry *se;
+  if (num_attrs == 0 || !is_primary_svc_decl(&attr_db[0])) {
+    LOG(LL_ERROR, ("Invalid service table"));
+    return false;
+  }
+  /* Handles are allocated along with the entry. */
+  se = (struct esp32_bt_gatts_service_entry *) calloc(
+      1, sizeof(*se) + num_attrs * sizeof(*se->handles));
+  if (se == NULL) return false;
+  se->handles = (uint16_t *) (se + 1);
+  se->attr_db = attr_db;
+  se->attr_info = attr_info;
+  se->num_attrs = num_attrs;
+  se->sec_level = sec_level;
+  se->handler = handler;
+  se->handler_arg = handler_arg;
+  for (uint16_t i = 0; i < num_attrs; i++) {
+    if (is_cccd(&attr_db[i])) se->num_cccds++;
+  }
+  add_service(se);
+  return true;
+}
+
 static void esp32_bt_gatts_send_resp(struct mgos_bt_gatts_conn *gsc,
                                      uint16_t handle, uint32_t trans_id,
                                      enum mgos_bt_gatt_status st) {
@@ -1150,22 +1775,170 @@ void mgos_bt_gatts_send_resp_data(struct mgos_bt_gatts_conn *gsc,
                               ESP_GATT_OK, &rsp);
 }
 
-void mgos_bt_gatts_notify(struct mgos_bt_gatts_conn *gsc,
+/* Queue the buffer for sending to the session's connection. */
+static bool esp32_bt_gatts_queue_ind(struct esp32_bt_gatts_session_entry *sse,
+                                     int ai, uint16_t handle,
+                                     enum mgos_bt_gatt_notify_mode mode,
+                                     struct mgos_bt_notify_buf *nb) {
+  struct esp32_bt_gatts_connection_entry *ce = sse->ce;
+  enum mgos_bt_gatts_notify_qmode qmode =
+      (sse->se->attr_info != NULL ? sse->se->attr_info[ai].notify_qmode
+                                  : MGOS_BT_GATTS_NOTIFY_QMODE_ALL);
+  bool need_confirm = (mode == MGOS_BT_GATT_NOTIFY_MODE_INDICATE);
+  bool res = mgos_bt_notify_queue_push(&ce->queue, handle, need_confirm, qmode,
+                                       get_max_notify_queue_len(), nb);
+  esp32_bt_gatts_send_next_ind(ce);
+  return res;
+}
+
+bool mgos_bt_gatts_notify_owned(struct mgos_bt_gatts_conn *gsc,
+                                enum mgos_bt_gatt_notify_mode mode,
+                                uint16_t handle, struct mg_str data,
+                                mgos_bt_gatts_free_cb_t free_cb,
+                                void *free_arg) {
+  bool res = false;
+  struct mgos_bt_notify_buf *nb =
+      mgos_bt_notify_buf_new(data, free_cb, free_arg);
+  if (nb == NULL) return false;
+  if (gsc == NULL || mode == MGOS_BT_GATT_NOTIFY_MODE_OFF) goto out;
+  int ai = 0;
+  struct esp32_bt_gatts_session_entry *sse =
+      find_session(s_gatts_if, gsc->gc.conn_id, handle, &ai);
+  if (sse == NULL) goto out;
+  res = esp32_bt_gatts_queue_ind(sse, ai, handle, mode, nb);
+out:
+  mgos_bt_notify_buf_unref(nb);
+  return res;
+}
+
+bool mgos_bt_gatts_notify(struct mgos_bt_gatts_conn *gsc,
                           enum mgos_bt_gatt_notify_mode mode, uint16_t handle,
                           struct mg_str data) {
-  if (gsc == NULL || mode == MGOS_BT_GATT_NOTIFY_MODE_OFF) return;
-  struct esp32_bt_gatts_session_entry *sse =
-      find_session(s_gatts_if, gsc->gc.conn_id, handle, NULL);
-  if (sse == NULL) return false;
-  struct esp32_bt_gatts_pending_ind *pi = calloc(1, sizeof(*pi));
-  if (pi != NULL) {
-    pi->handle = handle;
-    pi->need_confirm = (mode == MGOS_BT_GATT_NOTIFY_MODE_INDICATE);
-    pi->value = mg_strdup(data);
-    STAILQ_INSERT_TAIL(&sse->ce->pending_inds, pi, next);
-    sse->ce->ind_queue_len++;
+  return mgos_bt_gatts_notify_owned(gsc, mode, handle, data, NULL, NULL);
+}
+
+/* Queue the buffer for all the subscribed connections, takes references. */
+static int esp32_bt_gatts_notify_all_buf(uint16_t handle,
+                                         struct mgos_bt_notify_buf *nb) {
+  int num_sent = 0;
+  /* CCCD, if present, immediately follows the value attribute. */
+  const struct esp32_bt_gatts_attr_ref *ar = find_attr(handle);
+  const struct esp32_bt_gatts_attr_ref *car = find_attr(handle + 1);
+  if (ar == NULL || car == NULL || car->se != ar->se || car->ci < 0) goto out;
+  for (int i = 0; i < ESP32_BT_MAX_CONNS; i++) {
+    struct esp32_bt_gatts_connection_entry *ce = &s_conns[i];
+    if (!ce->in_use || ar->se->idx >= ce->num_sessions_by_svc) continue;
+    struct esp32_bt_gatts_session_entry *sse =
+        ce->sessions_by_svc[ar->se->idx];
+    if (sse == NULL) continue;
+    enum mgos_bt_gatt_notify_mode mode;
+    uint16_t cccd = sse->cccd_values[car->ci];
+    if (cccd & 2) {
+      mode = MGOS_BT_GATT_NOTIFY_MODE_INDICATE;
+    } else if (cccd & 1) {
+      mode = MGOS_BT_GATT_NOTIFY_MODE_NOTIFY;
+    } else {
+      continue;
+    }
+    if (esp32_bt_gatts_queue_ind(sse, ar->ai, handle, mode, nb)) num_sent++;
+  }
+out:
+  return num_sent;
+}
+
+int mgos_bt_gatts_notify_all(uint16_t handle, struct mg_str data,
+                             mgos_bt_gatts_free_cb_t free_cb, void *free_arg) {
+  struct mgos_bt_notify_buf *nb =
+      mgos_bt_notify_buf_new(data, free_cb, free_arg);
+  if (nb == NULL) return 0;
+  int num_sent = esp32_bt_gatts_notify_all_buf(handle, nb);
+  mgos_bt_notify_buf_unref(nb);
+  return num_sent;
+}
+
+/*
+ * Value store.
+ *
+ * Reads of attributes with a stored value are answered here, without calling
+ * the handler. A long read takes a reference to the value buffer on the first
+ * chunk, so the following chunks are served from the same snapshot even if
+ * the value is updated in the meantime.
+ */
+static bool esp32_bt_gatts_read_value(struct esp32_bt_gatts_session_entry *sse,
+                                      const struct gatts_read_evt_param *p) {
+  const struct esp32_bt_gatts_attr_ref *ar = find_attr(p->handle);
+  if (ar == NULL || ar->val == NULL) return false;
+  struct mgos_bt_notify_buf *nb = ar->val->buf;
+  uint16_t max_len = MIN(sse->gsc.gc.mtu - 1, ESP_GATT_MAX_ATTR_LEN);
+  if (p->offset == 0) {
+    mgos_bt_notify_buf_unref(sse->read_snap);
+    sse->read_snap = NULL;
+    if (nb->data.len > max_len) {
+      nb->refcnt++;
+      sse->read_snap = nb;
+      sse->read_snap_handle = p->handle;
+    }
+  } else if (sse->read_snap != NULL && sse->read_snap_handle == p->handle) {
+    nb = sse->read_snap;
+  }
+  if (!p->need_rsp) return true;
+  if (p->offset > nb->data.len) {
+    esp32_bt_gatts_send_resp(&sse->gsc, p->handle, p->trans_id,
+                             MGOS_BT_GATT_STATUS_INVALID_OFFSET);
+    return true;
   }
-  esp32_bt_gatts_send_next_ind(sse->ce);
+  uint16_t len = MIN(nb->data.len - p->offset, max_len);
+  esp_gatt_rsp_t rsp = {
+      .attr_value =
+          {
+              .handle = p->handle,
+              .offset = p->offset,
+              .len = len,
+              .auth_req = ESP_GATT_AUTH_REQ_NONE,
+          },
+  };
+  memcpy(rsp.attr_value.value, nb->data.p + p->offset, len);
+  esp_ble_gatts_send_response(s_gatts_if, p->conn_id, p->trans_id, ESP_GATT_OK,
+                              &rsp);
+  /* Last chunk, release the snapshot. */
+  if (nb == sse->read_snap && p->offset + len >= nb->data.len) {
+    mgos_bt_notify_buf_unref(sse->read_snap);
+    sse->read_snap = NULL;
+  }
+  return true;
+}
+
+bool mgos_bt_gatts_set_value(uint16_t handle, struct mg_str data,
+                             uint32_t version, bool notify) {
+  struct esp32_bt_gatts_attr_ref *ar = find_attr(handle);
+  if (ar == NULL || ar->ci >= 0 ||
+      ar->se->attr_db[ar->ai].attr_control.auto_rsp != ESP_GATT_RSP_BY_APP) {
+    return false;
+  }
+  if (ar->val != NULL && ar->val->version == version) return true;
+  struct mgos_bt_notify_buf *nb = mgos_bt_notify_buf_new(data, NULL, NULL);
+  if (nb == NULL) return false;
+  if (ar->val == NULL) {
+    ar->val = (struct esp32_bt_gatts_value *) calloc(1, sizeof(*ar->val));
+    if (ar->val == NULL) {
+      mgos_bt_notify_buf_unref(nb);
+      return false;
+    }
+  }
+  /* Long reads in progress keep their snapshots. */
+  mgos_bt_notify_buf_unref(ar->val->buf);
+  ar->val->buf = nb;
+  ar->val->version = version;
+  if (notify) esp32_bt_gatts_notify_all_buf(handle, nb);
+  return true;
+}
+
+void mgos_bt_gatts_clear_value(uint16_t handle) {
+  struct esp32_bt_gatts_attr_ref *ar = find_attr(handle);
+  if (ar == NULL || ar->val == NULL) return;
+  mgos_bt_notify_buf_unref(ar->val->buf);
+  free(ar->val);
+  ar->val = NULL;
 }
 
 bool esp32_bt_gatts_init(void) {
@@ -16,12 +16,17 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "mgos_bt.h"
 #include "mgos_bt_gap.h"
 #include "mgos_bt_gattc.h"
+#include "mgos_bt_ring.h"
 #include "mgos_system.h"
+#include "mgos_timers.h"
+
+#include "common/cs_dbg.h"
 
 const char *mgos_bt_addr_to_str(const struct mgos_bt_addr *addr, uint32_t flags,
                                 char *out) {
@@ -145,33 +150,171 @@ int mgos_bt_uuid_cmp(const struct mgos_bt_uuid *a,
   return result;
 }
 
+#ifndef MGOS_BT_SCHED_RING_SIZE
+#define MGOS_BT_SCHED_RING_SIZE 4096
+#endif
+/* Bulk records may fill the ring this far, the rest is for control. */
+#ifndef MGOS_BT_SCHED_BULK_MAX_PCT
+#define MGOS_BT_SCHED_BULK_MAX_PCT 75
+#endif
+#define MGOS_BT_SCHED_DROP_LOG_INTERVAL_MS 1000
+/* Drain is retried this often if it could not be scheduled. */
+#define MGOS_BT_SCHED_RETRY_MS 100
+
+static struct mgos_bt_ring s_sched_ring;
+static bool s_sched_drain_pending = false;
+static bool s_sched_retry = false;
+/* Drops since the last log line. Only accessed on the BT task. */
+static uint32_t s_num_bulk_dropped = 0, s_num_ctl_dropped = 0;
+static int64_t s_last_drop_log_us = 0;
+
+struct mgos_bt_sched_rec {
+  mgos_cb_t cb;
+};
+
+/* Executed on the main task. */
+static void mgos_bt_sched_drain(void *arg) {
+  void *p;
+  /* Clear the flag first: if producer adds more while we are draining,
+   * it will schedule another run. */
+  __atomic_store_n(&s_sched_drain_pending, false, __ATOMIC_SEQ_CST);
+  while ((p = mgos_bt_ring_peek(&s_sched_ring, NULL)) != NULL) {
+    struct mgos_bt_sched_rec *rec = (struct mgos_bt_sched_rec *) p;
+    rec->cb(rec + 1);
+    mgos_bt_ring_consume(&s_sched_ring);
+  }
+  (void) arg;
+}
+
+/* Executed on the main task, picks up records of a failed invoke. */
+static void mgos_bt_sched_retry(void *arg) {
+  if (!__atomic_exchange_n(&s_sched_retry, false, __ATOMIC_SEQ_CST)) return;
+  mgos_bt_sched_drain(NULL);
+  (void) arg;
+}
+
+static void mgos_bt_sched_dropped(bool bulk) {
+  int64_t now = mgos_uptime_micros();
+  if (bulk) {
+    s_num_bulk_dropped++;
+  } else {
+    s_num_ctl_dropped++;
+  }
+  if (now - s_last_drop_log_us < MGOS_BT_SCHED_DROP_LOG_INTERVAL_MS * 1000LL) {
+    return;
+  }
+  LOG((s_num_ctl_dropped > 0 ? LL_ERROR : LL_WARN),
+      ("BT event queue full, dropped %u control and %u bulk records",
+       (unsigned) s_num_ctl_dropped, (unsigned) s_num_bulk_dropped));
+  s_num_bulk_dropped = s_num_ctl_dropped = 0;
+  s_last_drop_log_us = now;
+}
+
+static void *mgos_bt_sched_reserve_max(mgos_cb_t cb, size_t len,
+                                       size_t max_used) {
+  if (s_sched_ring.buf == NULL) return NULL;
+  struct mgos_bt_sched_rec *rec =
+      (struct mgos_bt_sched_rec *) mgos_bt_ring_reserve_max(
+          &s_sched_ring, sizeof(*rec) + len, max_used);
+  if (rec == NULL) {
+    mgos_bt_sched_dropped(max_used < s_sched_ring.size);
+    return NULL;
+  }
+  rec->cb = cb;
+  return rec + 1;
+}
+
+void *mgos_bt_sched_reserve(mgos_cb_t cb, size_t len) {
+  return mgos_bt_sched_reserve_max(cb, len, s_sched_ring.size);
+}
+
+void *mgos_bt_sched_reserve_bulk(mgos_cb_t cb, size_t len) {
+  return mgos_bt_sched_reserve_max(
+      cb, len, s_sched_ring.size * MGOS_BT_SCHED_BULK_MAX_PCT / 100);
+}
+
+void mgos_bt_sched_commit(void) {
+  mgos_bt_ring_commit(&s_sched_ring);
+  if (!__atomic_exchange_n(&s_sched_drain_pending, true, __ATOMIC_SEQ_CST)) {
+    if (!mgos_invoke_cb(mgos_bt_sched_drain, NULL, false /* from_isr */)) {
+      /* Records stay in the ring, the retry timer picks them up. */
+      __atomic_store_n(&s_sched_drain_pending, false, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&s_sched_retry, true, __ATOMIC_SEQ_CST);
+    }
+  }
+}
+
+bool mgos_bt_sched_init(void) {
+  if (s_sched_ring.buf != NULL) return true;
+  void *buf = malloc(MGOS_BT_SCHED_RING_SIZE);
+  if (buf == NULL) return false;
+  mgos_bt_ring_init(&s_sched_ring, buf, MGOS_BT_SCHED_RING_SIZE);
+  mgos_set_timer(MGOS_BT_SCHED_RETRY_MS, MGOS_TIMER_REPEAT,
+                 mgos_bt_sched_retry, NULL);
+  return true;
+}
+
+void mgos_bt_sched_get_stats(struct mgos_bt_ring_stats *stats) {
+  mgos_bt_ring_get_stats(&s_sched_ring, stats);
+}
+
+/* Returns pointers to the mg_str fields of the event payload that need to be
+ * copied along with it. */
+static int get_ev_strs(int ev, void *ev_data, struct mg_str **strs) {
+  switch (ev) {
+    case MGOS_BT_GATTC_EV_READ_RESULT: {
+      struct mgos_bt_gattc_read_result *p = ev_data;
+      strs[0] = &p->data;
+      return 1;
+    }
+    case MGOS_BT_GATTC_EV_NOTIFY: {
+      struct mgos_bt_gattc_notify_arg *p = ev_data;
+      strs[0] = &p->data;
+      return 1;
+    }
+    case MGOS_BT_GAP_EVENT_SCAN_RESULT: {
+      struct mgos_bt_gap_scan_result *p = ev_data;
+      strs[0] = &p->adv_data;
+      strs[1] = &p->scan_rsp;
+      return 2;
+    }
+  }
+  return 0;
+}
+
 struct mgos_event_info {
   int ev;
 };
 
 static void trigger_cb(void *arg) {
   struct mgos_event_info *ei = arg;
-  void *ev_data = ei + 1;
-  mgos_event_trigger(ei->ev, ev_data);
-  if (ei->ev == MGOS_BT_GATTC_EV_READ_RESULT) {
-    struct mgos_bt_gattc_read_result *p = ev_data;
-    free((void *) p->data.p);
-  } else if (ei->ev == MGOS_BT_GATTC_EV_NOTIFY) {
-    struct mgos_bt_gattc_notify_arg *p = ev_data;
-    free((void *) p->data.p);
-  } else if (ei->ev == MGOS_BT_GAP_EVENT_SCAN_RESULT) {
-    struct mgos_bt_gap_scan_result *p = ev_data;
-    free((void *) p->adv_data.p);
-    free((void *) p->scan_rsp.p);
-  }
-  free(ei);
+  mgos_event_trigger(ei->ev, ei + 1);
 }
 
 void mgos_event_trigger_schedule(int ev, const void *ev_data, size_t data_len) {
-  struct mgos_event_info *ei = malloc(sizeof(*ei) + data_len);
+  struct mg_str *strs[2];
+  size_t len = sizeof(struct mgos_event_info) + data_len;
+  int i, num_strs = 0;
+  if (data_len > 0) {
+    num_strs = get_ev_strs(ev, (void *) ev_data, strs);
+    for (i = 0; i < num_strs; i++) len += strs[i]->len;
+  }
+  bool bulk = (ev == MGOS_BT_GAP_EVENT_SCAN_RESULT ||
+               ev == MGOS_BT_GATTC_EV_NOTIFY);
+  void *p = (bulk ? mgos_bt_sched_reserve_bulk(trigger_cb, len)
+                  : mgos_bt_sched_reserve(trigger_cb, len));
+  struct mgos_event_info *ei = (struct mgos_event_info *) p;
+  if (ei == NULL) return;
   ei->ev = ev;
-  memcpy(ei + 1, ev_data, data_len);
-  if (!mgos_invoke_cb(trigger_cb, ei, false /* from_isr */)) {
-    free(ei);
+  void *evd = ei + 1;
+  if (data_len > 0) memcpy(evd, ev_data, data_len);
+  /* Copy referenced data inline and repoint the payload to it. */
+  char *dp = ((char *) evd) + data_len;
+  if (num_strs > 0) num_strs = get_ev_strs(ev, evd, strs);
+  for (i = 0; i < num_strs; i++) {
+    memcpy(dp, strs[i]->p, strs[i]->len);
+    strs[i]->p = dp;
+    dp += strs[i]->len;
   }
+  mgos_bt_sched_commit();
 }
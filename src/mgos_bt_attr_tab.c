@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bt_attr_tab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void mgos_bt_attr_tab_init(struct mgos_bt_attr_tab *t, size_t entry_size) {
+  memset(t, 0, sizeof(*t));
+  t->entry_size = entry_size;
+}
+
+bool mgos_bt_attr_tab_extend(struct mgos_bt_attr_tab *t, uint16_t min_handle,
+                             uint16_t max_handle) {
+  uint32_t start = min_handle, end = (uint32_t) max_handle + 1;
+  if (min_handle > max_handle) return false;
+  if (t->len > 0) {
+    if (t->start < start) start = t->start;
+    if (t->start + t->len > end) end = t->start + t->len;
+  }
+  if (start == t->start && end - start == t->len) return true;
+  uint8_t *entries = (uint8_t *) calloc(end - start, t->entry_size);
+  if (entries == NULL) return false;
+  if (t->len > 0) {
+    memcpy(entries + (t->start - start) * t->entry_size, t->entries,
+           t->len * t->entry_size);
+  }
+  free(t->entries);
+  t->entries = entries;
+  t->start = start;
+  t->len = end - start;
+  return true;
+}
+
+void *mgos_bt_attr_tab_get(const struct mgos_bt_attr_tab *t, uint16_t handle) {
+  uint32_t i = (uint32_t) handle - t->start;
+  if (handle < t->start || i >= t->len) return NULL;
+  return t->entries + i * t->entry_size;
+}
+
+void mgos_bt_attr_tab_free(struct mgos_bt_attr_tab *t) {
+  free(t->entries);
+  mgos_bt_attr_tab_init(t, t->entry_size);
+}
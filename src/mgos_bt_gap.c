@@ -17,40 +17,84 @@
 
 #include "mgos_bt_gap.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef MGOS_HAVE_MJS
 #include "mjs.h"
 #endif
 
-struct mg_str mgos_bt_gap_parse_adv_data(struct mg_str adv_data,
-                                         enum mgos_bt_gap_eir_type t) {
-  const uint8_t *dp = (const uint8_t *) adv_data.p;
-  struct mg_str res = MG_NULL_STR;
-  for (size_t i = 0; i < adv_data.len;) {
+/*
+ * Offsets are stored in 7 bits, the top bit is MGOS_BT_ADV_INDEX_SCAN_RSP.
+ * With the buffer capped at 127 bytes, data of the last structure that fits
+ * (length 1, no data) starts at offset 127 at most.
+ */
+#define ADV_INDEX_MAX_DATA_LEN (MGOS_BT_ADV_INDEX_SCAN_RSP - 1)
+
+static void adv_index_add(struct mgos_bt_adv_index *idx, struct mg_str data,
+                          uint8_t flags) {
+  const uint8_t *dp = (const uint8_t *) data.p;
+  size_t data_len = data.len;
+  if (data_len > ADV_INDEX_MAX_DATA_LEN) data_len = ADV_INDEX_MAX_DATA_LEN;
+  for (size_t i = 0; i < data_len;) {
     size_t len = dp[i];
-    if (i + len + 1 > adv_data.len) break;
-    if (dp[i + 1] == t) {
-      res.p = (const char *) dp + i + 2;
-      res.len = len - 1;
-      break;
-    }
+    /* Zero length means the rest is padding. */
+    if (len == 0 || i + len + 1 > data_len) break;
+    if (idx->num_entries == MGOS_BT_ADV_INDEX_MAX_ENTRIES) break;
+    struct mgos_bt_adv_index_entry *e = &idx->entries[idx->num_entries++];
+    e->type = dp[i + 1];
+    e->off = (i + 2) | flags;
+    e->len = len - 1;
     i += len + 1;
   }
-  return res;
 }
 
-struct mg_str mgos_bt_gap_parse_name(struct mg_str adv_data) {
-  struct mg_str s =
-      mgos_bt_gap_parse_adv_data(adv_data, MGOS_BT_GAP_EIR_FULL_NAME);
-  if (s.len == 0) {
-    s = mgos_bt_gap_parse_adv_data(adv_data, MGOS_BT_GAP_EIR_SHORT_NAME);
+void mgos_bt_adv_index_init(struct mgos_bt_adv_index *idx,
+                            struct mg_str adv_data, struct mg_str scan_rsp) {
+  idx->adv_data = (const uint8_t *) adv_data.p;
+  idx->scan_rsp = (const uint8_t *) scan_rsp.p;
+  idx->num_entries = 0;
+  adv_index_add(idx, adv_data, 0);
+  adv_index_add(idx, scan_rsp, MGOS_BT_ADV_INDEX_SCAN_RSP);
+}
+
+static struct mg_str adv_index_entry_data(
+    const struct mgos_bt_adv_index *idx,
+    const struct mgos_bt_adv_index_entry *e) {
+  const uint8_t *base =
+      ((e->off & MGOS_BT_ADV_INDEX_SCAN_RSP) ? idx->scan_rsp : idx->adv_data);
+  return mg_mk_str_n(
+      (const char *) base + (e->off & ~MGOS_BT_ADV_INDEX_SCAN_RSP), e->len);
+}
+
+struct mg_str mgos_bt_adv_index_find(const struct mgos_bt_adv_index *idx,
+                                     enum mgos_bt_gap_eir_type t, int *pos) {
+  for (int i = *pos; i < idx->num_entries; i++) {
+    const struct mgos_bt_adv_index_entry *e = &idx->entries[i];
+    if (e->type != t) continue;
+    *pos = i + 1;
+    return adv_index_entry_data(idx, e);
   }
-  return s;
+  *pos = idx->num_entries;
+  return mg_mk_str_n(NULL, 0);
 }
 
-bool mgos_bt_gap_adv_data_has_service(struct mg_str adv_data,
-                                      const struct mgos_bt_uuid *svc_uuid) {
+struct mg_str mgos_bt_adv_index_get_name(const struct mgos_bt_adv_index *idx) {
+  struct mg_str short_name = MG_NULL_STR;
+  for (int i = 0; i < idx->num_entries; i++) {
+    const struct mgos_bt_adv_index_entry *e = &idx->entries[i];
+    if (e->type == MGOS_BT_GAP_EIR_FULL_NAME && e->len > 0) {
+      return adv_index_entry_data(idx, e);
+    }
+    if (e->type == MGOS_BT_GAP_EIR_SHORT_NAME && short_name.p == NULL) {
+      short_name = adv_index_entry_data(idx, e);
+    }
+  }
+  return short_name;
+}
+
+bool mgos_bt_adv_index_has_service(const struct mgos_bt_adv_index *idx,
+                                   const struct mgos_bt_uuid *svc_uuid) {
   enum mgos_bt_gap_eir_type t1, t2;
   switch (svc_uuid->len) {
     case 2:
@@ -68,19 +112,22 @@ bool mgos_bt_gap_adv_data_has_service(struct mg_str adv_data,
     default:
       return false;
   }
-  struct mg_str d = adv_data;
-  while ((d = mgos_bt_gap_parse_adv_data(d, t1)).len == svc_uuid->len) {
-    if (memcmp(d.p, svc_uuid->uuid.uuid128, svc_uuid->len) == 0) return true;
-  }
-  d = adv_data;
-  while ((d = mgos_bt_gap_parse_adv_data(d, t2)).len == svc_uuid->len) {
-    if (memcmp(d.p, svc_uuid->uuid.uuid128, svc_uuid->len) == 0) return true;
+  for (int i = 0; i < idx->num_entries; i++) {
+    const struct mgos_bt_adv_index_entry *e = &idx->entries[i];
+    if (e->type != t1 && e->type != t2) continue;
+    /* Each structure holds a list of UUIDs. */
+    struct mg_str d = adv_index_entry_data(idx, e);
+    for (size_t j = 0; j + svc_uuid->len <= d.len; j += svc_uuid->len) {
+      if (memcmp(d.p + j, svc_uuid->uuid.uuid128, svc_uuid->len) == 0) {
+        return true;
+      }
+    }
   }
   return false;
 }
 
-struct mg_str mgos_bt_gap_parse_service_data(
-    struct mg_str adv_data, const struct mgos_bt_uuid *svc_uuid) {
+struct mg_str mgos_bt_adv_index_get_service_data(
+    const struct mgos_bt_adv_index *idx, const struct mgos_bt_uuid *svc_uuid) {
   enum mgos_bt_gap_eir_type et;
   switch (svc_uuid->len) {
     case sizeof(svc_uuid->uuid.uuid16):
@@ -95,17 +142,123 @@ struct mg_str mgos_bt_gap_parse_service_data(
     default:
       goto out;
   }
-  while (adv_data.len > 0) {
-    struct mg_str svc_data = mgos_bt_gap_parse_adv_data(adv_data, et);
-    if (svc_data.len < svc_uuid->len) break;
+  for (int i = 0; i < idx->num_entries; i++) {
+    const struct mgos_bt_adv_index_entry *e = &idx->entries[i];
+    if (e->type != et || e->len < svc_uuid->len) continue;
+    struct mg_str svc_data = adv_index_entry_data(idx, e);
     if (memcmp(svc_data.p, &svc_uuid->uuid, svc_uuid->len) == 0) {
       return mg_mk_str_n(svc_data.p + svc_uuid->len,
                          svc_data.len - svc_uuid->len);
     }
-    svc_data.p += svc_data.len;
-    adv_data.len = adv_data.len - (svc_data.p - adv_data.p);
-    adv_data.p = svc_data.p;
   }
 out:
   return mg_mk_str_n(NULL, 0);
 }
+
+struct mg_str mgos_bt_gap_parse_adv_data(struct mg_str adv_data,
+                                         enum mgos_bt_gap_eir_type t) {
+  struct mgos_bt_adv_index idx;
+  int pos = 0;
+  mgos_bt_adv_index_init(&idx, adv_data, mg_mk_str_n(NULL, 0));
+  return mgos_bt_adv_index_find(&idx, t, &pos);
+}
+
+struct mg_str mgos_bt_gap_parse_name(struct mg_str adv_data) {
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, adv_data, mg_mk_str_n(NULL, 0));
+  return mgos_bt_adv_index_get_name(&idx);
+}
+
+bool mgos_bt_gap_adv_data_has_service(struct mg_str adv_data,
+                                      const struct mgos_bt_uuid *svc_uuid) {
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, adv_data, mg_mk_str_n(NULL, 0));
+  return mgos_bt_adv_index_has_service(&idx, svc_uuid);
+}
+
+struct mg_str mgos_bt_gap_parse_service_data(
+    struct mg_str adv_data, const struct mgos_bt_uuid *svc_uuid) {
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, adv_data, mg_mk_str_n(NULL, 0));
+  return mgos_bt_adv_index_get_service_data(&idx, svc_uuid);
+}
+
+static bool scan_filter_match_mfr(const struct mgos_bt_gap_scan_filter *f,
+                                  const struct mgos_bt_adv_index *idx) {
+  int pos = 0;
+  struct mg_str d;
+  while ((d = mgos_bt_adv_index_find(
+              idx, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA, &pos))
+             .p != NULL) {
+    if (d.len < 2) continue;
+    const uint8_t *dp = (const uint8_t *) d.p;
+    uint16_t id = dp[0] | (dp[1] << 8);
+    for (int i = 0; i < f->num_mfr_ids; i++) {
+      if (f->mfr_ids[i] == id) return true;
+    }
+  }
+  return false;
+}
+
+bool mgos_bt_gap_scan_filter_match(const struct mgos_bt_gap_scan_filter *f,
+                                   const struct mgos_bt_gap_scan_result *r,
+                                   const struct mgos_bt_adv_index *idx) {
+  int i;
+  /* Cheapest checks first. */
+  if (f->min_rssi != 0 && r->rssi < f->min_rssi) return false;
+  if (f->num_addrs > 0) {
+    for (i = 0; i < f->num_addrs; i++) {
+      if (memcmp(f->addrs[i].addr, r->addr.addr, sizeof(r->addr.addr)) == 0) {
+        break;
+      }
+    }
+    if (i == f->num_addrs) return false;
+  }
+  if (f->num_mfr_ids > 0 && !scan_filter_match_mfr(f, idx)) return false;
+  if (f->name_prefix != NULL) {
+    struct mg_str name = mgos_bt_adv_index_get_name(idx);
+    size_t pl = strlen(f->name_prefix);
+    if (name.len < pl || memcmp(name.p, f->name_prefix, pl) != 0) return false;
+  }
+  if (f->num_svc_uuids > 0) {
+    for (i = 0; i < f->num_svc_uuids; i++) {
+      if (mgos_bt_adv_index_has_service(idx, &f->svc_uuids[i])) break;
+    }
+    if (i == f->num_svc_uuids) return false;
+  }
+  return true;
+}
+
+struct mgos_bt_gap_scan_filter *mgos_bt_gap_scan_filter_copy(
+    const struct mgos_bt_gap_scan_filter *f) {
+  size_t svc_size = f->num_svc_uuids * sizeof(*f->svc_uuids);
+  size_t addrs_size = f->num_addrs * sizeof(*f->addrs);
+  size_t mfr_size = f->num_mfr_ids * sizeof(*f->mfr_ids);
+  size_t name_size = (f->name_prefix ? strlen(f->name_prefix) + 1 : 0);
+  /* Arrays are ordered by alignment requirement, UUIDs are packed. */
+  struct mgos_bt_gap_scan_filter *res = (struct mgos_bt_gap_scan_filter *)
+      calloc(1, sizeof(*res) + svc_size + addrs_size + mfr_size + name_size);
+  if (res == NULL) return NULL;
+  *res = *f;
+  uint8_t *p = (uint8_t *) (res + 1);
+  if (addrs_size > 0) {
+    memcpy(p, f->addrs, addrs_size);
+    res->addrs = (struct mgos_bt_addr *) p;
+    p += addrs_size;
+  }
+  if (mfr_size > 0) {
+    memcpy(p, f->mfr_ids, mfr_size);
+    res->mfr_ids = (uint16_t *) p;
+    p += mfr_size;
+  }
+  if (svc_size > 0) {
+    memcpy(p, f->svc_uuids, svc_size);
+    res->svc_uuids = (struct mgos_bt_uuid *) p;
+    p += svc_size;
+  }
+  if (name_size > 0) {
+    memcpy(p, f->name_prefix, name_size);
+    res->name_prefix = (char *) p;
+  }
+  return res;
+}
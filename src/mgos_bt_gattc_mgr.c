@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bt_gattc_mgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/cs_dbg.h"
+#include "common/queue.h"
+
+#include "mgos_bt_gattc.h"
+#include "mgos_sys_config.h"
+#include "mgos_system.h"
+#include "mgos_timers.h"
+#include "mgos_utils.h"
+
+#define MGOS_BT_GATTC_MGR_TICK_MS 250
+
+enum peer_state {
+  PEER_IDLE,
+  PEER_CONNECTING,
+  PEER_CONNECTED,
+  PEER_DISCONNECTING,
+  /* Connect was cancelled, waiting for the outcome. Still holds a link. */
+  PEER_CANCELLING,
+};
+
+struct peer {
+  struct mgos_bt_addr addr;
+  bool addr_type_known;
+  struct mgos_bt_gattc_mgr_peer_opts opts;
+  enum peer_state state;
+  int conn_id;
+  bool released;
+  bool removed; /* Removed while holding a link, freed once it's released. */
+  int64_t state_since_us;
+  int64_t last_attempt_us;
+  int64_t next_attempt_us;
+  int backoff_ms;
+  bool have_params;
+  struct mgos_bt_gattc_conn_params params;
+  SLIST_ENTRY(peer) next;
+};
+
+static SLIST_HEAD(s_peers, peer) s_peers = SLIST_HEAD_INITIALIZER(s_peers);
+static mgos_timer_id s_tick_timer = MGOS_INVALID_TIMER_ID;
+static struct mgos_bt_gattc_mgr_stats s_stats;
+static uint64_t s_connect_time_us = 0;
+static uint64_t s_link_time_us = 0, s_total_time_us = 0;
+static int64_t s_last_tick_us = 0;
+
+static struct peer *find_peer(const struct mgos_bt_addr *addr) {
+  struct peer *p;
+  SLIST_FOREACH(p, &s_peers, next) {
+    if (mgos_bt_addr_cmp(&p->addr, addr) == 0) return p;
+  }
+  return NULL;
+}
+
+static struct peer *find_peer_by_conn_id(int conn_id) {
+  struct peer *p;
+  SLIST_FOREACH(p, &s_peers, next) {
+    if ((p->state == PEER_CONNECTED || p->state == PEER_DISCONNECTING) &&
+        p->conn_id == conn_id) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static void set_state(struct peer *p, enum peer_state state) {
+  p->state = state;
+  p->state_since_us = mgos_uptime_micros();
+}
+
+static int num_links(void) {
+  int n = 0;
+  struct peer *p;
+  SLIST_FOREACH(p, &s_peers, next) {
+    if (p->state != PEER_IDLE) n++;
+  }
+  return n;
+}
+
+static void schedule_retry(struct peer *p) {
+  int min_ms = mgos_sys_config_get_bt_gattc_reconnect_min_ms();
+  int max_ms = mgos_sys_config_get_bt_gattc_reconnect_max_ms();
+  p->backoff_ms = (p->backoff_ms == 0 ? min_ms : p->backoff_ms * 2);
+  if (p->backoff_ms > max_ms) p->backoff_ms = max_ms;
+  p->next_attempt_us = mgos_uptime_micros() + p->backoff_ms * 1000LL;
+}
+
+static void connect_failed(struct peer *p) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  s_stats.num_failures++;
+  /* Try the other address type next time. */
+  if (!p->addr_type_known) {
+    p->addr.type = (p->addr.type == MGOS_BT_ADDR_TYPE_PUBLIC
+                        ? MGOS_BT_ADDR_TYPE_RANDOM_STATIC
+                        : MGOS_BT_ADDR_TYPE_PUBLIC);
+  }
+  set_state(p, PEER_IDLE);
+  schedule_retry(p);
+  LOG(LL_DEBUG, ("%s: connect failed, retry in %d ms",
+                 mgos_bt_addr_to_str(&p->addr, 0, buf), p->backoff_ms));
+}
+
+static void peer_connect(struct peer *p) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  LOG(LL_DEBUG, ("%s: connecting",
+                 mgos_bt_addr_to_str(&p->addr, MGOS_BT_ADDR_STRINGIFY_TYPE,
+                                     buf)));
+  p->released = false;
+  p->conn_id = -1;
+  set_state(p, PEER_CONNECTING);
+  p->last_attempt_us = p->state_since_us;
+  if (!mgos_bt_gattc_connect_opts(&p->addr,
+                                  (p->have_params ? &p->params : NULL))) {
+    connect_failed(p);
+  }
+}
+
+/* Returns false if the peer has to wait for the attempt to end. */
+static bool peer_cancel(struct peer *p) {
+  if (mgos_bt_gattc_connect_cancel(&p->addr)) return true;
+  set_state(p, PEER_CANCELLING);
+  return false;
+}
+
+/* Link of a removed peer has been released, peer can go now. */
+static bool free_if_removed(struct peer *p) {
+  if (!p->removed) return false;
+  SLIST_REMOVE(&s_peers, p, peer, next);
+  free(p);
+  return true;
+}
+
+/* Outcome of the cancelled attempt is known, the link is free. */
+static void cancel_done(struct peer *p) {
+  if (!free_if_removed(p)) connect_failed(p);
+}
+
+/*
+ * Link of the peer is gone: attempt failed (conn_id -1) or connection
+ * closed. Events of earlier connections are stale and ignored.
+ */
+static void peer_closed(struct peer *p, const struct mgos_bt_gatt_conn *conn) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  enum peer_state prev_state = p->state;
+  bool attempt_failed = (conn->conn_id == (uint16_t) -1);
+  if (attempt_failed ? (prev_state != PEER_CONNECTING &&
+                        prev_state != PEER_CANCELLING)
+                     : conn->conn_id != p->conn_id) {
+    return;
+  }
+  switch (prev_state) {
+    case PEER_IDLE:
+      return;
+    case PEER_CANCELLING:
+      cancel_done(p);
+      return;
+    case PEER_CONNECTING:
+      connect_failed(p);
+      return;
+    default:
+      break;
+  }
+  if (free_if_removed(p)) return;
+  set_state(p, PEER_IDLE);
+  if (prev_state == PEER_DISCONNECTING) {
+    /* Next poll is due poll_interval_ms after this one started. */
+    p->next_attempt_us =
+        MAX(mgos_uptime_micros(),
+            p->last_attempt_us + p->opts.poll_interval_ms * 1000LL);
+  } else {
+    s_stats.num_lost++;
+    schedule_retry(p);
+  }
+  LOG(LL_DEBUG, ("%s: disconnected", mgos_bt_addr_to_str(&p->addr, 0, buf)));
+  if (p->opts.cb != NULL) p->opts.cb(conn, false, p->opts.cb_arg);
+}
+
+/* Connection is still there, i.e. its disconnect event was not lost. */
+static bool peer_link_alive(const struct peer *p) {
+  struct mgos_bt_gatt_conn c;
+  return (mgos_bt_gattc_get_conn(p->conn_id, &c) &&
+          mgos_bt_addr_cmp(&c.addr, &p->addr) == 0);
+}
+
+static void peer_disconnect(struct peer *p) {
+  switch (p->state) {
+    case PEER_CONNECTING:
+      if (peer_cancel(p)) set_state(p, PEER_IDLE);
+      break;
+    case PEER_CONNECTED:
+      set_state(p, PEER_DISCONNECTING);
+      mgos_bt_gattc_disconnect(p->conn_id);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Picks the peer that has been waiting the longest. */
+static struct peer *next_peer_to_connect(int64_t now) {
+  struct peer *p, *res = NULL;
+  SLIST_FOREACH(p, &s_peers, next) {
+    if (p->state != PEER_IDLE || p->next_attempt_us > now) continue;
+    if (res == NULL || p->next_attempt_us < res->next_attempt_us) res = p;
+  }
+  return res;
+}
+
+static void mgr_tick(void *arg) {
+  struct peer *p, *pt;
+  int64_t now = mgos_uptime_micros();
+  int connect_timeout_ms = mgos_sys_config_get_bt_gattc_connect_timeout_ms();
+  int max_links = mgos_sys_config_get_bt_gattc_max_links();
+  int n;
+  SLIST_FOREACH_SAFE(p, &s_peers, next, pt) {
+    int64_t in_state_ms = (now - p->state_since_us) / 1000;
+    if ((p->state == PEER_CONNECTED || p->state == PEER_DISCONNECTING) &&
+        !peer_link_alive(p)) {
+      /* Disconnect event was lost. */
+      struct mgos_bt_gatt_conn c = {.addr = p->addr, .conn_id = p->conn_id};
+      peer_closed(p, &c);
+      continue;
+    }
+    switch (p->state) {
+      case PEER_CONNECTING:
+        if (in_state_ms >= connect_timeout_ms && peer_cancel(p)) {
+          connect_failed(p);
+        }
+        break;
+      case PEER_CONNECTED:
+        /* Remember parameters for the next connection. */
+        if (mgos_bt_gattc_get_conn_params(p->conn_id, &p->params)) {
+          p->have_params = true;
+        }
+        if (p->opts.poll_interval_ms > 0 &&
+            (p->released ||
+             (p->opts.max_hold_ms > 0 && in_state_ms >= p->opts.max_hold_ms))) {
+          peer_disconnect(p);
+        }
+        break;
+      case PEER_DISCONNECTING:
+        /* Disconnect event was lost, don't hold the link forever. */
+        if (in_state_ms >= connect_timeout_ms && !free_if_removed(p)) {
+          set_state(p, PEER_IDLE);
+          schedule_retry(p);
+        }
+        break;
+      case PEER_CANCELLING:
+        /* Failure is reported by then, the event must have been lost. */
+        if (in_state_ms >= MGOS_BT_GATTC_MAX_CONNECT_TIME_MS) cancel_done(p);
+        break;
+      case PEER_IDLE:
+        break;
+    }
+  }
+  n = num_links();
+  while (n < max_links && (p = next_peer_to_connect(now)) != NULL) {
+    peer_connect(p);
+    if (p->state == PEER_CONNECTING) n++;
+  }
+  if (s_last_tick_us > 0 && max_links > 0) {
+    s_total_time_us += (now - s_last_tick_us) * max_links;
+    s_link_time_us += (now - s_last_tick_us) * MIN(n, max_links);
+  }
+  s_last_tick_us = now;
+  (void) arg;
+}
+
+static void mgr_ev(int ev, void *ev_data, void *userdata) {
+  char buf[MGOS_BT_ADDR_STR_LEN];
+  const struct mgos_bt_gatt_conn *conn =
+      (const struct mgos_bt_gatt_conn *) ev_data;
+  struct peer *p;
+  int64_t now = mgos_uptime_micros();
+  switch (ev) {
+    case MGOS_BT_GATTC_EV_CONNECT: {
+      p = find_peer(&conn->addr);
+      if (p == NULL || p->removed || p->state == PEER_CONNECTED) break;
+      if (p->state == PEER_CANCELLING) {
+        /* Opened late, it is being closed. Hold the link until then. */
+        p->addr_type_known = true;
+        p->conn_id = conn->conn_id;
+        break;
+      }
+      if (p->state == PEER_CONNECTING) {
+        s_connect_time_us += now - p->state_since_us;
+        s_stats.num_connects++;
+      }
+      p->addr_type_known = true;
+      p->conn_id = conn->conn_id;
+      p->backoff_ms = 0;
+      set_state(p, PEER_CONNECTED);
+      LOG(LL_DEBUG, ("%s: connected, cid %d",
+                     mgos_bt_addr_to_str(&p->addr, 0, buf), p->conn_id));
+      if (p->opts.cb != NULL) p->opts.cb(conn, true, p->opts.cb_arg);
+      break;
+    }
+    case MGOS_BT_GATTC_EV_DISCONNECT: {
+      p = find_peer_by_conn_id(conn->conn_id);
+      if (p == NULL) p = find_peer(&conn->addr);
+      if (p != NULL) peer_closed(p, conn);
+      break;
+    }
+  }
+  /* Link may have been freed, no need to wait for the tick. */
+  mgr_tick(NULL);
+  (void) userdata;
+}
+
+bool mgos_bt_gattc_mgr_add_peer(
+    const struct mgos_bt_addr *addr,
+    const struct mgos_bt_gattc_mgr_peer_opts *opts) {
+  struct peer *p = find_peer(addr);
+  if (p != NULL) {
+    if (p->removed) {
+      p->removed = false;
+      s_stats.num_peers++;
+    }
+    p->opts = *opts;
+    return true;
+  }
+  if (s_tick_timer == MGOS_INVALID_TIMER_ID) {
+    mgos_event_add_handler(MGOS_BT_GATTC_EV_CONNECT, mgr_ev, NULL);
+    mgos_event_add_handler(MGOS_BT_GATTC_EV_DISCONNECT, mgr_ev, NULL);
+    s_tick_timer = mgos_set_timer(MGOS_BT_GATTC_MGR_TICK_MS, MGOS_TIMER_REPEAT,
+                                  mgr_tick, NULL);
+    if (s_tick_timer == MGOS_INVALID_TIMER_ID) return false;
+  }
+  p = (struct peer *) calloc(1, sizeof(*p));
+  if (p == NULL) return false;
+  p->addr = *addr;
+  p->addr_type_known = (addr->type != MGOS_BT_ADDR_TYPE_NONE);
+  if (!p->addr_type_known) p->addr.type = MGOS_BT_ADDR_TYPE_PUBLIC;
+  p->opts = *opts;
+  p->state = PEER_IDLE;
+  p->next_attempt_us = mgos_uptime_micros();
+  SLIST_INSERT_HEAD(&s_peers, p, next);
+  s_stats.num_peers++;
+  return true;
+}
+
+bool mgos_bt_gattc_mgr_remove_peer(const struct mgos_bt_addr *addr) {
+  struct peer *p = find_peer(addr);
+  if (p == NULL || p->removed) return false;
+  peer_disconnect(p);
+  s_stats.num_peers--;
+  /* Keep counting the link until it is actually released. */
+  if (p->state != PEER_IDLE) {
+    p->removed = true;
+    return true;
+  }
+  SLIST_REMOVE(&s_peers, p, peer, next);
+  free(p);
+  return true;
+}
+
+void mgos_bt_gattc_mgr_release(const struct mgos_bt_addr *addr) {
+  struct peer *p = find_peer(addr);
+  if (p == NULL || p->removed) return;
+  p->released = true;
+  mgr_tick(NULL);
+}
+
+void mgos_bt_gattc_mgr_get_stats(struct mgos_bt_gattc_mgr_stats *stats) {
+  *stats = s_stats;
+  stats->num_links = num_links();
+  stats->max_links = mgos_sys_config_get_bt_gattc_max_links();
+  if (s_stats.num_connects > 0) {
+    stats->avg_connect_ms = s_connect_time_us / 1000.0 / s_stats.num_connects;
+  }
+  if (s_total_time_us > 0) {
+    stats->link_utilization = (float) s_link_time_us / s_total_time_us;
+  }
+}
@@ -126,6 +126,22 @@ const struct mjs_c_struct_member *mgos_bt_gattc_js_get_discovery_result_arg_def(
   return gattc_discovery_result_arg_def;
 }
 
+static const struct mjs_c_struct_member gattc_discovery_done_arg_def[] = {
+    {"conn", offsetof(struct mgos_bt_gattc_discovery_done_arg, conn),
+     MJS_STRUCT_FIELD_TYPE_STRUCT, gatt_conn_def},
+    {"status", offsetof(struct mgos_bt_gattc_discovery_done_arg, status),
+     MJS_STRUCT_FIELD_TYPE_INT, NULL},
+    {"numEntries",
+     offsetof(struct mgos_bt_gattc_discovery_done_arg, num_entries),
+     MJS_STRUCT_FIELD_TYPE_INT, NULL},
+    {NULL, 0, MJS_STRUCT_FIELD_TYPE_INVALID, NULL},
+};
+
+const struct mjs_c_struct_member *mgos_bt_gattc_js_get_discovery_done_arg_def(
+    void) {
+  return gattc_discovery_done_arg_def;
+}
+
 static const struct mjs_c_struct_member gattc_read_result_def[] = {
     {"conn", offsetof(struct mgos_bt_gattc_read_result, conn),
      MJS_STRUCT_FIELD_TYPE_STRUCT, gatt_conn_def},
@@ -232,10 +248,10 @@ void mgos_bt_gatts_send_resp_data_js(struct mgos_bt_gatts_conn *gsc,
   mgos_bt_gatts_send_resp_data(gsc, ra, *data);
 }
 
-void mgos_bt_gatts_notify_js(struct mgos_bt_gatts_conn *gsc, int mode,
+bool mgos_bt_gatts_notify_js(struct mgos_bt_gatts_conn *gsc, int mode,
                              int handle, struct mg_str *data) {
-  mgos_bt_gatts_notify(gsc, (enum mgos_bt_gatt_notify_mode) mode, handle,
-                       *data);
+  return mgos_bt_gatts_notify(gsc, (enum mgos_bt_gatt_notify_mode) mode,
+                              handle, *data);
 }
 
 #endif /* MGOS_HAVE_MJS */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bt_notify_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct mgos_bt_notify_buf *mgos_bt_notify_buf_new(
+    struct mg_str data, mgos_bt_gatts_free_cb_t free_cb, void *free_arg) {
+  struct mgos_bt_notify_buf *nb = NULL;
+  if (free_cb != NULL) {
+    nb = (struct mgos_bt_notify_buf *) calloc(1, sizeof(*nb));
+    if (nb == NULL) {
+      free_cb((void *) data.p, free_arg);
+      return NULL;
+    }
+    nb->data = data;
+    nb->free_cb = free_cb;
+    nb->free_arg = free_arg;
+  } else {
+    /* Copy data inline, saves an allocation. */
+    nb = (struct mgos_bt_notify_buf *) calloc(1, sizeof(*nb) + data.len);
+    if (nb == NULL) return NULL;
+    memcpy(nb + 1, data.p, data.len);
+    nb->data = mg_mk_str_n((const char *) (nb + 1), data.len);
+  }
+  nb->refcnt = 1;
+  return nb;
+}
+
+void mgos_bt_notify_buf_unref(struct mgos_bt_notify_buf *nb) {
+  if (nb == NULL || --nb->refcnt > 0) return;
+  if (nb->free_cb != NULL) nb->free_cb((void *) nb->data.p, nb->free_arg);
+  memset(nb, 0, sizeof(*nb));
+  free(nb);
+}
+
+void mgos_bt_notify_entry_free(struct mgos_bt_notify_entry *e) {
+  mgos_bt_notify_buf_unref(e->buf);
+  memset(e, 0, sizeof(*e));
+  free(e);
+}
+
+struct mg_str mgos_bt_notify_entry_data(const struct mgos_bt_notify_entry *e,
+                                        uint16_t mtu) {
+  size_t max_len = (mtu > 3 ? mtu - 3 : 0);
+  size_t len = e->buf->data.len;
+  return mg_mk_str_n(e->buf->data.p, (len < max_len ? len : max_len));
+}
+
+void mgos_bt_notify_queue_init(struct mgos_bt_notify_queue *q) {
+  memset(q, 0, sizeof(*q));
+  STAILQ_INIT(&q->entries);
+}
+
+/* Returns the oldest queued entry for the handle. */
+static struct mgos_bt_notify_entry *find_entry(struct mgos_bt_notify_queue *q,
+                                               uint16_t handle,
+                                               bool need_confirm) {
+  struct mgos_bt_notify_entry *e;
+  STAILQ_FOREACH(e, &q->entries, next) {
+    if (e->handle == handle && e->need_confirm == need_confirm) return e;
+  }
+  return NULL;
+}
+
+bool mgos_bt_notify_queue_push(struct mgos_bt_notify_queue *q,
+                               uint16_t handle, bool need_confirm,
+                               enum mgos_bt_gatts_notify_qmode qmode,
+                               int max_len, struct mgos_bt_notify_buf *nb) {
+  struct mgos_bt_notify_entry *e = NULL;
+  if (qmode == MGOS_BT_GATTS_NOTIFY_QMODE_LATEST) {
+    e = find_entry(q, handle, need_confirm);
+  }
+  if (e != NULL) {
+    /* Replace the queued value in place, keeping its position. */
+    nb->refcnt++;
+    mgos_bt_notify_buf_unref(e->buf);
+    e->buf = nb;
+    q->num_dropped++;
+    return true;
+  }
+  if (q->len >= max_len) {
+    struct mgos_bt_notify_entry *oe = NULL;
+    if (qmode != MGOS_BT_GATTS_NOTIFY_QMODE_ALL) {
+      oe = find_entry(q, handle, need_confirm);
+    }
+    q->num_dropped++;
+    if (oe == NULL) return false;
+    STAILQ_REMOVE(&q->entries, oe, mgos_bt_notify_entry, next);
+    q->len--;
+    mgos_bt_notify_entry_free(oe);
+  }
+  e = (struct mgos_bt_notify_entry *) calloc(1, sizeof(*e));
+  if (e == NULL) return false;
+  e->handle = handle;
+  e->need_confirm = need_confirm;
+  e->buf = nb;
+  nb->refcnt++;
+  STAILQ_INSERT_TAIL(&q->entries, e, next);
+  q->len++;
+  return true;
+}
+
+struct mgos_bt_notify_entry *mgos_bt_notify_queue_pop(
+    struct mgos_bt_notify_queue *q) {
+  struct mgos_bt_notify_entry *e = STAILQ_FIRST(&q->entries);
+  if (e == NULL) return NULL;
+  STAILQ_REMOVE_HEAD(&q->entries, next);
+  q->len--;
+  return e;
+}
+
+void mgos_bt_notify_queue_clear(struct mgos_bt_notify_queue *q) {
+  struct mgos_bt_notify_entry *e;
+  while ((e = mgos_bt_notify_queue_pop(q)) != NULL) {
+    mgos_bt_notify_entry_free(e);
+  }
+}
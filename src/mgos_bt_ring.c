@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_bt_ring.h"
+
+#include <string.h>
+
+/*
+ * Each record is preceded by a header holding payload length.
+ * Records are padded so that headers (and payloads) are always aligned.
+ * If a record does not fit at the end of the buffer, a wrap marker is written
+ * in place of the header and the record is placed at the beginning.
+ * Head never catches up with tail, so head == tail means empty.
+ */
+#define RING_ALIGN sizeof(void *)
+#define RING_ALIGN_UP(x) (((x) + RING_ALIGN - 1) & ~(RING_ALIGN - 1))
+#define RING_HDR_SIZE RING_ALIGN_UP(sizeof(uint32_t))
+#define RING_WRAP_MARKER 0xffffffff
+
+#define LOAD_ACQ(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+void mgos_bt_ring_init(struct mgos_bt_ring *r, void *buf, size_t size) {
+  memset(r, 0, sizeof(*r));
+  r->buf = (uint8_t *) buf;
+  r->size = size & ~(RING_ALIGN - 1);
+}
+
+static uint32_t ring_used(const struct mgos_bt_ring *r, uint32_t head,
+                          uint32_t tail) {
+  return (head >= tail ? head - tail : r->size - tail + head);
+}
+
+void *mgos_bt_ring_reserve(struct mgos_bt_ring *r, size_t len) {
+  return mgos_bt_ring_reserve_max(r, len, r->size);
+}
+
+void *mgos_bt_ring_reserve_max(struct mgos_bt_ring *r, size_t len,
+                               size_t max_used) {
+  uint32_t total = RING_HDR_SIZE + RING_ALIGN_UP(len);
+  uint32_t head = r->head;
+  uint32_t tail = LOAD_ACQ(&r->tail);
+  uint32_t pos;
+  bool wrap = false;
+  if (ring_used(r, head, tail) + total > max_used) goto drop;
+  if (head >= tail) {
+    uint32_t avail_end = r->size - head;
+    if (total < avail_end || (total == avail_end && tail != 0)) {
+      pos = head;
+    } else if (total < tail) {
+      pos = 0;
+      wrap = true;
+    } else {
+      goto drop;
+    }
+  } else if (head + total < tail) {
+    pos = head;
+  } else {
+    goto drop;
+  }
+  r->res_pos = pos;
+  r->res_len = len;
+  r->res_wrap = wrap;
+  return r->buf + pos + RING_HDR_SIZE;
+drop:
+  r->num_dropped++;
+  return NULL;
+}
+
+void mgos_bt_ring_commit(struct mgos_bt_ring *r) {
+  uint32_t pos = r->res_pos;
+  if (r->res_wrap) {
+    *((uint32_t *) (r->buf + r->head)) = RING_WRAP_MARKER;
+  }
+  *((uint32_t *) (r->buf + pos)) = r->res_len;
+  uint32_t new_head = pos + RING_HDR_SIZE + RING_ALIGN_UP(r->res_len);
+  if (new_head == r->size) new_head = 0;
+  STORE_REL(&r->head, new_head);
+  r->num_pushed++;
+  uint32_t used = ring_used(r, new_head, LOAD_ACQ(&r->tail));
+  if (used > r->high_water) r->high_water = used;
+}
+
+void *mgos_bt_ring_peek(struct mgos_bt_ring *r, size_t *len) {
+  uint32_t tail = r->tail;
+  uint32_t head = LOAD_ACQ(&r->head);
+  if (tail == head) return NULL;
+  uint32_t rec_len = *((uint32_t *) (r->buf + tail));
+  if (rec_len == RING_WRAP_MARKER) {
+    tail = 0;
+    STORE_REL(&r->tail, tail);
+    rec_len = *((uint32_t *) r->buf);
+  }
+  if (len != NULL) *len = rec_len;
+  return r->buf + tail + RING_HDR_SIZE;
+}
+
+void mgos_bt_ring_consume(struct mgos_bt_ring *r) {
+  uint32_t tail = r->tail;
+  uint32_t rec_len = *((uint32_t *) (r->buf + tail));
+  tail += RING_HDR_SIZE + RING_ALIGN_UP(rec_len);
+  if (tail == r->size) tail = 0;
+  STORE_REL(&r->tail, tail);
+}
+
+void mgos_bt_ring_get_stats(const struct mgos_bt_ring *r,
+                            struct mgos_bt_ring_stats *stats) {
+  stats->size = r->size;
+  stats->used = ring_used(r, LOAD_ACQ(&r->head), LOAD_ACQ(&r->tail));
+  stats->high_water = r->high_water;
+  stats->num_pushed = r->num_pushed;
+  stats->num_dropped = r->num_dropped;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Fuzz target for the advertisement data index.
+ * Input is split into advertisement data and scan response, the index
+ * is checked against a straightforward reference parser.
+ * Built with -DFUZZ_LIBFUZZER for libFuzzer, otherwise runs a
+ * self-contained random driver.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mgos_bt_gap.h"
+
+#include "test_util.h"
+
+/* Index ignores anything beyond 127 bytes into each buffer. */
+#define REF_MAX_DATA_LEN 127
+
+struct ref_entry {
+  uint8_t type;
+  const uint8_t *data;
+  size_t len;
+};
+
+static int ref_parse(const uint8_t *buf, size_t buf_len, struct ref_entry *out,
+                     int n) {
+  if (buf_len > REF_MAX_DATA_LEN) buf_len = REF_MAX_DATA_LEN;
+  for (size_t i = 0; i < buf_len && n < MGOS_BT_ADV_INDEX_MAX_ENTRIES;) {
+    size_t len = buf[i];
+    if (len == 0 || i + len + 1 > buf_len) break;
+    out[n].type = buf[i + 1];
+    out[n].data = buf + i + 2;
+    out[n].len = len - 1;
+    n++;
+    i += len + 1;
+  }
+  return n;
+}
+
+static void check(const uint8_t *ad, size_t ad_len, const uint8_t *sr,
+                  size_t sr_len) {
+  struct ref_entry ref[MGOS_BT_ADV_INDEX_MAX_ENTRIES];
+  int n = ref_parse(ad, ad_len, ref, 0);
+  n = ref_parse(sr, sr_len, ref, n);
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, mg_mk_str_n((const char *) ad, ad_len),
+                         mg_mk_str_n((const char *) sr, sr_len));
+  ASSERT_EQ(idx.num_entries, n);
+  for (int k = 0; k < n; k++) {
+    int pos = k;
+    struct mg_str d = mgos_bt_adv_index_find(&idx, ref[k].type, &pos);
+    ASSERT_EQ(pos, k + 1);
+    ASSERT(d.p == (const char *) ref[k].data);
+    ASSERT_EQ(d.len, ref[k].len);
+  }
+  /* Must not crash or read out of bounds. */
+  struct mgos_bt_uuid u = {.len = 2};
+  mgos_bt_adv_index_get_name(&idx);
+  mgos_bt_adv_index_has_service(&idx, &u);
+  mgos_bt_adv_index_get_service_data(&idx, &u);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size < 1) return 0;
+  size_t ad_len = data[0];
+  if (ad_len > size - 1) ad_len = size - 1;
+  /* Copies, so that ASan catches reads past the end of either buffer. */
+  uint8_t *ad = malloc(ad_len + 1), *sr = malloc(size - 1 - ad_len + 1);
+  memcpy(ad, data + 1, ad_len);
+  memcpy(sr, data + 1 + ad_len, size - 1 - ad_len);
+  check(ad, ad_len, sr, size - 1 - ad_len);
+  free(ad);
+  free(sr);
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+/*
+ * Random inputs are mostly well-formed chains of structures of random
+ * length, to reach deep offsets, with occasional corruption.
+ */
+static size_t gen_buf(uint32_t *rs, uint8_t *buf, size_t max_len) {
+  size_t len = test_rand(rs) % (max_len + 1), i = 0;
+  while (i < len) {
+    size_t sl = 1 + test_rand(rs) % (test_rand(rs) % 4 == 0 ? 255 : 8);
+    buf[i++] = sl;
+    for (size_t j = 0; j < sl && i < len; j++) buf[i++] = test_rand(rs);
+  }
+  if (len > 0 && test_rand(rs) % 8 == 0) buf[test_rand(rs) % len] ^= 0xff;
+  return len;
+}
+
+int main(int argc, char **argv) {
+  int iters = (argc > 1 ? atoi(argv[1]) : 200000);
+  uint32_t rs = 0x12345678;
+  uint8_t in[1 + 2 * 300];
+  fprintf(stderr, "fuzz_adv_index: %d iterations\n", iters);
+  for (int it = 0; it < iters; it++) {
+    size_t ad_len = gen_buf(&rs, in + 1, 300);
+    size_t sr_len = gen_buf(&rs, in + 1 + ad_len, 300);
+    in[0] = (ad_len > 255 ? 255 : ad_len);
+    if (ad_len > 255) continue;
+    LLVMFuzzerTestOneInput(in, 1 + ad_len + sr_len);
+  }
+  return 0;
+}
+#endif
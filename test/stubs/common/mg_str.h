@@ -0,0 +1,26 @@
+/* Minimal host stand-in for common/mg_str.h, enough for the tests. */
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+struct mg_str {
+  const char *p;
+  size_t len;
+};
+
+#define MG_NULL_STR \
+  { NULL, 0 }
+#define MG_MK_STR(s) \
+  { s, sizeof(s) - 1 }
+#define MG_MK_STR_N(s, len) \
+  { s, len }
+
+static inline struct mg_str mg_mk_str_n(const char *s, size_t len) {
+  struct mg_str r = {s, len};
+  return r;
+}
+
+static inline struct mg_str mg_mk_str(const char *s) {
+  return mg_mk_str_n(s, (s == NULL ? 0 : strlen(s)));
+}
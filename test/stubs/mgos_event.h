@@ -0,0 +1,10 @@
+/* Minimal host stand-in for mgos_event.h, enough for the tests. */
+#pragma once
+
+#include <stdbool.h>
+
+#define MGOS_EVENT_BASE(a, b, c) ((a) << 24 | (b) << 16 | (c) << 8)
+
+typedef void (*mgos_event_handler_t)(int ev, void *ev_data, void *userdata);
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata);
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Minimal stand-in for mgos_sys_config.h, values are set by the test. */
+
+#pragma once
+
+#include <stdbool.h>
+
+int mgos_sys_config_get_bt_gattc_max_links(void);
+int mgos_sys_config_get_bt_gattc_connect_timeout_ms(void);
+int mgos_sys_config_get_bt_gattc_reconnect_min_ms(void);
+int mgos_sys_config_get_bt_gattc_reconnect_max_ms(void);
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Minimal stand-in for mgos_timers.h, for host tests. Time and timers are
+ * provided by the test.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef uintptr_t mgos_timer_id;
+typedef void (*timer_callback)(void *param);
+
+#define MGOS_INVALID_TIMER_ID 0
+#define MGOS_TIMER_REPEAT 1
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg);
+void mgos_clear_timer(mgos_timer_id id);
+int64_t mgos_uptime_micros(void);
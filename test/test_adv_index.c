@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Advertisement data index tests and a benchmark of the index against
+ * scanning the buffer once per lookup.
+ */
+
+#include <string.h>
+
+#include "mgos_bt_gap.h"
+
+#include "test_util.h"
+
+static const uint8_t s_adv[] = {
+    0x02, MGOS_BT_GAP_EIR_FLAGS, 0x06,
+    0x05, MGOS_BT_GAP_EIR_SERVICE_16_INCOMPLETE, 0x0a, 0x18, 0x0f, 0x18,
+    0x05, MGOS_BT_GAP_EIR_SERVICE_DATA_16, 0x0f, 0x18, 0x55, 0x66,
+    0x07, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA, 0x59, 0x00, 1, 2, 3, 4,
+    0x04, MGOS_BT_GAP_EIR_SHORT_NAME, 'a', 'b', 'c',
+};
+
+static const uint8_t s_rsp[] = {
+    0x09, MGOS_BT_GAP_EIR_FULL_NAME, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h',
+    0x03, MGOS_BT_GAP_EIR_SERVICE_16, 0x0d, 0x18,
+};
+
+#define ADV mg_mk_str_n((const char *) s_adv, sizeof(s_adv))
+#define RSP mg_mk_str_n((const char *) s_rsp, sizeof(s_rsp))
+
+static struct mgos_bt_uuid uuid16(uint16_t u) {
+  struct mgos_bt_uuid res = {.len = 2};
+  res.uuid.uuid16 = u;
+  return res;
+}
+
+static void test_lookups(void) {
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, ADV, RSP);
+  ASSERT_EQ(idx.num_entries, 7);
+  struct mg_str name = mgos_bt_adv_index_get_name(&idx);
+  ASSERT_EQ(name.len, 8);
+  ASSERT(memcmp(name.p, "abcdefgh", 8) == 0);
+  struct mgos_bt_uuid u = uuid16(0x180f);
+  ASSERT(mgos_bt_adv_index_has_service(&idx, &u));
+  u = uuid16(0x180d);
+  ASSERT(mgos_bt_adv_index_has_service(&idx, &u));
+  u = uuid16(0x1809);
+  ASSERT(!mgos_bt_adv_index_has_service(&idx, &u));
+  u = uuid16(0x180f);
+  struct mg_str sd = mgos_bt_adv_index_get_service_data(&idx, &u);
+  ASSERT_EQ(sd.len, 2);
+  ASSERT_EQ((uint8_t) sd.p[0], 0x55);
+  int pos = 0;
+  struct mg_str md = mgos_bt_adv_index_find(
+      &idx, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA, &pos);
+  ASSERT_EQ(md.len, 6);
+  ASSERT(md.p == (const char *) s_adv + 17);
+  md = mgos_bt_adv_index_find(
+      &idx, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA, &pos);
+  ASSERT(md.p == NULL);
+  /* Single buffer helpers. */
+  name = mgos_bt_gap_parse_name(ADV);
+  ASSERT_EQ(name.len, 3);
+}
+
+static void test_repeated_types(void) {
+  const uint8_t ad[] = {0x02, 0xff, 1, 0x03, 0xff, 2, 3, 0x02, 0xff, 4};
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, mg_mk_str_n((const char *) ad, sizeof(ad)),
+                         mg_mk_str_n(NULL, 0));
+  int pos = 0, n = 0;
+  struct mg_str d;
+  while ((d = mgos_bt_adv_index_find(&idx, 0xff, &pos)).p != NULL) n++;
+  ASSERT_EQ(n, 3);
+}
+
+static void test_malformed(void) {
+  /* Second structure overruns the buffer, zero length ends parsing. */
+  const uint8_t ad1[] = {0x02, 0x01, 0x06, 0x05, 0xff, 1};
+  const uint8_t ad2[] = {0x02, 0x01, 0x06, 0x00, 0x02, 0xff, 1};
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, mg_mk_str_n((const char *) ad1, sizeof(ad1)),
+                         mg_mk_str_n((const char *) ad2, sizeof(ad2)));
+  ASSERT_EQ(idx.num_entries, 2);
+}
+
+/* Structures near the 127 byte limit must not be confused with scan rsp. */
+static void test_offset_limit(void) {
+  uint8_t ad[130], sr[4] = {0x03, 0x08, 'x', 'y'};
+  memset(ad, 0, sizeof(ad));
+  ad[0] = 125; /* Structure of 126 bytes, next one starts at 126. */
+  ad[1] = 0xfe;
+  ad[126] = 0x01; /* Length 1: type only, data at offset 128. */
+  ad[127] = MGOS_BT_GAP_EIR_FULL_NAME;
+  struct mgos_bt_adv_index idx;
+  mgos_bt_adv_index_init(&idx, mg_mk_str_n((const char *) ad, sizeof(ad)),
+                         mg_mk_str_n((const char *) sr, sizeof(sr)));
+  /* Second structure ends past 127 bytes and is ignored. */
+  ASSERT_EQ(idx.num_entries, 2);
+  struct mg_str name = mgos_bt_adv_index_get_name(&idx);
+  ASSERT_EQ(name.len, 2);
+  ASSERT(name.p == (const char *) sr + 2);
+  /* Last structure that fits: data at offset 127. */
+  ad[0] = 124;
+  ad[125] = 0x01;
+  ad[126] = MGOS_BT_GAP_EIR_FULL_NAME;
+  mgos_bt_adv_index_init(&idx, mg_mk_str_n((const char *) ad, 127),
+                         mg_mk_str_n(NULL, 0));
+  ASSERT_EQ(idx.num_entries, 2);
+  int pos = 0;
+  struct mg_str d =
+      mgos_bt_adv_index_find(&idx, MGOS_BT_GAP_EIR_FULL_NAME, &pos);
+  ASSERT(d.p == (const char *) ad + 127);
+  ASSERT_EQ(d.len, 0);
+}
+
+/* Scans the whole buffer for each lookup, like the helpers used to. */
+static struct mg_str scan_for(struct mg_str buf, uint8_t t) {
+  const uint8_t *dp = (const uint8_t *) buf.p;
+  for (size_t i = 0; i + 1 < buf.len && dp[i] != 0;) {
+    size_t len = dp[i];
+    if (i + len + 1 > buf.len) break;
+    if (dp[i + 1] == t) return mg_mk_str_n((const char *) dp + i + 2, len - 1);
+    i += len + 1;
+  }
+  return mg_mk_str_n(NULL, 0);
+}
+
+static bool scan_has_svc16(struct mg_str buf, uint16_t u) {
+  const uint8_t ts[] = {MGOS_BT_GAP_EIR_SERVICE_16,
+                        MGOS_BT_GAP_EIR_SERVICE_16_INCOMPLETE};
+  for (size_t k = 0; k < sizeof(ts); k++) {
+    struct mg_str d = scan_for(buf, ts[k]);
+    for (size_t j = 0; j + 2 <= d.len; j += 2) {
+      if (memcmp(d.p + j, &u, 2) == 0) return true;
+    }
+  }
+  return false;
+}
+
+static volatile size_t s_sink;
+
+/* Typical gateway workload: name, two services, service and mfr data. */
+static void bench(void) {
+  const int n = 2000000;
+  double t0 = test_now();
+  for (int i = 0; i < n; i++) {
+    struct mg_str name = scan_for(RSP, MGOS_BT_GAP_EIR_FULL_NAME);
+    if (name.p == NULL) name = scan_for(ADV, MGOS_BT_GAP_EIR_FULL_NAME);
+    if (name.p == NULL) name = scan_for(ADV, MGOS_BT_GAP_EIR_SHORT_NAME);
+    bool s1 = scan_has_svc16(ADV, 0x180f) || scan_has_svc16(RSP, 0x180f);
+    bool s2 = scan_has_svc16(ADV, 0x1809) || scan_has_svc16(RSP, 0x1809);
+    struct mg_str sd = scan_for(ADV, MGOS_BT_GAP_EIR_SERVICE_DATA_16);
+    struct mg_str md =
+        scan_for(ADV, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA);
+    s_sink += name.len + s1 + s2 + sd.len + md.len;
+  }
+  double t1 = test_now();
+  struct mgos_bt_uuid u1 = uuid16(0x180f), u2 = uuid16(0x1809);
+  for (int i = 0; i < n; i++) {
+    struct mgos_bt_adv_index idx;
+    int pos = 0;
+    mgos_bt_adv_index_init(&idx, ADV, RSP);
+    struct mg_str name = mgos_bt_adv_index_get_name(&idx);
+    bool s1 = mgos_bt_adv_index_has_service(&idx, &u1);
+    bool s2 = mgos_bt_adv_index_has_service(&idx, &u2);
+    struct mg_str sd = mgos_bt_adv_index_get_service_data(&idx, &u1);
+    struct mg_str md = mgos_bt_adv_index_find(
+        &idx, MGOS_BT_GAP_EIR_MANUFACTURER_SPECIFIC_DATA, &pos);
+    s_sink += name.len + s1 + s2 + sd.len + md.len;
+  }
+  double t2 = test_now();
+  fprintf(stderr, "  bench: rescan %.1f ns/advert, index %.1f ns/advert\n",
+          (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n);
+}
+
+int main(int argc, char **argv) {
+  fprintf(stderr, "test_adv_index\n");
+  RUN_TEST(test_lookups);
+  RUN_TEST(test_repeated_types);
+  RUN_TEST(test_malformed);
+  RUN_TEST(test_offset_limit);
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) bench();
+  return 0;
+}
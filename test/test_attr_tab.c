@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Attribute handle table tests and a benchmark of table lookups against
+ * scanning every service's handles, which is what lookups used to do.
+ */
+
+#include <string.h>
+
+#include "mgos_bt_attr_tab.h"
+
+#include "test_util.h"
+
+struct entry {
+  int svc; /* 0 - no attribute. */
+  int ai;
+};
+
+static struct entry *get(struct mgos_bt_attr_tab *t, uint16_t h) {
+  return (struct entry *) mgos_bt_attr_tab_get(t, h);
+}
+
+static void test_empty(void) {
+  struct mgos_bt_attr_tab t;
+  mgos_bt_attr_tab_init(&t, sizeof(struct entry));
+  ASSERT(get(&t, 0) == NULL);
+  ASSERT(get(&t, 1) == NULL);
+  ASSERT(get(&t, 0xffff) == NULL);
+  mgos_bt_attr_tab_free(&t);
+}
+
+static void test_extend(void) {
+  struct mgos_bt_attr_tab t;
+  mgos_bt_attr_tab_init(&t, sizeof(struct entry));
+  ASSERT(mgos_bt_attr_tab_extend(&t, 40, 49));
+  ASSERT_EQ(t.start, 40);
+  ASSERT_EQ(t.len, 10);
+  ASSERT(get(&t, 39) == NULL);
+  ASSERT(get(&t, 50) == NULL);
+  for (uint16_t h = 40; h < 50; h++) {
+    ASSERT(get(&t, h) != NULL);
+    ASSERT_EQ(get(&t, h)->svc, 0);
+    get(&t, h)->svc = 1;
+    get(&t, h)->ai = h - 40;
+  }
+  /* Grow at both ends, with a gap. Existing entries are kept. */
+  ASSERT(mgos_bt_attr_tab_extend(&t, 60, 64));
+  ASSERT(mgos_bt_attr_tab_extend(&t, 20, 29));
+  ASSERT_EQ(t.start, 20);
+  ASSERT_EQ(t.len, 45);
+  for (uint16_t h = 20; h < 65; h++) {
+    struct entry *e = get(&t, h);
+    ASSERT(e != NULL);
+    if (h >= 40 && h < 50) {
+      ASSERT_EQ(e->svc, 1);
+      ASSERT_EQ(e->ai, h - 40);
+    } else {
+      ASSERT_EQ(e->svc, 0);
+    }
+  }
+  /* Already covered: no change. */
+  uint8_t *entries = t.entries;
+  ASSERT(mgos_bt_attr_tab_extend(&t, 45, 47));
+  ASSERT(t.entries == entries);
+  ASSERT(!mgos_bt_attr_tab_extend(&t, 47, 45));
+  mgos_bt_attr_tab_free(&t);
+  ASSERT(get(&t, 40) == NULL);
+}
+
+static void test_edges(void) {
+  struct mgos_bt_attr_tab t;
+  mgos_bt_attr_tab_init(&t, sizeof(struct entry));
+  /* The last possible handle must not wrap the table length. */
+  ASSERT(mgos_bt_attr_tab_extend(&t, 0xfff0, 0xffff));
+  ASSERT_EQ(t.len, 16);
+  ASSERT(get(&t, 0xffff) != NULL);
+  ASSERT(get(&t, 0xffef) == NULL);
+  ASSERT(get(&t, 0) == NULL);
+  ASSERT(mgos_bt_attr_tab_extend(&t, 1, 1));
+  ASSERT_EQ(t.start, 1);
+  ASSERT_EQ(t.len, 0xffff);
+  ASSERT(get(&t, 0) == NULL);
+  ASSERT(get(&t, 1) != NULL);
+  ASSERT(get(&t, 0xffff) != NULL);
+  mgos_bt_attr_tab_free(&t);
+}
+
+/* Services with sequentially allocated handles, as the stack does it. */
+#define BENCH_NUM_SVCS 8
+#define BENCH_NUM_ATTRS 24
+#define BENCH_FIRST_HANDLE 40
+
+struct bench_svc {
+  uint16_t handles[BENCH_NUM_ATTRS];
+};
+
+static struct bench_svc s_svcs[BENCH_NUM_SVCS];
+
+/* The old lookup: walk all services and their attributes. */
+static int scan_lookup(uint16_t h, int *ai) {
+  for (int s = 0; s < BENCH_NUM_SVCS; s++) {
+    for (int i = 0; i < BENCH_NUM_ATTRS; i++) {
+      if (s_svcs[s].handles[i] == h) {
+        *ai = i;
+        return s + 1;
+      }
+    }
+  }
+  return 0;
+}
+
+static void bench(void) {
+  struct mgos_bt_attr_tab t;
+  const int num_lookups = 10000000;
+  uint16_t handles[1024];
+  uint32_t st = 1;
+  long sum1 = 0, sum2 = 0;
+  mgos_bt_attr_tab_init(&t, sizeof(struct entry));
+  uint16_t h = BENCH_FIRST_HANDLE;
+  for (int s = 0; s < BENCH_NUM_SVCS; s++) {
+    for (int i = 0; i < BENCH_NUM_ATTRS; i++) s_svcs[s].handles[i] = h++;
+    ASSERT(mgos_bt_attr_tab_extend(&t, s_svcs[s].handles[0], h - 1));
+    for (int i = 0; i < BENCH_NUM_ATTRS; i++) {
+      struct entry *e = get(&t, s_svcs[s].handles[i]);
+      e->svc = s + 1;
+      e->ai = i;
+    }
+  }
+  for (int i = 0; i < 1024; i++) {
+    handles[i] = BENCH_FIRST_HANDLE +
+                 test_rand(&st) % (BENCH_NUM_SVCS * BENCH_NUM_ATTRS);
+  }
+  double start = test_now();
+  for (int i = 0; i < num_lookups; i++) {
+    struct entry *e = get(&t, handles[i & 1023]);
+    sum1 += e->svc + e->ai;
+  }
+  double tab_ns = (test_now() - start) * 1e9 / num_lookups;
+  start = test_now();
+  for (int i = 0; i < num_lookups; i++) {
+    int ai = 0;
+    sum2 += scan_lookup(handles[i & 1023], &ai) + ai;
+  }
+  double scan_ns = (test_now() - start) * 1e9 / num_lookups;
+  ASSERT_EQ(sum1, sum2);
+  fprintf(stderr,
+          "  bench: %d services x %d attrs: table %.1f ns, scan %.1f ns per "
+          "lookup\n",
+          BENCH_NUM_SVCS, BENCH_NUM_ATTRS, tab_ns, scan_ns);
+  mgos_bt_attr_tab_free(&t);
+}
+
+int main(int argc, char **argv) {
+  fprintf(stderr, "test_attr_tab\n");
+  RUN_TEST(test_empty);
+  RUN_TEST(test_extend);
+  RUN_TEST(test_edges);
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) bench();
+  return 0;
+}
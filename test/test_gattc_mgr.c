@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Connection manager tests: link accounting against max_links. The GATTC
+ * client is faked: connects are recorded and their outcome is reported by
+ * the test, the same way the client reports it with events.
+ */
+
+#include <string.h>
+
+#include "mgos_bt_gattc.h"
+#include "mgos_bt_gattc_mgr.h"
+#include "mgos_sys_config.h"
+#include "mgos_timers.h"
+
+#include "test_util.h"
+
+#define CONNECT_TIMEOUT_MS 10000
+
+static int64_t s_now_us = 1;
+static timer_callback s_tick_cb = NULL;
+static mgos_event_handler_t s_ev_cb = NULL;
+/* Connects issued and cancels requested, by the last byte of the address. */
+static int s_num_connects[4], s_num_cancels[4];
+static int s_num_cb_connects = 0, s_num_cb_disconnects = 0;
+/* Live connections of the client, by conn_id. */
+static struct mgos_bt_gatt_conn s_conns[4];
+static bool s_conn_live[4];
+
+int64_t mgos_uptime_micros(void) {
+  return s_now_us;
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb,
+                             void *cb_arg) {
+  s_tick_cb = cb;
+  (void) msecs;
+  (void) flags;
+  (void) cb_arg;
+  return 1;
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  (void) id;
+}
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata) {
+  s_ev_cb = cb;
+  (void) ev;
+  (void) userdata;
+  return true;
+}
+
+int mgos_sys_config_get_bt_gattc_max_links(void) {
+  return 1;
+}
+
+int mgos_sys_config_get_bt_gattc_connect_timeout_ms(void) {
+  return CONNECT_TIMEOUT_MS;
+}
+
+int mgos_sys_config_get_bt_gattc_reconnect_min_ms(void) {
+  return 1000;
+}
+
+int mgos_sys_config_get_bt_gattc_reconnect_max_ms(void) {
+  return 60000;
+}
+
+const char *mgos_bt_addr_to_str(const struct mgos_bt_addr *addr, uint32_t flags,
+                                char *out) {
+  sprintf(out, "%02x", addr->addr[5]);
+  (void) flags;
+  return out;
+}
+
+int mgos_bt_addr_cmp(const struct mgos_bt_addr *a,
+                     const struct mgos_bt_addr *b) {
+  return memcmp(a->addr, b->addr, sizeof(b->addr));
+}
+
+bool mgos_bt_gattc_connect_opts(const struct mgos_bt_addr *addr,
+                                const struct mgos_bt_gattc_conn_params *cp) {
+  s_num_connects[addr->addr[5]]++;
+  (void) cp;
+  return true;
+}
+
+/* Always issued by the time it is cancelled: the outcome follows. */
+bool mgos_bt_gattc_connect_cancel(const struct mgos_bt_addr *addr) {
+  s_num_cancels[addr->addr[5]]++;
+  return false;
+}
+
+bool mgos_bt_gattc_disconnect(int conn_id) {
+  (void) conn_id;
+  return true;
+}
+
+bool mgos_bt_gattc_get_conn(int conn_id, struct mgos_bt_gatt_conn *conn) {
+  if (conn_id < 0 || !s_conn_live[conn_id]) return false;
+  *conn = s_conns[conn_id];
+  return true;
+}
+
+bool mgos_bt_gattc_get_conn_params(int conn_id,
+                                   struct mgos_bt_gattc_conn_params *cp) {
+  (void) conn_id;
+  (void) cp;
+  return false;
+}
+
+static struct mgos_bt_addr mk_addr(uint8_t n) {
+  struct mgos_bt_addr addr = {.addr = {1, 2, 3, 4, 5, n},
+                              .type = MGOS_BT_ADDR_TYPE_PUBLIC};
+  return addr;
+}
+
+static void peer_cb(const struct mgos_bt_gatt_conn *conn, bool connected,
+                    void *cb_arg) {
+  if (connected) {
+    s_num_cb_connects++;
+  } else {
+    s_num_cb_disconnects++;
+  }
+  (void) conn;
+  (void) cb_arg;
+}
+
+static void add_peer(uint8_t n) {
+  struct mgos_bt_addr addr = mk_addr(n);
+  struct mgos_bt_gattc_mgr_peer_opts opts = {.cb = peer_cb};
+  ASSERT(mgos_bt_gattc_mgr_add_peer(&addr, &opts));
+}
+
+static void remove_peer(uint8_t n) {
+  struct mgos_bt_addr addr = mk_addr(n);
+  ASSERT(mgos_bt_gattc_mgr_remove_peer(&addr));
+}
+
+static void advance(int ms) {
+  s_now_us += ms * 1000LL;
+  s_tick_cb(NULL);
+}
+
+/* Reports a connection event the way the client does. */
+static void ev(int ev, uint8_t n, int conn_id) {
+  struct mgos_bt_gatt_conn c = {.addr = mk_addr(n), .conn_id = conn_id};
+  if (conn_id >= 0) {
+    s_conns[conn_id] = c;
+    s_conn_live[conn_id] = (ev == MGOS_BT_GATTC_EV_CONNECT);
+  }
+  s_ev_cb(ev, &c, NULL);
+}
+
+static int num_links(void) {
+  struct mgos_bt_gattc_mgr_stats stats;
+  mgos_bt_gattc_mgr_get_stats(&stats);
+  return stats.num_links;
+}
+
+static void reset(void) {
+  memset(s_num_connects, 0, sizeof(s_num_connects));
+  memset(s_num_cancels, 0, sizeof(s_num_cancels));
+  s_num_cb_connects = s_num_cb_disconnects = 0;
+}
+
+static void test_failure_frees_link(void) {
+  reset();
+  add_peer(1);
+  add_peer(2);
+  advance(0);
+  ASSERT_EQ(s_num_connects[1] + s_num_connects[2], 1);
+  uint8_t first = (s_num_connects[1] ? 1 : 2), second = 3 - first;
+  /* Reported failure frees the link at once, not at connect_timeout_ms. */
+  advance(100);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, first, -1);
+  ASSERT_EQ(s_num_connects[second], 1);
+  ASSERT_EQ(s_num_cancels[first], 0);
+  ASSERT_EQ(num_links(), 1);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, second, -1);
+  ASSERT_EQ(num_links(), 0);
+  remove_peer(1);
+  remove_peer(2);
+  ASSERT_EQ(num_links(), 0);
+}
+
+static void test_cancel_holds_link(void) {
+  reset();
+  add_peer(1);
+  advance(0);
+  ASSERT_EQ(s_num_connects[1], 1);
+  add_peer(2);
+  /* Timed out: cancelled, but the link is held until the outcome. */
+  advance(CONNECT_TIMEOUT_MS);
+  ASSERT_EQ(s_num_cancels[1], 1);
+  ASSERT_EQ(num_links(), 1);
+  advance(1000);
+  ASSERT_EQ(s_num_connects[2], 0);
+  /* Cancel completes with the failure event, next peer goes at once. */
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 1, -1);
+  ASSERT_EQ(s_num_connects[2], 1);
+  ASSERT_EQ(num_links(), 1);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 2, -1);
+  remove_peer(1);
+  remove_peer(2);
+  ASSERT_EQ(num_links(), 0);
+}
+
+static void test_cancel_late_open(void) {
+  reset();
+  add_peer(1);
+  advance(0);
+  add_peer(2);
+  advance(CONNECT_TIMEOUT_MS);
+  /* Opened anyway: not reported, held until the client closes it. */
+  ev(MGOS_BT_GATTC_EV_CONNECT, 1, 0);
+  ASSERT_EQ(s_num_cb_connects, 0);
+  ASSERT_EQ(num_links(), 1);
+  ASSERT_EQ(s_num_connects[2], 0);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 1, 0);
+  ASSERT_EQ(s_num_cb_disconnects, 0);
+  ASSERT_EQ(s_num_connects[2], 1);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 2, -1);
+  remove_peer(1);
+  remove_peer(2);
+  ASSERT_EQ(num_links(), 0);
+}
+
+static void test_remove_while_connecting(void) {
+  reset();
+  add_peer(1);
+  advance(0);
+  add_peer(2);
+  remove_peer(1);
+  ASSERT_EQ(s_num_cancels[1], 1);
+  ASSERT_EQ(num_links(), 1);
+  advance(1000);
+  ASSERT_EQ(s_num_connects[2], 0);
+  /* Removed peer goes away once the attempt ends. */
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 1, -1);
+  ASSERT_EQ(s_num_connects[2], 1);
+  ASSERT_EQ(s_num_connects[1], 1);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 2, -1);
+  remove_peer(2);
+  ASSERT_EQ(num_links(), 0);
+}
+
+static void test_cancel_backstop(void) {
+  reset();
+  add_peer(1);
+  advance(0);
+  add_peer(2);
+  advance(CONNECT_TIMEOUT_MS);
+  /* Outcome is never reported: link is freed after the client's limit. */
+  advance(MGOS_BT_GATTC_MAX_CONNECT_TIME_MS - 1000);
+  ASSERT_EQ(s_num_connects[2], 0);
+  advance(1000);
+  ASSERT_EQ(s_num_connects[2], 1);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 2, -1);
+  remove_peer(1);
+  remove_peer(2);
+  ASSERT_EQ(num_links(), 0);
+}
+
+static void test_lost_disconnect(void) {
+  reset();
+  add_peer(1);
+  advance(0);
+  ev(MGOS_BT_GATTC_EV_CONNECT, 1, 0);
+  ASSERT_EQ(s_num_cb_connects, 1);
+  advance(1000);
+  ASSERT_EQ(num_links(), 1);
+  /* Connection is gone but the event was lost: noticed on the next tick. */
+  s_conn_live[0] = false;
+  advance(250);
+  ASSERT_EQ(s_num_cb_disconnects, 1);
+  ASSERT_EQ(num_links(), 0);
+  /* Reconnected after the backoff; the late event is stale, ignored. */
+  advance(1000);
+  ASSERT_EQ(s_num_connects[1], 2);
+  ev(MGOS_BT_GATTC_EV_DISCONNECT, 1, 0);
+  ASSERT_EQ(s_num_cb_disconnects, 1);
+  ASSERT_EQ(num_links(), 1);
+  /* Same conn_id reused by another peer does not count as alive. */
+  ev(MGOS_BT_GATTC_EV_CONNECT, 1, 1);
+  ASSERT_EQ(s_num_cb_connects, 2);
+  s_conns[1].addr = mk_addr(2);
+  advance(250);
+  ASSERT_EQ(s_num_cb_disconnects, 2);
+  s_conn_live[1] = false;
+  remove_peer(1);
+  ASSERT_EQ(num_links(), 0);
+}
+
+int main(void) {
+  fprintf(stderr, "test_gattc_mgr\n");
+  RUN_TEST(test_failure_frees_link);
+  RUN_TEST(test_cancel_holds_link);
+  RUN_TEST(test_cancel_late_open);
+  RUN_TEST(test_remove_while_connecting);
+  RUN_TEST(test_cancel_backstop);
+  RUN_TEST(test_lost_disconnect);
+  return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Notification queue tests: per-qmode behavior when the queue is full,
+ * memory bounds and values longer than the MTU allows. Buffers are owned
+ * (free_cb), so the number of live buffers is known exactly and a dropped
+ * value must be released at once.
+ */
+
+#include <string.h>
+
+#include "mgos_bt_notify_queue.h"
+
+#include "test_util.h"
+
+#define MAX_LEN 8
+
+static int s_num_live = 0;
+
+static void buf_free(void *data, void *arg) {
+  s_num_live--;
+  free(data);
+  (void) arg;
+}
+
+/* Returns a buffer holding the value v. */
+static struct mgos_bt_notify_buf *new_buf(uint32_t v) {
+  uint32_t *p = (uint32_t *) malloc(sizeof(v));
+  *p = v;
+  s_num_live++;
+  return mgos_bt_notify_buf_new(mg_mk_str_n((const char *) p, sizeof(v)),
+                                buf_free, NULL);
+}
+
+/* Pushes a value, dropping the caller's reference as the library does. */
+static bool push(struct mgos_bt_notify_queue *q, uint16_t handle,
+                 enum mgos_bt_gatts_notify_qmode qmode, uint32_t v) {
+  struct mgos_bt_notify_buf *nb = new_buf(v);
+  bool res = mgos_bt_notify_queue_push(q, handle, false, qmode, MAX_LEN, nb);
+  mgos_bt_notify_buf_unref(nb);
+  return res;
+}
+
+/* Pops the head and checks it against handle and value. */
+static void pop_check(struct mgos_bt_notify_queue *q, uint16_t handle,
+                      uint32_t v) {
+  uint32_t qv;
+  struct mgos_bt_notify_entry *e = mgos_bt_notify_queue_pop(q);
+  ASSERT(e != NULL);
+  ASSERT_EQ(e->handle, handle);
+  ASSERT_EQ(e->buf->data.len, sizeof(qv));
+  memcpy(&qv, e->buf->data.p, sizeof(qv));
+  ASSERT_EQ(qv, v);
+  mgos_bt_notify_entry_free(e);
+}
+
+static void check_bounded(const struct mgos_bt_notify_queue *q) {
+  ASSERT(q->len <= MAX_LEN);
+  ASSERT_EQ(s_num_live, q->len);
+}
+
+static void test_all(void) {
+  struct mgos_bt_notify_queue q;
+  mgos_bt_notify_queue_init(&q);
+  for (uint32_t i = 0; i < 1000; i++) {
+    ASSERT_EQ(push(&q, 10, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, i), i < MAX_LEN);
+    check_bounded(&q);
+  }
+  ASSERT_EQ(q.num_dropped, 1000 - MAX_LEN);
+  /* The oldest values are kept, new ones are rejected. */
+  for (uint32_t i = 0; i < MAX_LEN; i++) pop_check(&q, 10, i);
+  ASSERT(mgos_bt_notify_queue_pop(&q) == NULL);
+  check_bounded(&q);
+}
+
+static void test_latest(void) {
+  struct mgos_bt_notify_queue q;
+  mgos_bt_notify_queue_init(&q);
+  /* One entry per handle, regardless of how many values are pushed. */
+  for (uint32_t i = 0; i < 1000; i++) {
+    ASSERT(push(&q, 10 + i % 3, MGOS_BT_GATTS_NOTIFY_QMODE_LATEST, i));
+    check_bounded(&q);
+    ASSERT(q.len <= 3);
+  }
+  ASSERT_EQ(q.num_dropped, 1000 - 3);
+  /* Positions are kept, values are the latest. */
+  pop_check(&q, 10, 999);
+  pop_check(&q, 11, 997);
+  pop_check(&q, 12, 998);
+  /* A full queue of other handles still rejects a new handle. */
+  for (uint32_t i = 0; i < MAX_LEN; i++) {
+    ASSERT(push(&q, 100 + i, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, i));
+  }
+  ASSERT(!push(&q, 10, MGOS_BT_GATTS_NOTIFY_QMODE_LATEST, 1));
+  /* But a queued handle is replaced even when full. */
+  ASSERT(push(&q, 100, MGOS_BT_GATTS_NOTIFY_QMODE_LATEST, 42));
+  check_bounded(&q);
+  pop_check(&q, 100, 42);
+  mgos_bt_notify_queue_clear(&q);
+  ASSERT_EQ(q.len, 0);
+  check_bounded(&q);
+}
+
+static void test_drop_oldest(void) {
+  struct mgos_bt_notify_queue q;
+  mgos_bt_notify_queue_init(&q);
+  /* Values of other handles are never dropped to make room. */
+  ASSERT(push(&q, 1, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, 1));
+  ASSERT(push(&q, 2, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, 2));
+  for (uint32_t i = 0; i < 1000; i++) {
+    ASSERT(push(&q, 10, MGOS_BT_GATTS_NOTIFY_QMODE_DROP_OLDEST, i));
+    check_bounded(&q);
+  }
+  ASSERT_EQ(q.len, MAX_LEN);
+  ASSERT_EQ(q.num_dropped, 1000 - (MAX_LEN - 2));
+  pop_check(&q, 1, 1);
+  pop_check(&q, 2, 2);
+  /* The newest values of the handle remain, in order. */
+  for (uint32_t i = 1000 - (MAX_LEN - 2); i < 1000; i++) pop_check(&q, 10, i);
+  /* Full of other handles: nothing of its own to drop, rejected. */
+  for (uint32_t i = 0; i < MAX_LEN; i++) {
+    ASSERT(push(&q, 100 + i, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, i));
+  }
+  ASSERT(!push(&q, 10, MGOS_BT_GATTS_NOTIFY_QMODE_DROP_OLDEST, 1));
+  check_bounded(&q);
+  mgos_bt_notify_queue_clear(&q);
+  check_bounded(&q);
+}
+
+static void test_indications_separate(void) {
+  struct mgos_bt_notify_queue q;
+  mgos_bt_notify_queue_init(&q);
+  /* Notifications and indications of the same handle are not merged. */
+  struct mgos_bt_notify_buf *nb = new_buf(1);
+  ASSERT(mgos_bt_notify_queue_push(&q, 10, true,
+                                   MGOS_BT_GATTS_NOTIFY_QMODE_LATEST, MAX_LEN,
+                                   nb));
+  mgos_bt_notify_buf_unref(nb);
+  ASSERT(push(&q, 10, MGOS_BT_GATTS_NOTIFY_QMODE_LATEST, 2));
+  ASSERT_EQ(q.len, 2);
+  struct mgos_bt_notify_entry *e = mgos_bt_notify_queue_pop(&q);
+  ASSERT(e->need_confirm);
+  mgos_bt_notify_entry_free(e);
+  pop_check(&q, 10, 2);
+  check_bounded(&q);
+}
+
+static void test_shared_buf(void) {
+  /* A broadcast buffer queued to several connections, freed by the last. */
+  struct mgos_bt_notify_queue q1, q2;
+  mgos_bt_notify_queue_init(&q1);
+  mgos_bt_notify_queue_init(&q2);
+  struct mgos_bt_notify_buf *nb = new_buf(7);
+  ASSERT(mgos_bt_notify_queue_push(
+      &q1, 10, false, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, MAX_LEN, nb));
+  ASSERT(mgos_bt_notify_queue_push(
+      &q2, 10, false, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, MAX_LEN, nb));
+  mgos_bt_notify_buf_unref(nb);
+  ASSERT_EQ(s_num_live, 1);
+  mgos_bt_notify_queue_clear(&q1);
+  ASSERT_EQ(s_num_live, 1);
+  pop_check(&q2, 10, 7);
+  ASSERT_EQ(s_num_live, 0);
+}
+
+static void test_long_value(void) {
+  /* Longer than any notification: each connection gets what fits. */
+  char v[300];
+  for (size_t i = 0; i < sizeof(v); i++) v[i] = (char) i;
+  struct mgos_bt_notify_queue q1, q2;
+  mgos_bt_notify_queue_init(&q1);
+  mgos_bt_notify_queue_init(&q2);
+  struct mgos_bt_notify_buf *nb =
+      mgos_bt_notify_buf_new(mg_mk_str_n(v, sizeof(v)), NULL, NULL);
+  ASSERT(mgos_bt_notify_queue_push(
+      &q1, 10, false, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, MAX_LEN, nb));
+  ASSERT(mgos_bt_notify_queue_push(
+      &q2, 10, false, MGOS_BT_GATTS_NOTIFY_QMODE_ALL, MAX_LEN, nb));
+  mgos_bt_notify_buf_unref(nb);
+  struct mgos_bt_notify_entry *e1 = mgos_bt_notify_queue_pop(&q1);
+  struct mgos_bt_notify_entry *e2 = mgos_bt_notify_queue_pop(&q2);
+  struct mg_str d1 = mgos_bt_notify_entry_data(e1, 23);
+  struct mg_str d2 = mgos_bt_notify_entry_data(e2, 247);
+  ASSERT_EQ(d1.len, 20);
+  ASSERT_EQ(d2.len, 244);
+  ASSERT(memcmp(d1.p, v, d1.len) == 0);
+  ASSERT(memcmp(d2.p, v, d2.len) == 0);
+  /* The stored value stays whole, for long reads. */
+  ASSERT_EQ(e1->buf->data.len, sizeof(v));
+  /* Values that fit are sent as is. */
+  ASSERT_EQ(mgos_bt_notify_entry_data(e1, 512).len, sizeof(v));
+  ASSERT_EQ(mgos_bt_notify_entry_data(e1, 303).len, sizeof(v));
+  ASSERT_EQ(mgos_bt_notify_entry_data(e1, 302).len, sizeof(v) - 1);
+  mgos_bt_notify_entry_free(e1);
+  mgos_bt_notify_entry_free(e2);
+}
+
+int main(void) {
+  fprintf(stderr, "test_notify_queue\n");
+  RUN_TEST(test_all);
+  RUN_TEST(test_latest);
+  RUN_TEST(test_drop_oldest);
+  RUN_TEST(test_indications_separate);
+  RUN_TEST(test_shared_buf);
+  RUN_TEST(test_long_value);
+  return 0;
+}
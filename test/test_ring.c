@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Ring buffer tests: wraparound, full ring rejection, usage limits, no
+ * allocations on the push/pop path, and a two-thread producer/consumer
+ * stress test.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include "mgos_bt_ring.h"
+
+#include "test_util.h"
+
+/*
+ * Allocation counting, via -Wl,--wrap (see Makefile). Only calls made from
+ * the test and the ring code are seen, not those internal to libc.
+ * Volatile because the compiler assumes malloc() does not touch globals.
+ */
+static volatile int s_count_allocs = 0;
+static volatile int s_num_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  if (s_count_allocs) __atomic_add_fetch(&s_num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  if (s_count_allocs) __atomic_add_fetch(&s_num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  if (s_count_allocs) __atomic_add_fetch(&s_num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, size);
+}
+
+/* Records carry a sequence number and a pattern derived from it. */
+static size_t rec_len(uint32_t seq, size_t max_len) {
+  uint32_t st = seq * 2654435761u + 1;
+  return sizeof(uint32_t) + test_rand(&st) % (max_len - sizeof(uint32_t) + 1);
+}
+
+static void rec_fill(uint8_t *p, uint32_t seq, size_t len) {
+  memcpy(p, &seq, sizeof(seq));
+  for (size_t i = sizeof(seq); i < len; i++) p[i] = (uint8_t) (seq + i);
+}
+
+static void rec_check(const uint8_t *p, size_t len, uint32_t seq,
+                      size_t max_len) {
+  uint32_t rseq;
+  ASSERT_EQ(len, rec_len(seq, max_len));
+  memcpy(&rseq, p, sizeof(rseq));
+  ASSERT_EQ(rseq, seq);
+  for (size_t i = sizeof(seq); i < len; i++) {
+    ASSERT_EQ(p[i], (uint8_t) (seq + i));
+  }
+}
+
+static bool push(struct mgos_bt_ring *r, uint32_t seq, size_t max_len) {
+  size_t len = rec_len(seq, max_len);
+  uint8_t *p = (uint8_t *) mgos_bt_ring_reserve(r, len);
+  if (p == NULL) return false;
+  rec_fill(p, seq, len);
+  mgos_bt_ring_commit(r);
+  return true;
+}
+
+static bool pop(struct mgos_bt_ring *r, uint32_t seq, size_t max_len) {
+  size_t len = 0;
+  uint8_t *p = (uint8_t *) mgos_bt_ring_peek(r, &len);
+  if (p == NULL) return false;
+  rec_check(p, len, seq, max_len);
+  mgos_bt_ring_consume(r);
+  return true;
+}
+
+static void test_alloc_counting(void) {
+  s_num_allocs = 0;
+  s_count_allocs = 1;
+  void *volatile p = malloc(1);
+  free(p);
+  s_count_allocs = 0;
+  ASSERT_EQ(s_num_allocs, 1);
+}
+
+static void test_empty(void) {
+  uint32_t buf[16];
+  struct mgos_bt_ring r;
+  size_t len = 123;
+  mgos_bt_ring_init(&r, buf, sizeof(buf));
+  ASSERT(mgos_bt_ring_peek(&r, &len) == NULL);
+  ASSERT_EQ(len, 123);
+  /* Zero-length records are valid. */
+  ASSERT(mgos_bt_ring_reserve(&r, 0) != NULL);
+  mgos_bt_ring_commit(&r);
+  ASSERT(mgos_bt_ring_peek(&r, &len) != NULL);
+  ASSERT_EQ(len, 0);
+  mgos_bt_ring_consume(&r);
+  ASSERT(mgos_bt_ring_peek(&r, NULL) == NULL);
+}
+
+static void test_full(void) {
+  uint32_t buf[64];
+  struct mgos_bt_ring r;
+  struct mgos_bt_ring_stats st;
+  mgos_bt_ring_init(&r, buf, sizeof(buf));
+  uint32_t n = 0;
+  while (push(&r, n, 16)) n++;
+  ASSERT(n > 0);
+  mgos_bt_ring_get_stats(&r, &st);
+  ASSERT_EQ(st.num_pushed, n);
+  ASSERT_EQ(st.num_dropped, 1);
+  ASSERT(st.used < st.size);
+  ASSERT_EQ(st.high_water, st.used);
+  /* Rejection does not disturb the contents. */
+  ASSERT(!push(&r, n, 16));
+  ASSERT(mgos_bt_ring_reserve(&r, sizeof(buf)) == NULL);
+  mgos_bt_ring_get_stats(&r, &st);
+  ASSERT_EQ(st.num_dropped, 3);
+  /* A record larger than the whole ring never fits, even when empty. */
+  for (uint32_t i = 0; i < n; i++) ASSERT(pop(&r, i, 16));
+  ASSERT(mgos_bt_ring_peek(&r, NULL) == NULL);
+  ASSERT(mgos_bt_ring_reserve(&r, sizeof(buf)) == NULL);
+  /* Freeing space makes room again. */
+  ASSERT(push(&r, n, 16));
+  ASSERT(pop(&r, n, 16));
+}
+
+static void test_reserve_max(void) {
+  /* Bulk records stop at the limit, the rest of the ring stays usable. */
+  uint32_t buf[64];
+  struct mgos_bt_ring r;
+  struct mgos_bt_ring_stats st;
+  size_t limit = sizeof(buf) * 3 / 4;
+  mgos_bt_ring_init(&r, buf, sizeof(buf));
+  uint32_t n = 0;
+  void *p;
+  while ((p = mgos_bt_ring_reserve_max(&r, 12, limit)) != NULL) {
+    mgos_bt_ring_commit(&r);
+    n++;
+  }
+  mgos_bt_ring_get_stats(&r, &st);
+  ASSERT(n > 0);
+  ASSERT(st.used <= limit);
+  ASSERT(st.used + 16 > limit);
+  ASSERT_EQ(st.num_dropped, 1);
+  /* Unlimited reservations still fit. */
+  uint32_t m = 0;
+  while (push(&r, m, 12)) m++;
+  ASSERT(m >= (sizeof(buf) - limit) / 16 - 1);
+  for (uint32_t i = 0; i < n; i++) {
+    ASSERT(mgos_bt_ring_peek(&r, NULL) != NULL);
+    mgos_bt_ring_consume(&r);
+  }
+  for (uint32_t i = 0; i < m; i++) ASSERT(pop(&r, i, 12));
+  ASSERT(mgos_bt_ring_peek(&r, NULL) == NULL);
+}
+
+static void test_wraparound(void) {
+  /* Odd-sized records in a small ring hit every wrap case. */
+  uint32_t buf[25];
+  struct mgos_bt_ring r;
+  struct mgos_bt_ring_stats st;
+  mgos_bt_ring_init(&r, buf, sizeof(buf));
+  uint32_t pushed = 0, popped = 0, num_wraps = 0, prev_head = 0;
+  uint32_t st_rand = 1;
+  for (int i = 0; i < 100000; i++) {
+    /* Random mix of pushes and pops, keeping the ring mostly full. */
+    if (test_rand(&st_rand) % 3 != 0) {
+      if (push(&r, pushed, 30)) pushed++;
+    } else if (pop(&r, popped, 30)) {
+      popped++;
+    } else {
+      ASSERT_EQ(popped, pushed);
+    }
+    if (r.head < prev_head) num_wraps++;
+    prev_head = r.head;
+    mgos_bt_ring_get_stats(&r, &st);
+    ASSERT(st.used < st.size);
+  }
+  while (pop(&r, popped, 30)) popped++;
+  ASSERT_EQ(popped, pushed);
+  ASSERT(num_wraps > 1000);
+  mgos_bt_ring_get_stats(&r, &st);
+  ASSERT_EQ(st.used, 0);
+  ASSERT_EQ(st.num_pushed, pushed);
+  ASSERT(st.num_dropped > 0);
+}
+
+#define STRESS_NUM_RECS 2000000
+#define STRESS_MAX_LEN 64
+
+struct stress_ctx {
+  struct mgos_bt_ring r;
+  uint32_t buf[256];
+  uint32_t num_full;
+};
+
+static void *stress_producer(void *arg) {
+  struct stress_ctx *ctx = (struct stress_ctx *) arg;
+  for (uint32_t seq = 0; seq < STRESS_NUM_RECS; seq++) {
+    while (!push(&ctx->r, seq, STRESS_MAX_LEN)) {
+      ctx->num_full++;
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+static void *stress_consumer(void *arg) {
+  struct stress_ctx *ctx = (struct stress_ctx *) arg;
+  for (uint32_t seq = 0; seq < STRESS_NUM_RECS; seq++) {
+    while (!pop(&ctx->r, seq, STRESS_MAX_LEN)) sched_yield();
+  }
+  return NULL;
+}
+
+static void test_stress(void) {
+  static struct stress_ctx ctx;
+  struct mgos_bt_ring_stats st;
+  pthread_t pt, ct;
+  mgos_bt_ring_init(&ctx.r, ctx.buf, sizeof(ctx.buf));
+  double start = test_now();
+  s_num_allocs = 0;
+  s_count_allocs = 1;
+  ASSERT_EQ(pthread_create(&ct, NULL, stress_consumer, &ctx), 0);
+  ASSERT_EQ(pthread_create(&pt, NULL, stress_producer, &ctx), 0);
+  pthread_join(pt, NULL);
+  pthread_join(ct, NULL);
+  s_count_allocs = 0;
+  double elapsed = test_now() - start;
+  mgos_bt_ring_get_stats(&ctx.r, &st);
+  ASSERT_EQ(st.used, 0);
+  ASSERT_EQ(st.num_pushed, STRESS_NUM_RECS);
+  ASSERT_EQ(st.num_dropped, ctx.num_full);
+  ASSERT(st.high_water < st.size);
+  ASSERT_EQ(s_num_allocs, 0);
+  fprintf(stderr, "    %d records in %.2f s, %u full, high water %u/%u\n",
+          STRESS_NUM_RECS, elapsed, (unsigned) ctx.num_full,
+          (unsigned) st.high_water, (unsigned) st.size);
+}
+
+int main(void) {
+  fprintf(stderr, "test_ring\n");
+  RUN_TEST(test_alloc_counting);
+  RUN_TEST(test_empty);
+  RUN_TEST(test_full);
+  RUN_TEST(test_reserve_max);
+  RUN_TEST(test_wraparound);
+  RUN_TEST(test_stress);
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ASSERT(cond)                                                  \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stderr, "%s:%d: ASSERT(%s) failed\n", __FILE__, __LINE__, \
+              #cond);                                                 \
+      abort();                                                        \
+    }                                                                 \
+  } while (0)
+
+#define ASSERT_EQ(a, b)                                                  \
+  do {                                                                   \
+    long long a_ = (long long) (a), b_ = (long long) (b);                \
+    if (a_ != b_) {                                                      \
+      fprintf(stderr, "%s:%d: ASSERT_EQ(%s, %s) failed: %lld != %lld\n", \
+              __FILE__, __LINE__, #a, #b, a_, b_);                       \
+      abort();                                                           \
+    }                                                                    \
+  } while (0)
+
+#define RUN_TEST(fn)                 \
+  do {                               \
+    fprintf(stderr, "  %s\n", #fn); \
+    fn();                            \
+  } while (0)
+
+static inline double test_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Deterministic PRNG (xorshift32), so failures are reproducible. */
+static inline uint32_t test_rand(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return (*state = x);
+}